@@ -1,193 +1,597 @@
 //#define SYNCOPE_DETECT_DEADLOCKS
 #include <syncope.hpp>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
 #include <thread>
 #include <vector>
-#include <pthread.h>
-#include <boost/timer.hpp>
-#include <google/profiler.h>
-#include <random>
-
-using namespace std;
-
-syncope::SymmetricLockLayer ll0(STATIC_STRING("ll0"));
-syncope::SymmetricLockLayer ll1(STATIC_STRING("ll1"));
-syncope::SymmetricLockLayer ll2(STATIC_STRING("ll2"));
-syncope::SymmetricLockLayer ll3(STATIC_STRING("ll3"));
-syncope::SymmetricLockLayer ll4(STATIC_STRING("ll4"));
-syncope::SymmetricLockLayer ll5(STATIC_STRING("ll5"));
-syncope::SymmetricLockLayer ll6(STATIC_STRING("ll6"));
-syncope::SymmetricLockLayer ll7(STATIC_STRING("ll7"));
-syncope::SymmetricLockLayer ll8(STATIC_STRING("ll8"));
-syncope::SymmetricLockLayer ll9(STATIC_STRING("ll9"));
-syncope::SymmetricLockLayer llA(STATIC_STRING("llA"));
-syncope::SymmetricLockLayer llB(STATIC_STRING("llB"));
-syncope::SymmetricLockLayer llC(STATIC_STRING("llC"));
-syncope::SymmetricLockLayer llD(STATIC_STRING("llD"));
-syncope::SymmetricLockLayer llE(STATIC_STRING("llE"));
-syncope::SymmetricLockLayer llF(STATIC_STRING("llF"));
-
-void perftest() {
-    for (int i = 0; i < 1000000; i++) {
-        SYNCOPE_LOCK(ll0, &i);
-        SYNCOPE_LOCK(ll1, &i);
-        SYNCOPE_LOCK(ll2, &i);
-        SYNCOPE_LOCK(ll3, &i);
-        SYNCOPE_LOCK(ll4, &i);
-        SYNCOPE_LOCK(ll5, &i);
-        SYNCOPE_LOCK(ll6, &i);
-        SYNCOPE_LOCK(ll7, &i);
-        SYNCOPE_LOCK(ll8, &i);
-        SYNCOPE_LOCK(ll9, &i);
-        SYNCOPE_LOCK(llA, &i);
-        SYNCOPE_LOCK(llB, &i);
-        SYNCOPE_LOCK(llC, &i);
-        SYNCOPE_LOCK(llD, &i);
-        SYNCOPE_LOCK(llE, &i);
-        SYNCOPE_LOCK(llF, &i);
+
+/** Syncope benchmark.
+  * Every run starts `threads` workers that lock random objects (out of `objects`)
+  * for reading or writing (with probability `write_ratio`) and spin `cs`
+  * iterations inside the critical section. Results are printed as CSV or JSON.
+  * Stripe count is fixed at compile time (SYNCOPE_NUM_LOCKS), build script
+  * produces one executable for every stripe count.
+  */
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+//! Value is atomic (relaxed) because optimistic readers can race with writers
+struct Object {
+    std::atomic<uint64_t> value;
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+
+    Object() : value{0u} {}
+};
+
+struct Config {
+    std::string lock;
+    int threads;
+    double write_ratio;
+    int objects;
+    int cs;
+};
+
+struct Options {
+    std::vector<std::string> locks;
+    std::vector<int> threads;
+    std::vector<double> write_ratios;
+    std::vector<int> objects;
+    std::vector<int> cs;
+    int duration_ms;
+    int sample;
+    bool json;
+
+    Options()
+        : locks{"symmetric", "asymmetric", "percpu", "writer_pref", "biased", "optimistic", "combining", "mutex", "shared_timed_mutex", "pthread_rwlock"}
+        , threads{1, 2, 4}
+        , write_ratios{0.002, 0.1}
+        , objects{1, 1024}
+        , cs{0, 64}
+        , duration_ms(100)
+        , sample(8)
+        , json(false)
+    {
+    }
+};
+
+struct Result {
+    Config config;
+    uint64_t ops;
+    double seconds;
+    uint64_t read_p[3];
+    uint64_t write_p[3];
+};
+
+//! Fast thread local PRNG
+struct XorShift {
+    uint64_t state;
+
+    explicit XorShift(uint64_t seed) : state(seed*0x9E3779B97F4A7C15ull + 1) {}
+
+    uint64_t operator () () {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+};
+
+//! Critical section body, reads or modifies the object
+inline void critical_section(Object* obj, int cs, bool write) {
+    uint64_t x = obj->value.load(std::memory_order_relaxed);
+    for (int i = 0; i < cs; i++) {
+        x = x*31 + i;
+        asm volatile("" : "+r"(x));
+    }
+    if (write) {
+        obj->value.store(x + 1, std::memory_order_relaxed);
     }
 }
 
-void create_deadlock() {
-    int cnt = 0;
-    for(auto i = 0u; i < 100000u; i++) {
-        auto x = random();
-        switch(x & 0x7) {
-        case 0: {
-            SYNCOPE_LOCK(ll0, &i);
-            SYNCOPE_LOCK(ll1, &i);
-            SYNCOPE_LOCK(ll2, &i);
-            cnt++;
-        }
-        case 1: {
-            SYNCOPE_LOCK(ll2, &i);
-            SYNCOPE_LOCK(ll3, &i);
-            SYNCOPE_LOCK(ll4, &i);
-            cnt++;
-        }
-        case 2: {
-            SYNCOPE_LOCK(ll4, &i);
-            SYNCOPE_LOCK(ll5, &i);
-            SYNCOPE_LOCK(ll6, &i);
-            cnt++;
-        }
-        case 3: {
-            SYNCOPE_LOCK(ll6, &i);
-            SYNCOPE_LOCK(ll7, &i);
-            SYNCOPE_LOCK(ll8, &i);
-            cnt++;
+// Lock adapters, every adapter implements read(obj, fn) and write(obj, fn)
+
+template<class Layer>
+struct SymmetricLock {
+    Layer layer;
+
+    SymmetricLock(int) : layer(STATIC_STRING("symmetric")) {}
+
+    template<class Fn> void read(Object* obj, Fn const& fn) {
+        SYNCOPE_LOCK(layer, obj);
+        fn();
+    }
+
+    template<class Fn> void write(Object* obj, Fn const& fn) {
+        SYNCOPE_LOCK(layer, obj);
+        fn();
+    }
+};
+
+template<class Layer>
+struct AsymmetricLock {
+    Layer layer;
+
+    AsymmetricLock(int) : layer(STATIC_STRING("asymmetric")) {}
+
+    template<class Fn> void read(Object* obj, Fn const& fn) {
+        SYNCOPE_LOCK_READ(layer, obj);
+        fn();
+    }
+
+    template<class Fn> void write(Object* obj, Fn const& fn) {
+        SYNCOPE_LOCK_WRITE(layer, obj);
+        fn();
+    }
+};
+
+struct OptimisticLock {
+    syncope::OptimisticLockLayer layer;
+
+    OptimisticLock(int) : layer(STATIC_STRING("optimistic")) {}
+
+    template<class Fn> void read(Object* obj, Fn const& fn) {
+        layer.read(obj, fn);
+    }
+
+    template<class Fn> void write(Object* obj, Fn const& fn) {
+        SYNCOPE_LOCK_WRITE(layer, obj);
+        fn();
+    }
+};
+
+struct CombiningLock {
+    syncope::CombiningLockLayer layer;
+
+    CombiningLock(int) : layer(STATIC_STRING("combining")) {}
+
+    template<class Fn> void read(Object* obj, Fn const& fn) {
+        SYNCOPE_EXECUTE(layer, obj, fn);
+    }
+
+    template<class Fn> void write(Object* obj, Fn const& fn) {
+        SYNCOPE_EXECUTE(layer, obj, fn);
+    }
+};
+
+#ifdef SYNCOPE_HAVE_COROUTINES
+//! Coroutine that starts eagerly and runs to completion
+struct Task {
+    struct promise_type {
+        Task get_return_object() { return Task(); }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+//! Coroutines of the worker thread, posted by the threads that release the mutexes
+struct RunQueue {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::coroutine_handle<>> handles;
+
+    void post(std::coroutine_handle<> handle) {
+        // notified under the lock, owner of the queue can exit right after the wake-up
+        std::lock_guard<std::mutex> lock(mutex);
+        handles.push_back(handle);
+        cond.notify_one();
+    }
+
+    //! Resume posted coroutines until `done` is set
+    void run(bool const& done) {
+        while (!done) {
+            std::coroutine_handle<> handle;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return !handles.empty(); });
+                handle = handles.front();
+                handles.pop_front();
+            }
+            handle.resume();
         }
-        case 4: {
-            SYNCOPE_LOCK(ll9, &i);
-            SYNCOPE_LOCK(llA, &i);
-            SYNCOPE_LOCK(llB, &i);
-            cnt++;
+    }
+
+    static RunQueue& local() {
+        static thread_local RunQueue queue;
+        return queue;
+    }
+};
+
+struct PostExecutor {
+    RunQueue* queue;
+
+    void operator() (std::coroutine_handle<> handle) const {
+        queue->post(handle);
+    }
+};
+
+//! Asymmetric layer locked by coroutines, every worker drives its own run queue
+struct CoroutineLock {
+    syncope::AsymmetricLockLayer layer;
+
+    CoroutineLock(int) : layer(STATIC_STRING("async")) {}
+
+    template<class Fn> Task read_task(Object* obj, Fn const& fn, bool& done) {
+        {
+            SYNCOPE_LOCK_READ_ASYNC(layer, PostExecutor{&RunQueue::local()}, obj);
+            fn();
         }
-        case 5: {
-            SYNCOPE_LOCK(llB, &i);
-            SYNCOPE_LOCK(llC, &i);
-            SYNCOPE_LOCK(llD, &i);
-            cnt++;
+        done = true;
+    }
+
+    template<class Fn> Task write_task(Object* obj, Fn const& fn, bool& done) {
+        {
+            SYNCOPE_LOCK_WRITE_ASYNC(layer, PostExecutor{&RunQueue::local()}, obj);
+            fn();
         }
-        case 6: {
-            SYNCOPE_LOCK(llD, &i);
-            SYNCOPE_LOCK(llE, &i);
-            SYNCOPE_LOCK(llF, &i);
-            cnt++;
+        done = true;
+    }
+
+    template<class Fn> void read(Object* obj, Fn const& fn) {
+        bool done = false;
+        read_task(obj, fn, done);
+        RunQueue::local().run(done);
+    }
+
+    template<class Fn> void write(Object* obj, Fn const& fn) {
+        bool done = false;
+        write_task(obj, fn, done);
+        RunQueue::local().run(done);
+    }
+};
+#endif
+
+struct MutexLock {
+    std::unique_ptr<std::mutex[]> mutexes;
+    Object* base;
+
+    MutexLock(int nobjects) : mutexes(new std::mutex[nobjects]), base(nullptr) {}
+
+    template<class Fn> void read(Object* obj, Fn const& fn) {
+        std::lock_guard<std::mutex> guard(mutexes[obj - base]);
+        fn();
+    }
+
+    template<class Fn> void write(Object* obj, Fn const& fn) {
+        std::lock_guard<std::mutex> guard(mutexes[obj - base]);
+        fn();
+    }
+};
+
+struct SharedTimedMutexLock {
+    std::unique_ptr<std::shared_timed_mutex[]> mutexes;
+    Object* base;
+
+    SharedTimedMutexLock(int nobjects) : mutexes(new std::shared_timed_mutex[nobjects]), base(nullptr) {}
+
+    template<class Fn> void read(Object* obj, Fn const& fn) {
+        std::shared_lock<std::shared_timed_mutex> guard(mutexes[obj - base]);
+        fn();
+    }
+
+    template<class Fn> void write(Object* obj, Fn const& fn) {
+        std::lock_guard<std::shared_timed_mutex> guard(mutexes[obj - base]);
+        fn();
+    }
+};
+
+struct RWLock {
+    std::unique_ptr<pthread_rwlock_t[]> locks;
+    int size;
+    Object* base;
+
+    RWLock(int nobjects) : locks(new pthread_rwlock_t[nobjects]), size(nobjects), base(nullptr) {
+        for (int i = 0; i < size; i++) {
+            pthread_rwlock_init(&locks[i], nullptr);
         }
-        case 7: {
-            SYNCOPE_LOCK(llE, &i);
-            SYNCOPE_LOCK(llF, &i);
-            SYNCOPE_LOCK(ll0, &i);
-            cnt++;
+    }
+
+    ~RWLock() {
+        for (int i = 0; i < size; i++) {
+            pthread_rwlock_destroy(&locks[i]);
         }
-        case 8: {
-            SYNCOPE_LOCK(ll1, &i);
-            SYNCOPE_LOCK(ll0, &i);
-            SYNCOPE_LOCK(llF, &i);
-            cnt++;
+    }
+
+    template<class Fn> void read(Object* obj, Fn const& fn) {
+        pthread_rwlock_rdlock(&locks[obj - base]);
+        fn();
+        pthread_rwlock_unlock(&locks[obj - base]);
+    }
+
+    template<class Fn> void write(Object* obj, Fn const& fn) {
+        pthread_rwlock_wrlock(&locks[obj - base]);
+        fn();
+        pthread_rwlock_unlock(&locks[obj - base]);
+    }
+};
+
+template<class Lock> void set_base(Lock&, Object*) {}
+void set_base(MutexLock& lock, Object* base) { lock.base = base; }
+void set_base(SharedTimedMutexLock& lock, Object* base) { lock.base = base; }
+void set_base(RWLock& lock, Object* base) { lock.base = base; }
+
+struct Samples {
+    std::vector<uint64_t> read;
+    std::vector<uint64_t> write;
+};
+
+void percentiles(std::vector<uint64_t>& samples, uint64_t* out) {
+    static const double QS[] = {0.5, 0.99, 0.999};
+    std::sort(samples.begin(), samples.end());
+    for (int i = 0; i < 3; i++) {
+        if (samples.empty()) {
+            out[i] = 0;
+        } else {
+            size_t ix = static_cast<size_t>(QS[i]*(samples.size() - 1));
+            out[i] = samples[ix];
         }
-        };
     }
 }
 
-int main()
-{
-    {
-        std::thread td1(create_deadlock);
-        std::thread td2(create_deadlock);
-        std::thread td3(create_deadlock);
-        std::thread td4(create_deadlock);
-        td1.join();
-        td2.join();
-        td3.join();
-        td4.join();
-    }
-    const int NITER = 10000000;
-    boost::timer tm;
-    perftest();
-    std::cout << "Perf test finished in " << tm.elapsed() << "s" << std::endl;
-    {
-        syncope::AsymmetricLockLayer layer(STATIC_STRING("base"));
-        std::vector<int> shared_data;
-        auto worker = [&]() {
-            //ProfilerStart("test");
-            size_t max_size = 0;
-            for (int i = 0; i < NITER; i++) {
-                if ((i & 0x1ff) == 0) {
-                    SYNCOPE_LOCK_WRITE(layer, &shared_data);
-                    shared_data.push_back(i);
-                } else {
-                    SYNCOPE_LOCK_READ(layer, &shared_data);
-                    if (shared_data.size() > max_size) {
-                        max_size = shared_data.size();
-                    }
+template<class Lock>
+Result run(Config const& config, Options const& opt) {
+    std::vector<Object> objects(config.objects);
+    Lock lock(config.objects);
+    set_base(lock, objects.data());
+    std::atomic<bool> start{false}, stop{false};
+    std::vector<uint64_t> ops(config.threads, 0u);
+    std::vector<Samples> samples(config.threads);
+    const uint64_t write_threshold = static_cast<uint64_t>(config.write_ratio*1000000.0);
+    const size_t max_samples = 1u << 20;
+
+    auto worker = [&](int id) {
+        XorShift rnd(id + 1);
+        Samples& local = samples[id];
+        uint64_t count = 0;
+        while (!start.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        while (!stop.load(std::memory_order_relaxed)) {
+            uint64_t r = rnd();
+            Object* obj = &objects[(r >> 20) % objects.size()];
+            bool write = (r & 0xFFFFF) % 1000000 < write_threshold;
+            bool measure = (count % opt.sample) == 0;
+            Clock::time_point begin, acquired;
+            if (measure) {
+                begin = Clock::now();
+            }
+            auto body = [&]() {
+                if (measure) {
+                    acquired = Clock::now();
                 }
+                critical_section(obj, config.cs, write);
+            };
+            if (write) {
+                lock.write(obj, body);
+            } else {
+                lock.read(obj, body);
             }
-            //ProfilerStop();
-            std::cout << max_size << std::endl;
-        };
-        std::thread test0(worker);
-        std::thread test1(worker);
-        std::thread test2(worker);
-        std::thread test3(worker);
-        test0.join();
-        test1.join();
-        test2.join();
-        test3.join();
-    }
-    std::cout << "My = " << tm.elapsed() << std::endl;
-    tm.restart();
-    {
-        std::vector<int> shared_data;
-        pthread_rwlock_t rwlock;
-        pthread_rwlock_init(&rwlock, 0);
-        auto worker = [&]() {
-            size_t max_size = 0;
-            for (int i = 0; i < NITER; i++) {
-                if ((i & 0x1ff) == 0) {
-                    pthread_rwlock_wrlock(&rwlock);
-                    shared_data.push_back(i);
-                    pthread_rwlock_unlock(&rwlock);
-                } else {
-                    pthread_rwlock_rdlock(&rwlock);
-                    if (shared_data.size() > max_size) {
-                        max_size = shared_data.size();
+            if (measure) {
+                auto& vec = write ? local.write : local.read;
+                if (vec.size() < max_samples) {
+                    vec.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(acquired - begin).count());
+                }
+            }
+            count++;
+        }
+        ops[id] = count;
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < config.threads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    auto begin = Clock::now();
+    start.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(std::chrono::milliseconds(opt.duration_ms));
+    stop.store(true);
+    for (auto& t: threads) {
+        t.join();
+    }
+    auto end = Clock::now();
+
+    Result res;
+    res.config = config;
+    res.ops = 0;
+    Samples all;
+    for (int i = 0; i < config.threads; i++) {
+        res.ops += ops[i];
+        all.read.insert(all.read.end(), samples[i].read.begin(), samples[i].read.end());
+        all.write.insert(all.write.end(), samples[i].write.begin(), samples[i].write.end());
+    }
+    res.seconds = std::chrono::duration<double>(end - begin).count();
+    percentiles(all.read, res.read_p);
+    percentiles(all.write, res.write_p);
+    return res;
+}
+
+bool run_config(Config const& config, Options const& opt, Result* res) {
+    // Padded layers place every mutex on its own cache line, compare with the
+    // default (packed) layers to see the cost of false sharing
+    typedef syncope::BasicSymmetricLockLayer<syncope::ShiftHash, SYNCOPE_NUM_LOCKS, 64> PaddedSymmetricLayer;
+    typedef syncope::BasicAsymmetricLockLayer< syncope::ThreadIdReaders, syncope::ShiftHash, syncope::ReaderPreference
+                                             , SYNCOPE_NUM_LOCKS, SYNCOPE_READ_SIDE_PARALLELISM, 64> PaddedAsymmetricLayer;
+    if (config.lock == "symmetric") {
+        *res = run<SymmetricLock<syncope::SymmetricLockLayer>>(config, opt);
+    } else if (config.lock == "symmetric_padded") {
+        *res = run<SymmetricLock<PaddedSymmetricLayer>>(config, opt);
+    } else if (config.lock == "asymmetric_padded") {
+        *res = run<AsymmetricLock<PaddedAsymmetricLayer>>(config, opt);
+    } else if (config.lock == "asymmetric") {
+        *res = run<AsymmetricLock<syncope::AsymmetricLockLayer>>(config, opt);
+    } else if (config.lock == "percpu") {
+        *res = run<AsymmetricLock<syncope::PerCpuAsymmetricLockLayer>>(config, opt);
+    } else if (config.lock == "writer_pref") {
+        *res = run<AsymmetricLock<syncope::WriterPreferringLockLayer>>(config, opt);
+    } else if (config.lock == "biased") {
+        *res = run<AsymmetricLock<syncope::ReaderBiasedLockLayer>>(config, opt);
+    } else if (config.lock == "optimistic") {
+        *res = run<OptimisticLock>(config, opt);
+    } else if (config.lock == "combining") {
+        *res = run<CombiningLock>(config, opt);
+#ifdef SYNCOPE_HAVE_COROUTINES
+    } else if (config.lock == "async") {
+        *res = run<CoroutineLock>(config, opt);
+#endif
+    } else if (config.lock == "mutex") {
+        *res = run<MutexLock>(config, opt);
+    } else if (config.lock == "shared_timed_mutex") {
+        *res = run<SharedTimedMutexLock>(config, opt);
+    } else if (config.lock == "pthread_rwlock") {
+        *res = run<RWLock>(config, opt);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void print_csv_header() {
+    std::cout << "lock,stripes,threads,write_ratio,objects,cs,ops,seconds,ops_per_sec,"
+                 "read_p50_ns,read_p99_ns,read_p999_ns,write_p50_ns,write_p99_ns,write_p999_ns"
+              << std::endl;
+}
+
+void print_csv(Result const& r) {
+    std::cout << r.config.lock << "," << SYNCOPE_NUM_LOCKS << "," << r.config.threads << ","
+              << r.config.write_ratio << "," << r.config.objects << "," << r.config.cs << ","
+              << r.ops << "," << r.seconds << "," << static_cast<uint64_t>(r.ops/r.seconds) << ","
+              << r.read_p[0] << "," << r.read_p[1] << "," << r.read_p[2] << ","
+              << r.write_p[0] << "," << r.write_p[1] << "," << r.write_p[2] << std::endl;
+}
+
+void print_json(Result const& r, bool first) {
+    std::cout << (first ? "[\n" : ",\n")
+              << "  {\"lock\": \"" << r.config.lock << "\", \"stripes\": " << SYNCOPE_NUM_LOCKS
+              << ", \"threads\": " << r.config.threads << ", \"write_ratio\": " << r.config.write_ratio
+              << ", \"objects\": " << r.config.objects << ", \"cs\": " << r.config.cs
+              << ", \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+              << ", \"ops_per_sec\": " << static_cast<uint64_t>(r.ops/r.seconds)
+              << ", \"read_ns\": {\"p50\": " << r.read_p[0] << ", \"p99\": " << r.read_p[1] << ", \"p999\": " << r.read_p[2] << "}"
+              << ", \"write_ns\": {\"p50\": " << r.write_p[0] << ", \"p99\": " << r.write_p[1] << ", \"p999\": " << r.write_p[2] << "}}";
+}
+
+template<class T>
+std::vector<T> parse_list(const char* arg) {
+    std::vector<T> res;
+    std::stringstream stream(arg);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        std::stringstream conv(item);
+        T value;
+        conv >> value;
+        res.push_back(value);
+    }
+    return res;
+}
+
+//! 1, 2, 4, ... up to the number of cores (inclusive)
+std::vector<int> scaling_threads() {
+    int ncores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> res;
+    for (int n = 1; n < ncores; n *= 2) {
+        res.push_back(n);
+    }
+    res.push_back(ncores);
+    return res;
+}
+
+void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [options]\n"
+              << "  --locks LIST        symmetric,asymmetric,percpu,writer_pref,biased,optimistic,\n"
+              << "                      symmetric_padded,asymmetric_padded,combining,\n"
+              << "                      mutex,shared_timed_mutex,pthread_rwlock,\n"
+              << "                      async (C++20 build only)\n"
+              << "  --threads LIST      number of threads (default 1,2,4), `scaling` means\n"
+              << "                      1,2,4,... up to the number of cores\n"
+              << "  --write-ratio LIST  fraction of write operations (default 0.002,0.1)\n"
+              << "  --objects LIST      number of distinct objects (default 1,1024)\n"
+              << "  --cs LIST           critical section length in iterations (default 0,64)\n"
+              << "  --duration MS       duration of the single run (default 100)\n"
+              << "  --sample N          measure latency of every N-th operation (default 8)\n"
+              << "  --format csv|json   output format (default csv)\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[++i];
+        if (arg == "--locks") {
+            opt.locks = parse_list<std::string>(value);
+        } else if (arg == "--threads") {
+            opt.threads = std::strcmp(value, "scaling") == 0 ? scaling_threads() : parse_list<int>(value);
+        } else if (arg == "--write-ratio") {
+            opt.write_ratios = parse_list<double>(value);
+        } else if (arg == "--objects") {
+            opt.objects = parse_list<int>(value);
+        } else if (arg == "--cs") {
+            opt.cs = parse_list<int>(value);
+        } else if (arg == "--duration") {
+            opt.duration_ms = std::atoi(value);
+        } else if (arg == "--sample") {
+            opt.sample = std::max(1, std::atoi(value));
+        } else if (arg == "--format") {
+            opt.json = std::strcmp(value, "json") == 0;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!opt.json) {
+        print_csv_header();
+    }
+    bool first = true;
+    for (auto const& lock: opt.locks) {
+        for (auto threads: opt.threads) {
+            for (auto ratio: opt.write_ratios) {
+                for (auto nobjects: opt.objects) {
+                    for (auto cs: opt.cs) {
+                        Config config = {lock, threads, ratio, std::max(1, nobjects), cs};
+                        Result res;
+                        if (!run_config(config, opt, &res)) {
+                            std::cerr << "Unknown lock type " << lock << std::endl;
+                            return 1;
+                        }
+                        if (opt.json) {
+                            print_json(res, first);
+                        } else {
+                            print_csv(res);
+                        }
+                        first = false;
                     }
-                    pthread_rwlock_unlock(&rwlock);
                 }
             }
-            std::cout << max_size << std::endl;
-        };
-        std::thread test0(worker);
-        std::thread test1(worker);
-        std::thread test2(worker);
-        std::thread test3(worker);
-        test0.join();
-        test1.join();
-        test2.join();
-        test3.join();
-    }
-    std::cout << "restart = " << tm.elapsed() << std::endl;
+        }
+    }
+    if (opt.json) {
+        std::cout << (first ? "[]\n" : "\n]\n");
+    }
     return 0;
 }
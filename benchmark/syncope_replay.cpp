@@ -0,0 +1,548 @@
+#define SYNCOPE_REPLAY
+#include <syncope.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Syncope lock trace replay.
+  * Reads the trace written by `syncope::LockRecorder::dump` (SYNCOPE_RECORD build)
+  * or concatenated traces written by `syncope::LockRecorder::drain`, and re-executes it against different layer configurations: every recorded
+  * thread gets its own replay thread that acquires and releases the same
+  * stripes (rehashed and masked by the new stripe count) keeping recorded
+  * gaps between operations. Contention and wait time of every layer are
+  * printed as CSV or JSON.
+  *
+  * Recorded hash is the output of the layer's hash policy, `--hash` mixes it
+  * once more, so it shows what better hashing would give, not what the
+  * other policy would give on the original addresses.
+  */
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    std::vector<size_t> stripes;    //! 0 - stripe count of the recorded layer
+    std::vector<std::string> hashes;
+    std::vector<size_t> aligns;
+    double time_scale;
+    uint64_t max_gap_ns;
+    uint64_t timeout_ns;
+    bool json;
+    bool info;
+
+    Options()
+        : stripes{0}
+        , hashes{"recorded"}
+        , aligns{0}
+        , time_scale(1.0)
+        , max_gap_ns(1000000u)
+        , timeout_ns(100000000u)
+        , json(false)
+        , info(false)
+    {
+    }
+};
+
+struct Config {
+    size_t stripes;
+    std::string hash;
+    size_t align;
+};
+
+//! Single replay step, consecutive acquisitions in the same layer are merged into one step
+struct Step {
+    uint64_t delay;     //! gap after the previous step (ns, scaled)
+    uint32_t layer;     //! index in LockTrace::layers
+    bool acquire;
+    size_t first;       //! first hash in ThreadPlan::hashes
+    size_t count;
+};
+
+struct ThreadPlan {
+    uint64_t start;     //! delay of the first step relative to the earliest thread
+    std::vector<Step> steps;
+    std::vector<uint64_t> hashes;
+};
+
+struct LayerResult {
+    uint64_t groups;        //! number of acquisition steps
+    uint64_t acquisitions;  //! number of mutex acquisitions
+    uint64_t contended;     //! number of acquisitions that failed try_lock first
+    uint64_t wait_ns;
+    uint64_t skipped;       //! nested acquisitions that timed out (lock order changed by the new mapping)
+
+    LayerResult() : groups(0u), acquisitions(0u), contended(0u), wait_ns(0u), skipped(0u) {}
+
+    void add(LayerResult const& other) {
+        groups += other.groups;
+        acquisitions += other.acquisitions;
+        contended += other.contended;
+        wait_ns += other.wait_ns;
+        skipped += other.skipped;
+    }
+};
+
+uint64_t rehash(std::string const& hash, uint64_t value) {
+    if (hash == "fibonacci") {
+        return syncope::FibonacciHash()(value);
+    } else if (hash == "murmur") {
+        return syncope::MurmurHash()(value);
+    }
+    return value;
+}
+
+//! Append the trace written by the next `LockRecorder::drain` call (layers are merged by id)
+void append(syncope::LockTrace& trace, syncope::LockTrace const& chunk) {
+    for (auto const& layer: chunk.layers) {
+        auto it = std::find_if(trace.layers.begin(), trace.layers.end(), [&](syncope::LockTrace::Layer const& l) {
+            return l.id == layer.id;
+        });
+        if (it == trace.layers.end()) {
+            trace.layers.push_back(layer);
+        }
+    }
+    for (auto const& thread: chunk.threads) {
+        auto it = std::find_if(trace.threads.begin(), trace.threads.end(), [&](syncope::LockTrace::Thread const& t) {
+            return t.id == thread.id;
+        });
+        if (it == trace.threads.end()) {
+            trace.threads.push_back(thread);
+        } else {
+            it->records.insert(it->records.end(), thread.records.begin(), thread.records.end());
+        }
+    }
+}
+
+//! Read all traces from the stream, returns false if the stream is empty or broken
+bool read_trace(std::istream& input, syncope::LockTrace& trace) {
+    bool any = false;
+    while (input.peek() != std::char_traits<char>::eof()) {
+        syncope::LockTrace chunk;
+        if (!chunk.read(input)) {
+            return false;
+        }
+        append(trace, chunk);
+        any = true;
+    }
+    return any;
+}
+
+uint64_t scale(uint64_t ns, Options const& opt) {
+    return std::min(static_cast<uint64_t>(ns*opt.time_scale), opt.max_gap_ns);
+}
+
+std::vector<ThreadPlan> make_plans(syncope::LockTrace const& trace, Options const& opt) {
+    std::map<int, uint32_t> layers;
+    for (size_t i = 0; i < trace.layers.size(); i++) {
+        layers[trace.layers[i].id] = static_cast<uint32_t>(i);
+    }
+    uint64_t origin = UINT64_MAX;
+    for (auto const& thread: trace.threads) {
+        if (!thread.records.empty()) {
+            origin = std::min(origin, thread.records.front().time);
+        }
+    }
+    std::vector<ThreadPlan> res;
+    for (auto const& thread: trace.threads) {
+        if (thread.records.empty()) {
+            continue;
+        }
+        ThreadPlan plan;
+        plan.start = scale(thread.records.front().time - origin, opt);
+        uint64_t prev = thread.records.front().time;
+        for (auto const& r: thread.records) {
+            auto it = layers.find(r.layer);
+            if (it == layers.end()) {
+                continue;
+            }
+            bool acquire = r.op == syncope::LockRecord::ACQUIRE;
+            // acquisition record is written after the wait, think time ends before it
+            uint64_t begin = acquire ? r.time - std::min<uint64_t>(r.wait, r.time) : r.time;
+            uint64_t gap = begin > prev ? begin - prev : 0u;
+            prev = std::max(prev, r.time);
+            Step* last = plan.steps.empty() ? nullptr : &plan.steps.back();
+            if (acquire && last && last->acquire && last->layer == it->second) {
+                plan.hashes.push_back(r.hash);
+                last->count++;
+                continue;
+            }
+            plan.steps.push_back(Step{scale(gap, opt), it->second, acquire, plan.hashes.size(), 1u});
+            plan.hashes.push_back(r.hash);
+        }
+        res.push_back(std::move(plan));
+    }
+    return res;
+}
+
+void pause(uint64_t ns) {
+    if (ns == 0u) {
+        return;
+    }
+    if (ns > 100000u) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+        return;
+    }
+    auto deadline = Clock::now() + std::chrono::nanoseconds(ns);
+    while (Clock::now() < deadline) {
+    }
+}
+
+/** Replay thread.
+  * Mutexes are reference counted because different recorded stripes can map
+  * to the same mutex in the new configuration. Thread that already holds some
+  * mutex uses timed acquisition, the new mapping can change the lock order.
+  */
+class Replayer {
+    ThreadPlan const& plan_;
+    std::vector<std::unique_ptr<syncope::detail::LockLayerImpl>>& layers_;
+    Config const& config_;
+    Options const& opt_;
+    //! (layer, recorded hash) -> new mutex index of every outstanding acquisition (SIZE_MAX - skipped)
+    std::map<std::pair<uint32_t, uint64_t>, std::vector<size_t>> held_;
+    //! (layer, mutex index) -> reference count
+    std::map<std::pair<uint32_t, size_t>, int> refs_;
+    int nheld_;
+public:
+    std::vector<LayerResult> results;
+
+    Replayer(ThreadPlan const& plan, std::vector<std::unique_ptr<syncope::detail::LockLayerImpl>>& layers,
+             Config const& config, Options const& opt)
+        : plan_(plan)
+        , layers_(layers)
+        , config_(config)
+        , opt_(opt)
+        , nheld_(0)
+        , results(layers.size())
+    {
+    }
+
+    void run() {
+        pause(plan_.start);
+        for (auto const& step: plan_.steps) {
+            pause(step.delay);
+            if (step.acquire) {
+                acquire(step);
+            } else {
+                release(step);
+            }
+        }
+        // unlock everything that wasn't released inside the recorded window
+        for (auto const& ref: refs_) {
+            if (ref.second > 0) {
+                layers_[ref.first.first]->unlock(ref.first.second);
+            }
+        }
+    }
+
+private:
+    size_t index(uint32_t layer, uint64_t hash) const {
+        return layers_[layer]->index(static_cast<size_t>(rehash(config_.hash, hash)));
+    }
+
+    void acquire(Step const& step) {
+        auto& layer = *layers_[step.layer];
+        LayerResult& res = results[step.layer];
+        res.groups++;
+        std::vector<size_t> ixs;
+        for (size_t i = 0; i < step.count; i++) {
+            size_t ix = index(step.layer, plan_.hashes[step.first + i]);
+            if (refs_[std::make_pair(step.layer, ix)] == 0) {
+                ixs.push_back(ix);
+            }
+        }
+        std::sort(ixs.begin(), ixs.end());
+        ixs.erase(std::unique(ixs.begin(), ixs.end()), ixs.end());
+        std::vector<size_t> skipped;
+        // mutexes of the single step are locked in order, blocking is safe only if nothing else is held
+        bool nested = nheld_ > 0;
+        for (auto ix: ixs) {
+            res.acquisitions++;
+            if (layer.try_lock(ix)) {
+                nheld_++;
+                continue;
+            }
+            res.contended++;
+            auto start = Clock::now();
+            bool ok = true;
+            if (!nested) {
+                layer.lock(ix);
+            } else {
+                ok = layer.try_lock_until(ix, start + std::chrono::nanoseconds(opt_.timeout_ns));
+            }
+            res.wait_ns += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+            if (ok) {
+                nheld_++;
+            } else {
+                res.skipped++;
+                skipped.push_back(ix);
+            }
+        }
+        for (size_t i = 0; i < step.count; i++) {
+            uint64_t hash = plan_.hashes[step.first + i];
+            size_t ix = index(step.layer, hash);
+            if (std::find(skipped.begin(), skipped.end(), ix) != skipped.end()) {
+                ix = SIZE_MAX;
+            } else {
+                refs_[std::make_pair(step.layer, ix)]++;
+            }
+            held_[std::make_pair(step.layer, hash)].push_back(ix);
+        }
+    }
+
+    void release(Step const& step) {
+        auto it = held_.find(std::make_pair(step.layer, plan_.hashes[step.first]));
+        if (it == held_.end() || it->second.empty()) {
+            // acquired before the recorded window
+            return;
+        }
+        size_t ix = it->second.back();
+        it->second.pop_back();
+        if (ix == SIZE_MAX) {
+            return;
+        }
+        if (--refs_[std::make_pair(step.layer, ix)] == 0) {
+            layers_[step.layer]->unlock(ix);
+            nheld_--;
+        }
+    }
+};
+
+struct Result {
+    Config config;
+    double seconds;
+    std::vector<LayerResult> layers;
+};
+
+Result replay(syncope::LockTrace const& trace, std::vector<ThreadPlan> const& plans, Config const& config, Options const& opt) {
+    std::vector<std::unique_ptr<syncope::detail::LockLayerImpl>> layers;
+    for (auto const& layer: trace.layers) {
+        size_t stripes = config.stripes ? config.stripes : static_cast<size_t>(layer.stripes);
+        layers.emplace_back(new syncope::detail::LockLayerImpl(layer.name.c_str(), layer.level, stripes, config.align));
+    }
+    std::vector<std::unique_ptr<Replayer>> replayers;
+    for (auto const& plan: plans) {
+        replayers.emplace_back(new Replayer(plan, layers, config, opt));
+    }
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool go = false;
+    std::vector<std::thread> threads;
+    for (auto& r: replayers) {
+        Replayer* replayer = r.get();
+        threads.emplace_back([&, replayer] {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&] { return go; });
+            }
+            replayer->run();
+        });
+    }
+    auto start = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        go = true;
+    }
+    cond.notify_all();
+    for (auto& t: threads) {
+        t.join();
+    }
+    Result res;
+    res.config = config;
+    res.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    res.layers.resize(layers.size());
+    for (auto const& r: replayers) {
+        for (size_t i = 0; i < layers.size(); i++) {
+            res.layers[i].add(r->results[i]);
+        }
+    }
+    return res;
+}
+
+void print_info(syncope::LockTrace const& trace) {
+    std::cout << "layers:\n";
+    for (auto const& layer: trace.layers) {
+        std::cout << "  " << layer.id << " " << layer.name << " level " << layer.level
+                  << ", " << layer.stripes << " stripes\n";
+    }
+    std::cout << "threads:\n";
+    for (auto const& thread: trace.threads) {
+        uint64_t contended = 0;
+        for (auto const& r: thread.records) {
+            contended += r.op == syncope::LockRecord::ACQUIRE && r.wait;
+        }
+        uint64_t span = thread.records.empty() ? 0u : thread.records.back().time - thread.records.front().time;
+        std::cout << "  " << thread.id << ": " << thread.records.size() << " records, "
+                  << contended << " contended, " << span/1000 << " us\n";
+    }
+}
+
+void print_csv_header() {
+    std::cout << "hash,stripes,align,layer,name,groups,acquisitions,contended,contention,"
+                 "wait_ns,skipped,seconds,acq_per_sec" << std::endl;
+}
+
+void print_csv(syncope::LockTrace const& trace, Result const& r) {
+    for (size_t i = 0; i < r.layers.size(); i++) {
+        LayerResult const& l = r.layers[i];
+        size_t stripes = r.config.stripes ? r.config.stripes : static_cast<size_t>(trace.layers[i].stripes);
+        std::cout << r.config.hash << "," << stripes << "," << r.config.align << ","
+                  << trace.layers[i].id << "," << trace.layers[i].name << ","
+                  << l.groups << "," << l.acquisitions << "," << l.contended << ","
+                  << (l.acquisitions ? double(l.contended)/l.acquisitions : 0.0) << ","
+                  << l.wait_ns << "," << l.skipped << "," << r.seconds << ","
+                  << static_cast<uint64_t>(l.acquisitions/r.seconds) << std::endl;
+    }
+}
+
+void print_json(syncope::LockTrace const& trace, Result const& r, bool& first) {
+    for (size_t i = 0; i < r.layers.size(); i++) {
+        LayerResult const& l = r.layers[i];
+        size_t stripes = r.config.stripes ? r.config.stripes : static_cast<size_t>(trace.layers[i].stripes);
+        std::cout << (first ? "[\n" : ",\n")
+                  << "  {\"hash\": \"" << r.config.hash << "\", \"stripes\": " << stripes
+                  << ", \"align\": " << r.config.align << ", \"layer\": " << trace.layers[i].id
+                  << ", \"name\": \"" << trace.layers[i].name << "\", \"groups\": " << l.groups
+                  << ", \"acquisitions\": " << l.acquisitions << ", \"contended\": " << l.contended
+                  << ", \"contention\": " << (l.acquisitions ? double(l.contended)/l.acquisitions : 0.0)
+                  << ", \"wait_ns\": " << l.wait_ns << ", \"skipped\": " << l.skipped
+                  << ", \"seconds\": " << r.seconds
+                  << ", \"acq_per_sec\": " << static_cast<uint64_t>(l.acquisitions/r.seconds) << "}";
+        first = false;
+    }
+}
+
+template<class T>
+std::vector<T> parse_list(const char* arg) {
+    std::vector<T> res;
+    std::stringstream stream(arg);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        std::stringstream conv(item);
+        T value;
+        conv >> value;
+        res.push_back(value);
+    }
+    return res;
+}
+
+void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [options] TRACE\n"
+              << "  --stripes LIST      stripe counts, powers of two (default 0 - recorded)\n"
+              << "  --hash LIST         recorded,fibonacci,murmur (default recorded)\n"
+              << "  --align LIST        stripe alignment in bytes (default 0)\n"
+              << "  --time-scale F      multiplier of the recorded gaps, 0 - no gaps (default 1)\n"
+              << "  --max-gap US        upper bound of the single gap (default 1000)\n"
+              << "  --timeout MS        timeout of the nested acquisition (default 100)\n"
+              << "  --format csv|json   output format (default csv)\n"
+              << "  --info              print trace summary and exit\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (arg == "--info") {
+            opt.info = true;
+            continue;
+        }
+        if (arg.compare(0, 2, "--") != 0) {
+            path = argv[i];
+            continue;
+        }
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[++i];
+        if (arg == "--stripes") {
+            opt.stripes = parse_list<size_t>(value);
+        } else if (arg == "--hash") {
+            opt.hashes = parse_list<std::string>(value);
+        } else if (arg == "--align") {
+            opt.aligns = parse_list<size_t>(value);
+        } else if (arg == "--time-scale") {
+            opt.time_scale = std::max(0.0, std::atof(value));
+        } else if (arg == "--max-gap") {
+            opt.max_gap_ns = static_cast<uint64_t>(std::atoll(value))*1000u;
+        } else if (arg == "--timeout") {
+            opt.timeout_ns = static_cast<uint64_t>(std::atoll(value))*1000000u;
+        } else if (arg == "--format") {
+            opt.json = std::strcmp(value, "json") == 0;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (path == nullptr) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (auto stripes: opt.stripes) {
+        if (stripes & (stripes - 1)) {
+            std::cerr << "Stripe count " << stripes << " is not a power of two" << std::endl;
+            return 1;
+        }
+    }
+    for (auto const& hash: opt.hashes) {
+        if (hash != "recorded" && hash != "fibonacci" && hash != "murmur") {
+            std::cerr << "Unknown hash " << hash << std::endl;
+            return 1;
+        }
+    }
+
+    std::ifstream input(path, std::ios::binary);
+    syncope::LockTrace trace;
+    if (!input || !read_trace(input, trace)) {
+        std::cerr << "Can't read lock trace " << path << std::endl;
+        return 1;
+    }
+    if (opt.info) {
+        print_info(trace);
+        return 0;
+    }
+
+    std::vector<ThreadPlan> plans = make_plans(trace, opt);
+    if (!opt.json) {
+        print_csv_header();
+    }
+    bool first = true;
+    for (auto const& hash: opt.hashes) {
+        for (auto stripes: opt.stripes) {
+            for (auto align: opt.aligns) {
+                Config config = {stripes, hash, align};
+                Result res = replay(trace, plans, config, opt);
+                if (opt.json) {
+                    print_json(trace, res, first);
+                } else {
+                    print_csv(trace, res);
+                }
+            }
+        }
+    }
+    if (opt.json) {
+        std::cout << (first ? "[]\n" : "\n]\n");
+    }
+    return 0;
+}
@@ -8,6 +8,11 @@
 #   define SYNCOPE_READ_SIDE_PARALLELISM 0x8
 #endif
 
+// Stripe alignment in bytes, 0 means no padding between mutexes
+#ifndef SYNCOPE_STRIPE_ALIGN
+#   define SYNCOPE_STRIPE_ALIGN 0
+#endif
+
 #ifndef SYNCOPE_MAX_LAYERS
 #   define SYNCOPE_MAX_LAYERS 100
 #endif
@@ -16,486 +21,7182 @@
 #   define SYNCOPE_MAX_DEPTH 0x10
 #endif
 
+// Size of the visible readers table shared by all reader-biased layers (power of two)
+#ifndef SYNCOPE_VISIBLE_READERS
+#   define SYNCOPE_VISIBLE_READERS 0x1000
+#endif
+
+// Lock tracing: max number of (layer, call site) pairs and size of the event ring buffer (per thread)
+#ifndef SYNCOPE_TRACE_SITES
+#   define SYNCOPE_TRACE_SITES 0x100
+#endif
+#ifndef SYNCOPE_TRACE_EVENTS
+#   define SYNCOPE_TRACE_EVENTS 0x1000
+#endif
+
+// Lock recording: size of the ring buffer of lock records (per thread)
+#ifndef SYNCOPE_RECORD_EVENTS
+#   define SYNCOPE_RECORD_EVENTS 0x4000
+#endif
+
+// Call sites (__FILE__:__LINE__) are passed to the layers by deadlock detector and by tracing
+#if defined(SYNCOPE_DETECT_DEADLOCKS) || defined(SYNCOPE_TRACE)
+#   define SYNCOPE_CALL_SITES
+#endif
+
 #ifdef SYNCOPE_DETECT_DEADLOCKS
 #include <iostream>
 #include <string>
 #include <exception>
 #include <sstream>
+#include <functional>
+#endif
+
+#ifdef SYNCOPE_COLLECT_STATS
+#include <cstring>
+#endif
+
+// Lock trace format is available to the recorder and to the replay tool
+#if defined(SYNCOPE_RECORD) || defined(SYNCOPE_REPLAY)
+#include <string>
 #endif
 
 #include <mutex>
+#include <condition_variable>
+#include <future>
 #include <memory>
+#include <new>
 #include <algorithm>
 #include <thread>
 #include <atomic>
+#include <array>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <tuple>
 #include <cassert>
+#include <climits>
+#include <cstdio>
+#include <exception>
+#include <utility>
 
-namespace syncope {
-
-namespace detail {
-
-    static const int CACHE_LINE_BITS = 6;
+// Asynchronous (coroutine) lock acquisition is available in C++20 mode
+#if defined(__cpp_impl_coroutine) && defined(__has_include) && !defined(SYNCOPE_NO_COROUTINES)
+#   if __has_include(<coroutine>)
+#       include <coroutine>
+#       include <optional>
+#       include <type_traits>
+#       define SYNCOPE_HAVE_COROUTINES
+#   endif
+#endif
 
-    class LockLayerImpl;
+#if defined(__linux__)
+#include <sched.h>
+// Asynchronous locks and RCU readers use membarrier(2) to keep memory fences off the fast path
+#   if defined(__has_include)
+#       if __has_include(<linux/membarrier.h>)
+#           include <linux/membarrier.h>
+#           include <sys/syscall.h>
+#           include <unistd.h>
+#           define SYNCOPE_HAVE_MEMBARRIER
+#       endif
+#   endif
+// Process-shared lock layers use robust process-shared (futex based) pthread mutexes
+#   if !defined(SYNCOPE_NO_PROCESS_SHARED)
+#       include <pthread.h>
+#       include <signal.h>
+#       include <unistd.h>
+#       include <cerrno>
+#       include <ctime>
+#       include <system_error>
+#       define SYNCOPE_HAVE_PROCESS_SHARED
+// Timed locks wait on the monotonic clock if glibc provides pthread_mutex_clocklock
+#       if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#           if __GLIBC_PREREQ(2, 30)
+#               define SYNCOPE_HAVE_CLOCKLOCK
+#           endif
+#       endif
+#   endif
+#   if !defined(SYNCOPE_NO_RSEQ) && defined(__GLIBC__) && defined(__has_include)
+#       if __has_include(<sys/rseq.h>) && (defined(__clang__) || __GNUC__ >= 11)
+#           include <sys/rseq.h>
+#           define SYNCOPE_HAVE_RSEQ
+#       endif
+#   endif
+#endif
 
-    struct TraceRoot {
-        typedef std::tuple<LockLayerImpl*, const char*> Owner;
-        std::unique_ptr<Owner[]> owners;
-        int top;
+namespace syncope {
 
-        TraceRoot() 
-            : owners(new Owner[SYNCOPE_MAX_DEPTH])
-            , top(0)
-        {
-        }
+#ifdef SYNCOPE_COLLECT_STATS
+    //! Lock statistics of the single mutex
+    struct StripeStats {
+        uint64_t acquisitions;  //! total number of acquisitions
+        uint64_t contended;     //! number of acquisitions that failed try_lock first
+        uint64_t wait_ns;       //! time spent waiting for the contended mutex (nanoseconds)
     };
 
-    class Detector {
-        static const int TRANSITIONS_SIZE = SYNCOPE_MAX_LAYERS * SYNCOPE_MAX_LAYERS;
-        struct CounterWithPad {
-            std::atomic<size_t> counter;
-            char pad[64 - sizeof(counter)];
-            CounterWithPad()
-                : counter{0}
-            {
+    //! Snapshot of the lock layer statistics
+    struct LayerStats {
+        const char* name;
+        int id;
+        int level;
+        std::vector<StripeStats> stripes;
+
+        //! Sum of the statistics of all mutexes
+        StripeStats total() const {
+            StripeStats res = {0u, 0u, 0u};
+            for (auto const& s: stripes) {
+                res.acquisitions += s.acquisitions;
+                res.contended += s.contended;
+                res.wait_ns += s.wait_ns;
             }
-        };
-        std::array<CounterWithPad, TRANSITIONS_SIZE> transitions;
-        Detector() {}
-    public:
-        static Detector& inst() {
-            static Detector d;
-            return d;
+            return res;
         }
-
-        void on_lock(TraceRoot::Owner const& prev, TraceRoot::Owner const& curr);
-
-        void on_deadlock(LockLayerImpl* curr, const char* message);
     };
+#endif
 
-    class LockLayerImpl {
+#ifdef SYNCOPE_TRACE
+    /** Latency histogram with HDR-style log-linear buckets.
+      * Every power of two is split into 16 linear sub-buckets so values
+      * are recorded with ~6% precision. Values are in nanoseconds.
+      */
+    struct LatencyHistogram {
         enum {
-            N = SYNCOPE_NUM_LOCKS
+            SUB_BITS = 4,
+            SUB_COUNT = 1 << SUB_BITS,
+            MAX_BITS = 40,  //! larger values (~18 minutes) are clamped
+            BUCKETS = (MAX_BITS - SUB_BITS + 1)*SUB_COUNT,
         };
-        static_assert((N & (N - 1)) == 0, "N (SYNCOPE_NUM_LOCKS) must be a power of two");
-        static const int MASK = N - 1;
-        typedef std::mutex MutexT;
-        mutable std::array<MutexT, N> mutexes_;
-        const char* name_;
-        int level_;
-        const int id_;
-        static thread_local TraceRoot tls_root;
-        static std::atomic<int> layers_counter;
-    public:
-        LockLayerImpl(const char* name, int level)
-            : name_(name)
-            , level_(level)
-            , id_(layers_counter++)
+        std::vector<uint64_t> counts;
+
+        LatencyHistogram()
+            : counts(BUCKETS, 0u)
         {
         }
 
-        LockLayerImpl(LockLayerImpl const&) = delete;
-        LockLayerImpl& operator = (LockLayerImpl const&) = delete;
+        //! Returns index of the bucket that contains the value
+        static size_t bucket(uint64_t value) {
+            if (value < SUB_COUNT) {
+                return static_cast<size_t>(value);
+            }
+            int exp = 63 - __builtin_clzll(value);
+            if (exp >= MAX_BITS) {
+                return BUCKETS - 1;
+            }
+            return static_cast<size_t>((exp - SUB_BITS + 1)*SUB_COUNT + ((value >> (exp - SUB_BITS)) & (SUB_COUNT - 1)));
+        }
 
-        void lock(size_t hash) {
-            size_t ix = hash & MASK;
-            mutexes_[ix].lock();
+        //! Returns the largest value that falls into the bucket
+        static uint64_t highest(size_t bucket) {
+            if (bucket < SUB_COUNT) {
+                return bucket;
+            }
+            int exp = static_cast<int>(bucket/SUB_COUNT) + SUB_BITS - 1;
+            uint64_t sub = bucket % SUB_COUNT;
+            return ((SUB_COUNT + sub + 1) << (exp - SUB_BITS)) - 1;
         }
 
+        //! Total number of recorded values
+        uint64_t count() const {
+            uint64_t res = 0;
+            for (auto c: counts) {
+                res += c;
+            }
+            return res;
+        }
 
-        void unlock(size_t hash) {
-            size_t ix = hash & MASK;
-            mutexes_[ix].unlock();
+        //! Returns value at the given percentile (0-100)
+        uint64_t percentile(double p) const {
+            uint64_t total = count();
+            if (total == 0) {
+                return 0;
+            }
+            uint64_t rank = static_cast<uint64_t>(p/100.0*static_cast<double>(total));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); i++) {
+                seen += counts[i];
+                if (seen > rank) {
+                    return highest(i);
+                }
+            }
+            return highest(counts.size() - 1);
         }
 
-        int get_id() const {
-            return id_;
+        //! Largest recorded value (bucket precision)
+        uint64_t max() const {
+            for (size_t i = counts.size(); i-- > 0;) {
+                if (counts[i]) {
+                    return highest(i);
+                }
+            }
+            return 0;
         }
 
-#ifdef SYNCOPE_DETECT_DEADLOCKS
+        void merge(LatencyHistogram const& other) {
+            for (size_t i = 0; i < counts.size(); i++) {
+                counts[i] += other.counts[i];
+            }
+        }
+    };
 
-        void detector_lock(const char* loc) {
-            TraceRoot& root = tls_root;
-            if (root.top > SYNCOPE_MAX_DEPTH) {
-                report_error("max depth reached");
+    //! Wait and hold latencies of the call site
+    struct SiteTrace {
+        const char* layer;          //! layer name
+        const char* site;           //! file:line of the locking macro
+        LatencyHistogram wait;      //! time spent acquiring the lock
+        LatencyHistogram hold;      //! time the lock was held
+    };
+#endif
+
+#if defined(SYNCOPE_RECORD) || defined(SYNCOPE_REPLAY)
+    //! Mutex acquisition or release recorded by the lock recorder
+    struct LockRecord {
+        enum Op {
+            ACQUIRE = 1,
+            RELEASE = 2,
+        };
+        uint64_t time;      //! steady clock, ns (acquisition completed or release started)
+        uint64_t hash;      //! stripe hash passed to the layer (mutex index is `hash & (stripes - 1)`)
+        uint32_t wait;      //! time spent waiting for the mutex, ns (0 - uncontended)
+        uint16_t layer;     //! layer id
+        uint16_t op;
+    };
+
+    /** Recorded lock trace.
+      * Binary format (native byte order): magic, layer table, then records of
+      * every thread ordered by time. Records are written as is, 24 bytes each.
+      */
+    struct LockTrace {
+        struct Layer {
+            int id;
+            int level;
+            uint64_t stripes;
+            std::string name;
+        };
+
+        struct Thread {
+            uint32_t id;
+            std::vector<LockRecord> records;
+        };
+
+        std::vector<Layer> layers;
+        std::vector<Thread> threads;
+
+        template<class Stream>
+        void write(Stream& stream) const {
+            stream.write(magic(), 8);
+            write_value(stream, static_cast<uint32_t>(layers.size()));
+            for (auto const& layer: layers) {
+                write_value(stream, static_cast<int32_t>(layer.id));
+                write_value(stream, static_cast<int32_t>(layer.level));
+                write_value(stream, layer.stripes);
+                write_value(stream, static_cast<uint32_t>(layer.name.size()));
+                stream.write(layer.name.data(), layer.name.size());
             }
-            root.owners[root.top] = std::make_tuple(this, loc);
-            root.top++;
-            auto top = root.top;
-            for (int i = top - 2; i >= 0; i--) {
-                Detector::inst().on_lock( root.owners[i]
-                                        , root.owners[root.top-1]);
-                break;
+            write_value(stream, static_cast<uint32_t>(threads.size()));
+            for (auto const& thread: threads) {
+                write_value(stream, thread.id);
+                write_value(stream, static_cast<uint64_t>(thread.records.size()));
+                stream.write(reinterpret_cast<const char*>(thread.records.data()), thread.records.size()*sizeof(LockRecord));
             }
         }
 
-        void detector_unlock() {
-            TraceRoot& root = tls_root;
-            if (root.top == 0) {
-                report_error("double unlock");
+        //! Read trace written by `write`, returns false if the stream is truncated or isn't a lock trace
+        template<class Stream>
+        bool read(Stream& stream) {
+            char buf[8];
+            if (!stream.read(buf, 8) || std::string(buf, 8) != std::string(magic(), 8)) {
+                return false;
+            }
+            uint32_t nlayers = 0;
+            if (!read_value(stream, &nlayers)) {
+                return false;
+            }
+            layers.resize(nlayers);
+            for (auto& layer: layers) {
+                int32_t id, level;
+                uint32_t len;
+                if (!read_value(stream, &id) || !read_value(stream, &level) ||
+                    !read_value(stream, &layer.stripes) || !read_value(stream, &len)) {
+                    return false;
+                }
+                layer.id = id;
+                layer.level = level;
+                layer.name.resize(len);
+                if (len && !stream.read(&layer.name[0], len)) {
+                    return false;
+                }
+            }
+            uint32_t nthreads = 0;
+            if (!read_value(stream, &nthreads)) {
+                return false;
+            }
+            threads.resize(nthreads);
+            for (auto& thread: threads) {
+                uint64_t count;
+                if (!read_value(stream, &thread.id) || !read_value(stream, &count)) {
+                    return false;
+                }
+                thread.records.resize(count);
+                if (count && !stream.read(reinterpret_cast<char*>(thread.records.data()), count*sizeof(LockRecord))) {
+                    return false;
+                }
             }
-            root.top--;
+            return true;
         }
 
-        void report_error(const char* message) const {
-            TraceRoot& root = tls_root;
+    private:
+        static const char* magic() {
+            return "SYNCREC1";
+        }
+
+        template<class Stream, class T>
+        static void write_value(Stream& stream, T value) {
+            stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+
+        template<class Stream, class T>
+        static bool read_value(Stream& stream, T* value) {
+            return static_cast<bool>(stream.read(reinterpret_cast<char*>(value), sizeof(T)));
+        }
+    };
+#endif
+
+#ifdef SYNCOPE_DETECT_DEADLOCKS
+    //! Deadlock detector finding
+    struct DeadlockReport {
+        typedef std::pair<const char*, const char*> Owner;
+        std::string message;        //! what was detected
+        std::string cycle;          //! lock-order cycle with call sites of every edge (can be empty)
+        std::vector<Owner> held;    //! layers held by the current thread (name and call site)
+
+        //! Human readable description
+        std::string str() const {
             std::stringstream sstream;
             sstream << "Deadlock detector - " << message << std::endl;
-            for (auto i = 0; i < root.top; i++) {
-                auto layer = std::get<0>(root.owners[i]);
-                auto loc = std::get<1>(root.owners[i]);
-                sstream << "layer[" << i << "] is " << layer->name_ << " at " << loc << std::endl;
+            sstream << cycle;
+            for (size_t i = 0; i < held.size(); i++) {
+                sstream << "layer[" << i << "] is " << held[i].first << " at " << held[i].second << std::endl;
             }
-            std::cout << sstream.str() << std::endl;
-            std::terminate();
+            return sstream.str();
         }
-#endif
     };
 
-    std::atomic<int> LockLayerImpl::layers_counter{0};
-    thread_local TraceRoot LockLayerImpl::tls_root;
-
-    void Detector::on_deadlock(LockLayerImpl* curr, const char* message) {
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-        curr->report_error(message);
+    typedef std::function<void(DeadlockReport const&)> DeadlockHandler;
 #endif
+
+namespace detail {
+
+    static const int CACHE_LINE_BITS = 6;
+
+    class LockLayerImpl;
+    class WaitQueues;
+
+#ifndef NDEBUG
+    /** Set while the thread runs closures of the combining layer (debug builds).
+      * Closures run on the combiner's thread that can hold other locks, lock order
+      * edges created inside them are invisible to the deadlock detector and to
+      * the level checks, so closures must not acquire locks.
+      */
+    inline bool& running_closures() {
+        static thread_local bool flag = false;
+        return flag;
     }
+#endif
 
-    void Detector::on_lock(TraceRoot::Owner const& prev, TraceRoot::Owner const& curr) {
-        LockLayerImpl* prev_layer = std::get<0>(prev);
-        LockLayerImpl* curr_layer = std::get<0>(curr);
-        auto id_prev = prev_layer->get_id();
-        auto id_curr = curr_layer->get_id();
-        int x, y, dir;
-        if (id_prev > id_curr)  {
-            x = id_prev;
-            y = id_curr;
-            dir = 1;
-        } else if (id_prev < id_curr){
-            y = id_prev;
-            x = id_curr;
-            dir = 2;
-        } else {
-            on_deadlock(curr_layer, "recursion detected");
-            return;
+    /** Vector with small inline buffer.
+      * Doesn't allocate memory until size exceeds C elements.
+      */
+    template<class T, int C>
+    class SmallVector {
+        std::array<T, C> inline_;
+        std::unique_ptr<T[]> heap_;
+        size_t size_;
+        size_t capacity_;
+
+        T* data_() {
+            return heap_ ? heap_.get() : inline_.data();
         }
-        int addr = y*SYNCOPE_MAX_LAYERS + x;
-        int res = transitions[addr].counter.exchange(dir);
-        if (res && res != dir) {
-            on_deadlock(curr_layer, "deadlock detected");
+    public:
+        SmallVector()
+            : size_(0)
+            , capacity_(C)
+        {
         }
-    }
-} // namespace detail
 
-// namespace locks
+        SmallVector(SmallVector&& other)
+            : heap_(std::move(other.heap_))
+            , size_(other.size_)
+            , capacity_(other.capacity_)
+        {
+            if (!heap_) {
+                std::copy(other.inline_.begin(), other.inline_.begin() + size_, inline_.begin());
+            }
+            other.size_ = 0;
+            other.capacity_ = C;
+        }
 
-    template<class T>
-    class LockGuard {
-        size_t value_;
-        bool owns_lock_;
-        detail::LockLayerImpl& lock_pool_;
-#ifdef  SYNCOPE_DETECT_DEADLOCKS
-        const char* loc_;
-#endif
+        SmallVector& operator = (SmallVector&& other) {
+            heap_ = std::move(other.heap_);
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+            if (!heap_) {
+                std::copy(other.inline_.begin(), other.inline_.begin() + size_, inline_.begin());
+            }
+            other.size_ = 0;
+            other.capacity_ = C;
+            return *this;
+        }
 
-        void lock() {
-#ifdef  SYNCOPE_DETECT_DEADLOCKS
-            lock_pool_.detector_lock(loc_);
-#endif
-            lock_pool_.lock(value_);
-            owns_lock_ = true;
+        SmallVector(SmallVector const&) = delete;
+        SmallVector& operator = (SmallVector const&) = delete;
+
+        void reserve(size_t capacity) {
+            if (capacity > capacity_) {
+                std::unique_ptr<T[]> tmp(new T[capacity]);
+                std::copy(begin(), end(), tmp.get());
+                heap_ = std::move(tmp);
+                capacity_ = capacity;
+            }
         }
 
-        void unlock() {
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-            lock_pool_.detector_unlock();
-#endif
-            lock_pool_.unlock(value_);
-            owns_lock_ = false;
+        void push_back(T const& value) {
+            if (size_ == capacity_) {
+                reserve(capacity_*2);
+            }
+            data_()[size_++] = value;
         }
-    public:
-        template<typename Hash>
-        LockGuard( T const* ptr
-                 , detail::LockLayerImpl& lockpool
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-                 , const char* loc
-#endif
-                 , Hash const& hash)
-            : value_(hash(reinterpret_cast<size_t>(ptr)))
-            , owns_lock_(false)
-            , lock_pool_(lockpool)
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-            , loc_(loc)
-#endif
-        {
-            lock();
+
+        void resize(size_t size) {
+            reserve(size);
+            size_ = size;
         }
 
-        LockGuard(LockGuard const&) = delete;
+        void clear() {
+            size_ = 0;
+        }
 
-        LockGuard& operator = (LockGuard const&) = delete;
+        size_t size() const {
+            return size_;
+        }
 
-        LockGuard(LockGuard&& other)
-            : value_(other.value_)
-            , owns_lock_(other.owns_lock_)
-            , lock_pool_(other.lock_pool_)
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-            , loc_(other.loc_)
-#endif
-        {
-            other.owns_lock_ = false;
+        T& operator [] (size_t ix) {
+            return data_()[ix];
         }
 
-        LockGuard& operator = (LockGuard&& other) {
-            value_ = other.value_;
-            other.owns_lock_ = false;
-            assert(&lock_pool_ == &other.lock_pool_);
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-            loc_ = other.loc_;
-#endif
+        T const& operator [] (size_t ix) const {
+            return heap_ ? heap_[ix] : inline_[ix];
         }
 
-        ~LockGuard() {
-            if (owns_lock_) {
-                unlock();
+        T* begin() {
+            return data_();
+        }
+
+        T* end() {
+            return data_() + size_;
+        }
+    };
+
+#ifdef SYNCOPE_COLLECT_STATS
+    class LayerCounters;
+
+    //! List of all live lock layers
+    class LayerList {
+        std::mutex mutex_;
+        std::vector<LayerCounters const*> layers_;
+        LayerList() {}
+    public:
+        static LayerList& inst() {
+            static LayerList l;
+            return l;
+        }
+
+        void add(LayerCounters const* layer) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            layers_.push_back(layer);
+        }
+
+        void remove(LayerCounters const* layer) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            layers_.erase(std::remove(layers_.begin(), layers_.end(), layer), layers_.end());
+        }
+
+        template<class Fn>
+        void for_each(Fn const& fn) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            for (auto layer: layers_) {
+                fn(*layer);
             }
         }
     };
 
-    template<int P, typename... T>
-    class LockGuardMany {
-        enum {
-            H = sizeof...(T)*P  // hashes array size (can be greater than sizeof...(T))
+    /** Per-mutex lock counters.
+      * Counters of the mutex are updated only by the thread that holds
+      * this mutex so there is no RMW operations, only relaxed loads and stores.
+      */
+    class LayerCounters {
+        struct CountersWithPad {
+            std::atomic<uint64_t> acquisitions;
+            std::atomic<uint64_t> contended;
+            std::atomic<uint64_t> wait_ns;
+            char pad[64 - 3*sizeof(std::atomic<uint64_t>)];
+            CountersWithPad()
+                : acquisitions{0}
+                , contended{0}
+                , wait_ns{0}
+            {
+            }
         };
-        detail::LockLayerImpl& impl_;
-        std::array<size_t, H> hashes_;
-        size_t hashes_count_;
-        bool owns_lock_;
-#ifdef  SYNCOPE_DETECT_DEADLOCKS
-        const char* loc_;
-#endif
+        std::unique_ptr<CountersWithPad[]> counters_;
+        const size_t size_;
+        const char* name_;
+        const int id_;
+        const int level_;
 
-        template<int I, int M, int H>
-        struct fill_hashes
+        static void increment(std::atomic<uint64_t>& value, uint64_t delta) {
+            value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        }
+    public:
+        LayerCounters(const char* name, int id, int level, size_t size)
+            : counters_(new CountersWithPad[size])
+            , size_(size)
+            , name_(name)
+            , id_(id)
+            , level_(level)
         {
-            template<typename Hash>
-            void operator () (std::array<size_t, H>& hashes, std::tuple<T const*...> const& items, Hash const& hash) {
-                const auto p = std::get<I>(items);
-                for (int i = 0; i < P; i++) {
-                    size_t h = hash(reinterpret_cast<size_t>(p), i);
-                    hashes[I*P + i] = h;
-                }
-                fill_hashes<I + 1, M, H> fh;
-                fh(hashes, items, hash);
-            }
-        };
+            LayerList::inst().add(this);
+        }
+
+        ~LayerCounters() {
+            LayerList::inst().remove(this);
+        }
+
+        LayerCounters(LayerCounters const&) = delete;
+        LayerCounters& operator = (LayerCounters const&) = delete;
+
+        //! Must be called by the thread that holds the mutex
+        void on_lock(size_t ix) {
+            increment(counters_[ix].acquisitions, 1u);
+        }
+
+        //! Must be called by the thread that holds the mutex
+        void on_contended(size_t ix, std::chrono::steady_clock::duration wait) {
+            increment(counters_[ix].contended, 1u);
+            increment(counters_[ix].wait_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count());
+        }
+
+        const char* name() const {
+            return name_;
+        }
+
+        LayerStats snapshot() const {
+            LayerStats res;
+            res.name = name_;
+            res.id = id_;
+            res.level = level_;
+            res.stripes.resize(size_);
+            for (size_t i = 0; i < size_; i++) {
+                res.stripes[i].acquisitions = counters_[i].acquisitions.load(std::memory_order_relaxed);
+                res.stripes[i].contended = counters_[i].contended.load(std::memory_order_relaxed);
+                res.stripes[i].wait_ns = counters_[i].wait_ns.load(std::memory_order_relaxed);
+            }
+            return res;
+        }
+    };
+#endif
+
+#if defined(SYNCOPE_TRACE) || defined(SYNCOPE_RECORD)
+    //! Monotonic timestamp in nanoseconds
+    inline uint64_t trace_now() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    /** List of per-thread buffers (lock traces or lock records).
+      * Buffer of the exited thread is reused by the next new thread, so
+      * nothing is lost and memory is bounded by the number of live threads.
+      */
+    template<class Buffer>
+    class BufferList {
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<Buffer>> buffers_;
+        std::vector<Buffer*> free_;
+        uint64_t next_tid_;
+        BufferList() : next_tid_(1u) {}
+    public:
+        static BufferList& inst() {
+            static BufferList l;
+            return l;
+        }
+
+        Buffer* acquire() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            Buffer* res;
+            if (free_.empty()) {
+                buffers_.emplace_back(new Buffer());
+                res = buffers_.back().get();
+            } else {
+                res = free_.back();
+                free_.pop_back();
+            }
+            res->set_tid(next_tid_++);
+            return res;
+        }
+
+        void release(Buffer* buffer) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            free_.push_back(buffer);
+        }
+
+        template<class Fn>
+        void for_each(Fn const& fn) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            for (auto const& buffer: buffers_) {
+                fn(*buffer);
+            }
+        }
+    };
+#endif
+
+#ifdef SYNCOPE_TRACE
+
+    /** Lock trace of the thread: wait/hold histograms of every call site and ring buffer of recent events.
+      * Updated only by the owning thread without RMW operations (relaxed loads and stores),
+      * can be read by any thread at any time.
+      */
+    class ThreadTrace {
+        typedef std::atomic<uint64_t> Counter;
+
+        struct Site {
+            const char* layer;
+            int layer_id;
+            const char* loc;
+            std::unique_ptr<Counter[]> wait;
+            std::unique_ptr<Counter[]> hold;
+
+            Site(const char* layer, int layer_id, const char* loc)
+                : layer(layer)
+                , layer_id(layer_id)
+                , loc(loc)
+                , wait(new Counter[LatencyHistogram::BUCKETS])
+                , hold(new Counter[LatencyHistogram::BUCKETS])
+            {
+                for (int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+                    wait[i].store(0u, std::memory_order_relaxed);
+                    hold[i].store(0u, std::memory_order_relaxed);
+                }
+            }
+        };
+
+        //! Event slot, `seq` is odd while the slot is being written (seqlock)
+        struct Event {
+            Counter seq;
+            std::atomic<const char*> layer;
+            std::atomic<const char*> loc;
+            Counter tid;
+            Counter start;
+            Counter wait;
+            Counter hold;
+        };
+
+        std::unique_ptr<std::atomic<Site*>[]> sites_;
+        std::unique_ptr<Event[]> events_;
+        uint64_t head_;
+        //! Id of the owning thread in the trace output
+        std::atomic<uint64_t> tid_;
+
+        static void increment(Counter& value) {
+            value.store(value.load(std::memory_order_relaxed) + 1u, std::memory_order_relaxed);
+        }
+
+        //! Find or add the call site (open addressing), returns nullptr if the table is full
+        Site* site(const char* layer, int layer_id, const char* loc) {
+            size_t hash = reinterpret_cast<size_t>(loc)*0x9E3779B97F4A7C15ull + static_cast<size_t>(layer_id);
+            for (size_t i = 0; i < SYNCOPE_TRACE_SITES; i++) {
+                auto& slot = sites_[(hash + i) % SYNCOPE_TRACE_SITES];
+                Site* site = slot.load(std::memory_order_relaxed);
+                if (site == nullptr) {
+                    site = new Site(layer, layer_id, loc);
+                    slot.store(site, std::memory_order_release);
+                    return site;
+                }
+                if (site->loc == loc && site->layer_id == layer_id) {
+                    return site;
+                }
+            }
+            return nullptr;
+        }
+    public:
+        ThreadTrace()
+            : sites_(new std::atomic<Site*>[SYNCOPE_TRACE_SITES])
+            , events_(new Event[SYNCOPE_TRACE_EVENTS])
+            , head_(0u)
+            , tid_{0u}
+        {
+            for (size_t i = 0; i < SYNCOPE_TRACE_SITES; i++) {
+                sites_[i].store(nullptr, std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < SYNCOPE_TRACE_EVENTS; i++) {
+                events_[i].seq.store(0u, std::memory_order_relaxed);
+            }
+        }
+
+        ~ThreadTrace() {
+            for (size_t i = 0; i < SYNCOPE_TRACE_SITES; i++) {
+                delete sites_[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        ThreadTrace(ThreadTrace const&) = delete;
+        ThreadTrace& operator = (ThreadTrace const&) = delete;
+
+        void set_tid(uint64_t tid) {
+            tid_.store(tid, std::memory_order_relaxed);
+        }
+
+        //! Must be called by the owning thread
+        void record(const char* layer, int layer_id, const char* loc, uint64_t start, uint64_t wait, uint64_t hold) {
+            Site* s = site(layer, layer_id, loc);
+            if (s) {
+                increment(s->wait[LatencyHistogram::bucket(wait)]);
+                increment(s->hold[LatencyHistogram::bucket(hold)]);
+            }
+            Event& e = events_[head_ % SYNCOPE_TRACE_EVENTS];
+            e.seq.store(2*head_ + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            e.layer.store(layer, std::memory_order_relaxed);
+            e.loc.store(loc, std::memory_order_relaxed);
+            e.tid.store(tid_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            e.start.store(start, std::memory_order_relaxed);
+            e.wait.store(wait, std::memory_order_relaxed);
+            e.hold.store(hold, std::memory_order_relaxed);
+            e.seq.store(2*head_ + 2, std::memory_order_release);
+            head_++;
+        }
+
+        //! Merge histograms of all call sites into `res`
+        void merge_into(std::vector<SiteTrace>& res) const {
+            for (size_t i = 0; i < SYNCOPE_TRACE_SITES; i++) {
+                Site const* s = sites_[i].load(std::memory_order_acquire);
+                if (s == nullptr) {
+                    continue;
+                }
+                SiteTrace* dest = nullptr;
+                for (auto& r: res) {
+                    if (r.site == s->loc && r.layer == s->layer) {
+                        dest = &r;
+                        break;
+                    }
+                }
+                if (dest == nullptr) {
+                    res.push_back(SiteTrace());
+                    dest = &res.back();
+                    dest->layer = s->layer;
+                    dest->site = s->loc;
+                }
+                for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+                    dest->wait.counts[b] += s->wait[b].load(std::memory_order_relaxed);
+                    dest->hold.counts[b] += s->hold[b].load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        //! Call `fn(layer, loc, tid, start, wait, hold)` for every consistent event in the buffer
+        template<class Fn>
+        void for_each_event(Fn const& fn) const {
+            for (size_t i = 0; i < SYNCOPE_TRACE_EVENTS; i++) {
+                Event const& e = events_[i];
+                uint64_t seq = e.seq.load(std::memory_order_acquire);
+                if (seq == 0u || (seq & 1u)) {
+                    continue;
+                }
+                const char* layer = e.layer.load(std::memory_order_relaxed);
+                const char* loc = e.loc.load(std::memory_order_relaxed);
+                uint64_t tid = e.tid.load(std::memory_order_relaxed);
+                uint64_t start = e.start.load(std::memory_order_relaxed);
+                uint64_t wait = e.wait.load(std::memory_order_relaxed);
+                uint64_t hold = e.hold.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (e.seq.load(std::memory_order_relaxed) == seq) {
+                    fn(layer, loc, tid, start, wait, hold);
+                }
+            }
+        }
+    };
+
+    typedef BufferList<ThreadTrace> TraceList;
+#endif
+
+#ifdef SYNCOPE_RECORD
+    /** Ring buffer of the lock records of the thread.
+      * Written only by the owning thread, every slot is a seqlock, so
+      * the buffer can be copied by any thread at any time. Read cursor
+      * remembers what was already drained (see LockRecorder::drain).
+      */
+    class ThreadRecord {
+        typedef std::atomic<uint64_t> Counter;
+
+        //! Record slot, `seq` is odd while the slot is being written
+        struct Slot {
+            Counter seq;
+            Counter time;
+            Counter hash;
+            Counter info;       //! wait << 32 | layer << 16 | op
+            Counter tid;
+        };
+
+        std::unique_ptr<Slot[]> slots_;
+        std::atomic<uint64_t> head_;
+        std::atomic<uint64_t> tid_;
+        //! Sequence number of the first record that wasn't drained yet
+        uint64_t cursor_;
+
+        //! Copy the slot written with `seq`, returns false if it was overwritten while copying
+        bool load(Slot const& s, uint64_t seq, uint64_t* tid, LockRecord* r) const {
+            r->time = s.time.load(std::memory_order_relaxed);
+            r->hash = s.hash.load(std::memory_order_relaxed);
+            uint64_t info = s.info.load(std::memory_order_relaxed);
+            *tid = s.tid.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) != seq) {
+                return false;
+            }
+            r->wait = static_cast<uint32_t>(info >> 32);
+            r->layer = static_cast<uint16_t>(info >> 16);
+            r->op = static_cast<uint16_t>(info);
+            return true;
+        }
+    public:
+        ThreadRecord()
+            : slots_(new Slot[SYNCOPE_RECORD_EVENTS])
+            , head_{0u}
+            , tid_{0u}
+            , cursor_(0u)
+        {
+            for (size_t i = 0; i < SYNCOPE_RECORD_EVENTS; i++) {
+                slots_[i].seq.store(0u, std::memory_order_relaxed);
+            }
+        }
+
+        ThreadRecord(ThreadRecord const&) = delete;
+        ThreadRecord& operator = (ThreadRecord const&) = delete;
+
+        void set_tid(uint64_t tid) {
+            tid_.store(tid, std::memory_order_relaxed);
+        }
+
+        //! Must be called by the owning thread
+        void record(LockRecord::Op op, int layer, size_t hash, uint64_t wait) {
+            uint64_t info = (std::min<uint64_t>(wait, UINT32_MAX) << 32)
+                          | (static_cast<uint64_t>(layer & 0xFFFF) << 16)
+                          | static_cast<uint64_t>(op);
+            uint64_t head = head_.load(std::memory_order_relaxed);
+            Slot& s = slots_[head % SYNCOPE_RECORD_EVENTS];
+            s.seq.store(2*head + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            s.time.store(trace_now(), std::memory_order_relaxed);
+            s.hash.store(static_cast<uint64_t>(hash), std::memory_order_relaxed);
+            s.info.store(info, std::memory_order_relaxed);
+            s.tid.store(tid_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            s.seq.store(2*head + 2, std::memory_order_release);
+            head_.store(head + 1, std::memory_order_release);
+        }
+
+        //! Call `fn(seqno, tid, record)` for every consistent record in the buffer
+        template<class Fn>
+        void for_each(Fn const& fn) const {
+            for (size_t i = 0; i < SYNCOPE_RECORD_EVENTS; i++) {
+                Slot const& s = slots_[i];
+                uint64_t seq = s.seq.load(std::memory_order_acquire);
+                if (seq == 0u || (seq & 1u)) {
+                    continue;
+                }
+                LockRecord r;
+                uint64_t tid;
+                if (load(s, seq, &tid, &r)) {
+                    fn(seq/2, tid, r);
+                }
+            }
+        }
+
+        /** Call `fn(tid, record)` for every record written since the previous call, in order.
+          * Returns number of records that were overwritten before they were read.
+          * Calls must be serialized (done under the mutex of the buffer list).
+          */
+        template<class Fn>
+        uint64_t drain(Fn const& fn) {
+            uint64_t head = head_.load(std::memory_order_acquire);
+            uint64_t first = head > SYNCOPE_RECORD_EVENTS ? head - SYNCOPE_RECORD_EVENTS : 0u;
+            first = std::max(first, cursor_);
+            uint64_t dropped = first - cursor_;
+            for (uint64_t n = first; n < head; n++) {
+                LockRecord r;
+                uint64_t tid;
+                if (load(slots_[n % SYNCOPE_RECORD_EVENTS], 2*n + 2, &tid, &r)) {
+                    fn(tid, r);
+                } else {
+                    dropped++;
+                }
+            }
+            cursor_ = head;
+            return dropped;
+        }
+    };
+
+    typedef BufferList<ThreadRecord> RecordList;
+
+    //! Layers created while recording is enabled (layers are never removed, trace can outlive them)
+    class RecordedLayers {
+        std::mutex mutex_;
+        std::vector<LockTrace::Layer> layers_;
+    public:
+        static RecordedLayers& inst() {
+            static RecordedLayers l;
+            return l;
+        }
+
+        void add(int id, int level, size_t stripes, const char* name) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            layers_.push_back(LockTrace::Layer{id, level, static_cast<uint64_t>(stripes), name ? name : ""});
+        }
+
+        std::vector<LockTrace::Layer> get() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            return layers_;
+        }
+    };
+#endif
+
+    struct TraceRoot {
+        typedef std::tuple<LockLayerImpl*, const char*> Owner;
+        std::unique_ptr<Owner[]> owners;
+        int top;
+        //! Number of locks that didn't fit into `owners`
+        int overflow;
+        //! Bitmap of the lock-order graph edges already seen by this thread
+        std::vector<uint64_t> seen;
+        //! Sampling state
+        uint32_t rand;
+        std::array<std::pair<const char*, uint32_t>, 64> sites;
+#ifdef SYNCOPE_TRACE
+        //! Held lock being traced
+        struct Frame {
+            LockLayerImpl* layer;
+            const char* loc;
+            uint64_t start;     //! acquisition started
+            uint64_t acquired;  //! acquisition completed (0 - same as start)
+        };
+        std::unique_ptr<Frame[]> frames;
+        int frames_top;
+        int frames_overflow;
+        ThreadTrace* trace;
+#endif
+#ifdef SYNCOPE_RECORD
+        ThreadRecord* record;
+#endif
+
+        TraceRoot() 
+            : owners(new Owner[SYNCOPE_MAX_DEPTH])
+            , top(0)
+            , overflow(0)
+            , seen((SYNCOPE_MAX_LAYERS*SYNCOPE_MAX_LAYERS + 63)/64, 0u)
+            , rand(static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1u)
+#ifdef SYNCOPE_TRACE
+            , frames(new Frame[SYNCOPE_MAX_DEPTH])
+            , frames_top(0)
+            , frames_overflow(0)
+            , trace(nullptr)
+#endif
+#ifdef SYNCOPE_RECORD
+            , record(nullptr)
+#endif
+        {
+            sites.fill(std::make_pair(nullptr, 0u));
+        }
+
+#if defined(SYNCOPE_TRACE) || defined(SYNCOPE_RECORD)
+        ~TraceRoot() {
+#ifdef SYNCOPE_TRACE
+            if (trace) {
+                TraceList::inst().release(trace);
+            }
+#endif
+#ifdef SYNCOPE_RECORD
+            if (record) {
+                RecordList::inst().release(record);
+            }
+#endif
+        }
+#endif
+    };
+
+#ifdef SYNCOPE_DETECT_DEADLOCKS
+    /** Lock-order graph.
+      * Vertices are lock layers, edge A->B is added when layer B is locked
+      * while layer A is held. Every cycle in this graph is a potential deadlock.
+      * Edges are added under the mutex, each thread caches edges that it
+      * has already seen, so steady-state locking doesn't write to shared memory.
+      */
+    class Detector {
+        static const int MAX_LAYERS = SYNCOPE_MAX_LAYERS;
+        struct Edge {
+            const char* from_name;
+            const char* from_loc;
+            const char* to_name;
+            const char* to_loc;
+            bool reported;
+        };
+        std::mutex mutex_;
+        //! Adjacency matrix, edge exists if `from_loc` isn't null
+        std::vector<Edge> edges_;
+        bool too_many_layers_;
+        DeadlockHandler handler_;
+        //! Sampling probability scaled to 2^32
+        std::atomic<uint64_t> threshold_;
+        std::atomic<uint32_t> first_per_site_;
+
+        Detector()
+            : edges_(MAX_LAYERS*MAX_LAYERS, Edge{nullptr, nullptr, nullptr, nullptr, false})
+            , too_many_layers_(false)
+            , threshold_{uint64_t(1u) << 32}
+            , first_per_site_{0u}
+        {
+        }
+
+        //! Find path from `from` to `to`, returns empty vector if not found
+        std::vector<int> find_path(int from, int to) const;
+    public:
+        static Detector& inst() {
+            static Detector d;
+            return d;
+        }
+
+        //! Returns true if the lock-order check should be performed for this acquisition
+        bool sample(TraceRoot& root, const char* loc) {
+            auto threshold = threshold_.load(std::memory_order_relaxed);
+            auto first = first_per_site_.load(std::memory_order_relaxed);
+            if (first) {
+                auto& site = root.sites[(reinterpret_cast<size_t>(loc) >> 3) % root.sites.size()];
+                if (site.first != loc) {
+                    site = std::make_pair(loc, 0u);
+                }
+                if (site.second < first) {
+                    site.second++;
+                    return true;
+                }
+            }
+            if (threshold == 0) {
+                return false;
+            }
+            // xorshift32
+            root.rand ^= root.rand << 13;
+            root.rand ^= root.rand >> 17;
+            root.rand ^= root.rand << 5;
+            return root.rand < threshold;
+        }
+
+        void set_sample_rate(double rate) {
+            rate = std::min(std::max(rate, 0.0), 1.0);
+            threshold_.store(static_cast<uint64_t>(rate*double(uint64_t(1u) << 32)), std::memory_order_relaxed);
+        }
+
+        void set_first_per_site(uint32_t n) {
+            first_per_site_.store(n, std::memory_order_relaxed);
+        }
+
+        void set_handler(DeadlockHandler handler) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            handler_ = handler;
+        }
+
+        //! Pass report to the user handler (print and terminate if not set)
+        void report(DeadlockReport const& report) {
+            DeadlockHandler handler;
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                handler = handler_;
+            }
+            if (handler) {
+                handler(report);
+            } else {
+                std::cout << report.str() << std::endl;
+                std::terminate();
+            }
+        }
+
+        //! Add edge prev->curr to the lock-order graph, report if it closes the cycle
+        void on_lock(TraceRoot::Owner const& prev, TraceRoot::Owner const& curr);
+    };
+#endif
+
+    /** Striped wait queues.
+      * Waiter parks on the queue selected by the mutex index of the object
+      * and is woken up only by notifications for the same object address.
+      */
+    class WaitQueues {
+        struct Waiter {
+            const void* addr;
+            bool notified;
+            Waiter* prev;
+            Waiter* next;
+            std::condition_variable cond;
+        };
+        struct Queue {
+            std::mutex mutex;
+            Waiter* head;
+            Queue() : head(nullptr) {}
+        };
+        std::unique_ptr<Queue[]> queues_;
+
+        static void link(Queue& q, Waiter* w) {
+            w->prev = nullptr;
+            w->next = q.head;
+            if (q.head) {
+                q.head->prev = w;
+            }
+            q.head = w;
+        }
+
+        static void unlink(Queue& q, Waiter* w) {
+            if (w->prev) {
+                w->prev->next = w->next;
+            } else {
+                q.head = w->next;
+            }
+            if (w->next) {
+                w->next->prev = w->prev;
+            }
+        }
+
+    public:
+        WaitQueues(size_t size)
+            : queues_(new Queue[size])
+        {
+        }
+
+        /** Release the guard and wait for notification, reacquire the guard after that.
+          * Returns false on timeout.
+          */
+        template<class Guard, class Clock, class Duration>
+        bool wait_until(Guard& guard, size_t ix, const void* addr, std::chrono::time_point<Clock, Duration> const* deadline) {
+            Queue& q = queues_[ix];
+            Waiter w;
+            w.addr = addr;
+            w.notified = false;
+            std::unique_lock<std::mutex> lock(q.mutex);
+            link(q, &w);
+            // notification can't be lost after the waiter is linked, the guard is released
+            // without the queue mutex because unlock may resume coroutines
+            lock.unlock();
+            guard.unlock();
+            lock.lock();
+            bool timeout = false;
+            while (!w.notified && !timeout) {
+                if (deadline) {
+                    timeout = w.cond.wait_until(lock, *deadline) == std::cv_status::timeout;
+                } else {
+                    w.cond.wait(lock);
+                }
+            }
+            if (!w.notified) {
+                unlink(q, &w);
+            }
+            lock.unlock();
+            guard.lock();
+            return w.notified;
+        }
+
+        //! Wake up waiters of the object (all or only one)
+        void notify(size_t ix, const void* addr, bool all) {
+            Queue& q = queues_[ix];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            for (Waiter* w = q.head; w != nullptr;) {
+                Waiter* next = w->next;
+                if (w->addr == addr) {
+                    unlink(q, w);
+                    w->notified = true;
+                    w->cond.notify_one();
+                    if (!all) {
+                        break;
+                    }
+                }
+                w = next;
+            }
+        }
+    };
+
+    /** Asymmetric memory fence.
+      * Orders a store followed by a load on both sides of the Dekker-style
+      * handshake between the frequent side (`light`: unlocking thread, RCU
+      * reader) and the rare side (`heavy`: parking coroutine, RCU writer). On
+      * Linux `heavy` forces a barrier on all running threads of the process
+      * (membarrier), so `light` is just a compiler barrier. Otherwise both
+      * sides are full fences.
+      */
+    class AsymmetricFence {
+        static bool expedited() {
+#ifdef SYNCOPE_HAVE_MEMBARRIER
+            static const bool res = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+            return res;
+#else
+            return false;
+#endif
+        }
+    public:
+        static void light() {
+            if (expedited()) {
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+            } else {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+
+        static void heavy() {
+#ifdef SYNCOPE_HAVE_MEMBARRIER
+            if (expedited()) {
+                syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+                return;
+            }
+#endif
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    };
+
+#ifdef SYNCOPE_HAVE_COROUTINES
+    /** Striped queues of suspended coroutines.
+      * Coroutine that failed to acquire the mutex `ix` parks on the queue `ix`,
+      * every unlock of the mutex resumes the oldest parked coroutine (it retries
+      * the acquisition and parks again if the mutex was taken by somebody else).
+      */
+    class AsyncQueues {
+    public:
+        enum {
+            PARKING,  //! coroutine is being suspended
+            PARKED,   //! coroutine is suspended
+            WOKEN,    //! node was removed from the queue
+        };
+        struct Node {
+            std::coroutine_handle<> handle;
+            void (*dispatch)(void*, std::coroutine_handle<>);
+            void* executor;
+            Node* next;
+            std::atomic<int> state;
+        };
+    private:
+        struct Queue {
+            std::mutex mutex;
+            Node* head;
+            Node* tail;
+            //! Number of parked coroutines, checked by the unlocking thread without locking
+            std::atomic<size_t> count;
+            Queue() : head(nullptr), tail(nullptr), count{0u} {}
+        };
+        std::unique_ptr<Queue[]> queues_;
+
+    public:
+        AsyncQueues(size_t size)
+            : queues_(new Queue[size])
+        {
+        }
+
+        //! Park the node, caller must recheck the mutex after that
+        void push(size_t ix, Node* node) {
+            Queue& q = queues_[ix];
+            node->next = nullptr;
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.tail) {
+                q.tail->next = node;
+            } else {
+                q.head = node;
+            }
+            q.tail = node;
+            q.count.fetch_add(1u, std::memory_order_relaxed);
+        }
+
+        /** Resume the oldest coroutine parked on the queue (mutex `ix` was just released).
+          * Coroutine that is still being suspended is not dispatched, it resumes itself.
+          * Caller must issue AsymmetricFence::light after releasing the mutex.
+          */
+        void wake(size_t ix) {
+            Queue& q = queues_[ix];
+            if (q.count.load(std::memory_order_relaxed) == 0u) {
+                return;
+            }
+            Node* node;
+            std::coroutine_handle<> handle;
+            void (*dispatch)(void*, std::coroutine_handle<>);
+            void* executor;
+            {
+                std::lock_guard<std::mutex> lock(q.mutex);
+                node = q.head;
+                if (node == nullptr) {
+                    return;
+                }
+                q.head = node->next;
+                if (q.head == nullptr) {
+                    q.tail = nullptr;
+                }
+                q.count.fetch_sub(1u, std::memory_order_relaxed);
+                handle = node->handle;
+                dispatch = node->dispatch;
+                executor = node->executor;
+            }
+            // node can't be used after that
+            if (node->state.exchange(WOKEN, std::memory_order_acq_rel) == PARKED) {
+                dispatch(executor, handle);
+            }
+        }
+
+        //! Resume all coroutines parked on the queue
+        void wake_all(size_t ix) {
+            Queue& q = queues_[ix];
+            if (q.count.load(std::memory_order_relaxed) == 0u) {
+                return;
+            }
+            Node* node;
+            {
+                std::lock_guard<std::mutex> lock(q.mutex);
+                node = q.head;
+                q.head = q.tail = nullptr;
+                q.count.store(0u, std::memory_order_relaxed);
+            }
+            while (node) {
+                Node* next = node->next;
+                std::coroutine_handle<> handle = node->handle;
+                void (*dispatch)(void*, std::coroutine_handle<>) = node->dispatch;
+                void* executor = node->executor;
+                if (node->state.exchange(WOKEN, std::memory_order_acq_rel) == PARKED) {
+                    dispatch(executor, handle);
+                }
+                node = next;
+            }
+        }
+    };
+#endif
+
+#ifdef SYNCOPE_WORD_LOCKS
+    /** Parking lot.
+      * Global hash table of wait queues keyed by the address of the lock word.
+      * Threads that failed to acquire the word lock park here, so the lock
+      * itself needs only two bits. Validation and unpark callbacks run under
+      * the queue mutex, this makes "check the word and sleep" atomic.
+      */
+    class ParkingLot {
+        struct Parker {
+            const void* addr;
+            bool unparked;
+            Parker* prev;
+            Parker* next;
+            std::condition_variable cond;
+        };
+        struct alignas(64) Queue {
+            std::mutex mutex;
+            Parker* head;
+            Parker* tail;
+            Queue() : head(nullptr), tail(nullptr) {}
+        };
+        static const size_t QUEUES = 0x100;
+        Queue queues_[QUEUES];
+
+        ParkingLot() {}
+
+        Queue& queue(const void* addr) {
+            return queues_[(reinterpret_cast<uint64_t>(addr)*0x9E3779B97F4A7C15ull >> 32) % QUEUES];
+        }
+
+        static void unlink(Queue& q, Parker* p) {
+            if (p->prev) {
+                p->prev->next = p->next;
+            } else {
+                q.head = p->next;
+            }
+            if (p->next) {
+                p->next->prev = p->prev;
+            } else {
+                q.tail = p->prev;
+            }
+        }
+    public:
+        static ParkingLot& inst() {
+            static ParkingLot lot;
+            return lot;
+        }
+
+        /** Park the thread if `validate()` returns true.
+          * Returns false on timeout, true if the thread was unparked or validation failed.
+          */
+        template<class Validate, class Clock, class Duration>
+        bool park(const void* addr, Validate const& validate, std::chrono::time_point<Clock, Duration> const* deadline) {
+            Queue& q = queue(addr);
+            std::unique_lock<std::mutex> lock(q.mutex);
+            if (!validate()) {
+                return true;
+            }
+            Parker p;
+            p.addr = addr;
+            p.unparked = false;
+            p.prev = q.tail;
+            p.next = nullptr;
+            if (q.tail) {
+                q.tail->next = &p;
+            } else {
+                q.head = &p;
+            }
+            q.tail = &p;
+            while (!p.unparked) {
+                if (deadline == nullptr) {
+                    p.cond.wait(lock);
+                } else if (p.cond.wait_until(lock, *deadline) == std::cv_status::timeout && !p.unparked) {
+                    unlink(q, &p);
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /** Unpark the oldest thread parked on `addr`.
+          * `callback(more)` is called under the queue mutex in any case, `more` is
+          * true if other threads are still parked on the same address.
+          */
+        template<class Callback>
+        void unpark_one(const void* addr, Callback const& callback) {
+            Queue& q = queue(addr);
+            std::lock_guard<std::mutex> lock(q.mutex);
+            Parker* p = q.head;
+            while (p && p->addr != addr) {
+                p = p->next;
+            }
+            bool more = false;
+            if (p) {
+                unlink(q, p);
+                for (Parker* n = p->next; n; n = n->next) {
+                    if (n->addr == addr) {
+                        more = true;
+                        break;
+                    }
+                }
+            }
+            callback(more);
+            if (p) {
+                p->unparked = true;
+                p->cond.notify_one();
+            }
+        }
+    };
+
+    /** One byte lock (WebKit's WTF::Lock scheme).
+      * Uncontended lock and unlock are single CAS operations. Contended thread
+      * spins for a while, then sets PARKED bit and parks in the ParkingLot,
+      * unlock goes to the parking lot only if PARKED bit is set.
+      */
+    class WordLock {
+        enum {
+            LOCKED = 1,
+            PARKED = 2,
+            SPIN_LIMIT = 40,
+        };
+        std::atomic<uint8_t> word_;
+
+        template<class Clock, class Duration>
+        bool lock_slow(std::chrono::time_point<Clock, Duration> const* deadline) {
+            int spin = 0;
+            for (;;) {
+                uint8_t word = word_.load(std::memory_order_relaxed);
+                if ((word & LOCKED) == 0) {
+                    if (word_.compare_exchange_weak(word, word | LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+                        return true;
+                    }
+                    continue;
+                }
+                if ((word & PARKED) == 0 && spin < SPIN_LIMIT) {
+                    spin++;
+                    std::this_thread::yield();
+                    continue;
+                }
+                if ((word & PARKED) == 0 &&
+                    !word_.compare_exchange_weak(word, word | PARKED, std::memory_order_relaxed, std::memory_order_relaxed)) {
+                    continue;
+                }
+                bool ok = ParkingLot::inst().park(&word_, [this] {
+                    return word_.load(std::memory_order_relaxed) == (LOCKED | PARKED);
+                }, deadline);
+                if (!ok) {
+                    // PARKED bit can be stale now, unlock will clear it
+                    return false;
+                }
+            }
+        }
+
+        void unlock_slow() {
+            for (;;) {
+                uint8_t word = word_.load(std::memory_order_relaxed);
+                if (word == LOCKED) {
+                    if (word_.compare_exchange_weak(word, 0, std::memory_order_release, std::memory_order_relaxed)) {
+                        return;
+                    }
+                    continue;
+                }
+                ParkingLot::inst().unpark_one(&word_, [this](bool more) {
+                    word_.store(more ? PARKED : 0, std::memory_order_release);
+                });
+                return;
+            }
+        }
+    public:
+        WordLock() : word_{0} {}
+
+        WordLock(WordLock const&) = delete;
+        WordLock& operator = (WordLock const&) = delete;
+
+        void lock() {
+            uint8_t word = 0;
+            if (!word_.compare_exchange_weak(word, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+                lock_slow(static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+            }
+        }
+
+        bool try_lock() {
+            uint8_t word = word_.load(std::memory_order_relaxed);
+            while ((word & LOCKED) == 0) {
+                if (word_.compare_exchange_weak(word, word | LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        template<class Clock, class Duration>
+        bool try_lock_until(std::chrono::time_point<Clock, Duration> const& deadline) {
+            uint8_t word = 0;
+            if (word_.compare_exchange_strong(word, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return true;
+            }
+            return lock_slow(&deadline);
+        }
+
+        void unlock() {
+            uint8_t word = LOCKED;
+            if (!word_.compare_exchange_strong(word, 0, std::memory_order_release, std::memory_order_relaxed)) {
+                unlock_slow();
+            }
+        }
+    };
+#endif
+
+    /** Kind of the per-object lock as seen by the layer-wide lock (gate).
+      * Read locks of the asymmetric layer pass the gate while the layer is locked
+      * in shared mode, everything else waits until the gate is open.
+      */
+    enum class GateKind {
+        EXCLUSIVE,
+        READ,
+    };
+
+    /** Pool of mutexes.
+      * Number of mutexes and alignment are set at construction time (by the layer's
+      * template parameters). If alignment is greater than the size of the mutex,
+      * every mutex is padded to occupy its own aligned slot (e.g. cache line).
+      */
+    class LockLayerImpl {
+#ifdef SYNCOPE_WORD_LOCKS
+        typedef WordLock MutexT;
+#else
+        typedef std::timed_mutex MutexT;
+#endif
+        const size_t size_;
+        const size_t mask_;
+        //! Distance between mutexes in bytes
+        const size_t stride_;
+        std::unique_ptr<char[]> buffer_;
+        char* mutexes_;
+        const char* name_;
+        int level_;
+        const int id_;
+#ifdef SYNCOPE_COLLECT_STATS
+        LayerCounters counters_;
+#endif
+        //! Allocated on first wait
+        std::atomic<WaitQueues*> waitq_;
+#ifdef SYNCOPE_HAVE_COROUTINES
+        //! Allocated on first asynchronous wait
+        std::atomic<AsyncQueues*> asyncq_;
+#endif
+        //! Layer-wide lock: 0 - not locked, N > 0 - number of shared holders, -1 - locked exclusively
+        std::atomic<int> gate_;
+        //! Exclusive layer-wide lockers waiting for the gate, new shared holders wait for them
+        int gate_writers_;
+        std::mutex gate_mutex_;
+        std::condition_variable gate_cv_;
+        static thread_local TraceRoot tls_root;
+        static std::atomic<int> layers_counter;
+
+        static size_t stride(size_t align) {
+            if (align <= alignof(MutexT)) {
+                return sizeof(MutexT);
+            }
+            return (sizeof(MutexT) + align - 1)/align*align;
+        }
+
+        MutexT& mutex(size_t ix) const {
+            return *reinterpret_cast<MutexT*>(mutexes_ + ix*stride_);
+        }
+    public:
+        /** C-tor
+          * @param size number of mutexes (power of two)
+          * @param align alignment of every mutex in bytes (0 - no padding)
+          */
+        LockLayerImpl(const char* name, int level, size_t size = SYNCOPE_NUM_LOCKS, size_t align = SYNCOPE_STRIPE_ALIGN)
+            : size_(size)
+            , mask_(size - 1)
+            , stride_(stride(align))
+            , buffer_(new char[size*stride_ + std::max(align, alignof(MutexT))])
+            , mutexes_(nullptr)
+            , name_(name)
+            , level_(level)
+            , id_(layers_counter++)
+#ifdef SYNCOPE_COLLECT_STATS
+            , counters_(name, id_, level, size)
+#endif
+            , waitq_{nullptr}
+#ifdef SYNCOPE_HAVE_COROUTINES
+            , asyncq_{nullptr}
+#endif
+            , gate_{0}
+            , gate_writers_(0)
+        {
+            assert(size && (size & (size - 1)) == 0);
+            size_t a = std::max(align, alignof(MutexT));
+            size_t addr = reinterpret_cast<size_t>(buffer_.get());
+            mutexes_ = buffer_.get() + (a - addr % a) % a;
+            for (size_t i = 0; i < size_; i++) {
+                new (mutexes_ + i*stride_) MutexT();
+            }
+#ifdef SYNCOPE_RECORD
+            RecordedLayers::inst().add(id_, level_, size_, name_);
+#endif
+        }
+
+        ~LockLayerImpl() {
+            delete waitq_.load();
+#ifdef SYNCOPE_HAVE_COROUTINES
+            delete asyncq_.load();
+#endif
+            for (size_t i = 0; i < size_; i++) {
+                mutex(i).~MutexT();
+            }
+        }
+
+        LockLayerImpl(LockLayerImpl const&) = delete;
+        LockLayerImpl& operator = (LockLayerImpl const&) = delete;
+
+        void lock(size_t hash) {
+            assert(!running_closures() && "closures of the combining layer must not acquire locks");
+            size_t ix = hash & mask_;
+#if defined(SYNCOPE_COLLECT_STATS) || defined(SYNCOPE_RECORD)
+            std::chrono::steady_clock::duration wait{0};
+            if (!mutex(ix).try_lock()) {
+                auto start = std::chrono::steady_clock::now();
+                mutex(ix).lock();
+                wait = std::chrono::steady_clock::now() - start;
+#ifdef SYNCOPE_COLLECT_STATS
+                counters_.on_contended(ix, wait);
+#endif
+            }
+#ifdef SYNCOPE_COLLECT_STATS
+            counters_.on_lock(ix);
+#endif
+#ifdef SYNCOPE_RECORD
+            record(LockRecord::ACQUIRE, hash, wait);
+#endif
+#else
+            mutex(ix).lock();
+#endif
+        }
+
+        bool try_lock(size_t hash) {
+            assert(!running_closures() && "closures of the combining layer must not acquire locks");
+            size_t ix = hash & mask_;
+            bool res = mutex(ix).try_lock();
+#ifdef SYNCOPE_COLLECT_STATS
+            if (res) {
+                counters_.on_lock(ix);
+            }
+#endif
+#ifdef SYNCOPE_RECORD
+            if (res) {
+                record(LockRecord::ACQUIRE, hash, std::chrono::steady_clock::duration{0});
+            }
+#endif
+            return res;
+        }
+
+        template<class Clock, class Duration>
+        bool try_lock_until(size_t hash, std::chrono::time_point<Clock, Duration> const& deadline) {
+            assert(!running_closures() && "closures of the combining layer must not acquire locks");
+            size_t ix = hash & mask_;
+#if defined(SYNCOPE_COLLECT_STATS) || defined(SYNCOPE_RECORD)
+            std::chrono::steady_clock::duration wait{0};
+            if (!mutex(ix).try_lock()) {
+                auto start = std::chrono::steady_clock::now();
+                if (!mutex(ix).try_lock_until(deadline)) {
+                    return false;
+                }
+                wait = std::chrono::steady_clock::now() - start;
+#ifdef SYNCOPE_COLLECT_STATS
+                counters_.on_contended(ix, wait);
+#endif
+            }
+#ifdef SYNCOPE_COLLECT_STATS
+            counters_.on_lock(ix);
+#endif
+#ifdef SYNCOPE_RECORD
+            record(LockRecord::ACQUIRE, hash, wait);
+#endif
+            return true;
+#else
+            return mutex(ix).try_lock_until(deadline);
+#endif
+        }
+
+
+        void unlock(size_t hash) {
+            size_t ix = hash & mask_;
+#ifdef SYNCOPE_RECORD
+            record(LockRecord::RELEASE, hash, std::chrono::steady_clock::duration{0});
+#endif
+            mutex(ix).unlock();
+#ifdef SYNCOPE_HAVE_COROUTINES
+            wake(ix);
+#endif
+        }
+
+#ifdef SYNCOPE_HAVE_COROUTINES
+        /** Resume the coroutine waiting for the mutex `ix`.
+          * Stripe without parked coroutines costs a compiler barrier and two loads.
+          */
+        void wake(size_t ix) {
+            // pairs with AsymmetricFence::heavy in StripeReleased::await_suspend
+            AsymmetricFence::light();
+            AsyncQueues* asyncq = asyncq_.load(std::memory_order_acquire);
+            if (asyncq) {
+                asyncq->wake(ix);
+            }
+        }
+
+        //! Resume every coroutine waiting for the gate
+        void wake_gate() {
+            // pairs with AsymmetricFence::heavy in GateOpened::await_suspend
+            AsymmetricFence::light();
+            AsyncQueues* asyncq = asyncq_.load(std::memory_order_acquire);
+            if (asyncq) {
+                asyncq->wake_all(size_);
+            }
+        }
+
+        /** Park the coroutine until the mutex `ix` is released.
+          * Queue `size()` is the wait list of the gate (see wake_gate).
+          */
+        void park(size_t ix, AsyncQueues::Node* node) {
+            AsyncQueues* asyncq = asyncq_.load(std::memory_order_acquire);
+            if (asyncq == nullptr) {
+                std::unique_ptr<AsyncQueues> tmp(new AsyncQueues(size_ + 1));
+                if (asyncq_.compare_exchange_strong(asyncq, tmp.get(), std::memory_order_acq_rel)) {
+                    asyncq = tmp.release();
+                }
+            }
+            asyncq->push(ix, node);
+        }
+#endif
+
+        static bool gate_passes(int gate, GateKind kind) {
+            return gate == 0 || (gate > 0 && kind == GateKind::READ);
+        }
+
+        /** Returns false if the layer-wide lock blocks locks of the given kind.
+          * Guards check the gate after their mutexes are acquired, if it's closed
+          * they release the mutexes and wait (see gate_wait).
+          */
+        bool gate_open(GateKind kind) const {
+            return gate_passes(gate_.load(std::memory_order_acquire), kind);
+        }
+
+        /** Wait until the layer-wide lock lets locks of the given kind through,
+          * returns false if deadline is reached. Caller must not hold any mutex of the layer.
+          */
+        template<class Clock, class Duration>
+        bool gate_wait(GateKind kind, std::chrono::time_point<Clock, Duration> const* deadline) {
+            if (gate_open(kind)) {
+                return true;
+            }
+            std::unique_lock<std::mutex> lock(gate_mutex_);
+            auto open = [this, kind] { return gate_passes(gate_.load(std::memory_order_relaxed), kind); };
+            if (deadline) {
+                return gate_cv_.wait_until(lock, *deadline, open);
+            }
+            gate_cv_.wait(lock, open);
+            return true;
+        }
+
+        /** Acquire the layer-wide lock (exclusive or shared), returns false if deadline is reached.
+          * Gate is closed first so new guards back off, then every mutex is acquired
+          * and released once to wait for the guards that passed the gate earlier.
+          * Mutexes of the layer are not held afterwards, per-object locking costs
+          * only the gate check. Exclusive lock is preferred: new shared holders
+          * wait while an exclusive locker is waiting.
+          */
+        template<class Clock, class Duration>
+        bool lock_layer(bool shared, std::chrono::time_point<Clock, Duration> const* deadline) {
+            {
+                std::unique_lock<std::mutex> lock(gate_mutex_);
+                auto ready = [this, shared] {
+                    int gate = gate_.load(std::memory_order_relaxed);
+                    return shared ? gate >= 0 && gate_writers_ == 0 : gate == 0;
+                };
+                if (!shared) {
+                    gate_writers_++;
+                }
+                bool res = true;
+                if (deadline) {
+                    res = gate_cv_.wait_until(lock, *deadline, ready);
+                } else {
+                    gate_cv_.wait(lock, ready);
+                }
+                if (!shared) {
+                    gate_writers_--;
+                    if (!res && gate_writers_ == 0) {
+                        // shared lockers could wait only for this one
+                        gate_cv_.notify_all();
+                    }
+                }
+                if (!res) {
+                    return false;
+                }
+                gate_.store(shared ? gate_.load(std::memory_order_relaxed) + 1 : -1);
+            }
+            // every shared holder drains the mutexes, the first one may still be doing this
+            for (size_t i = 0; i < size_; i++) {
+                if (deadline) {
+                    if (!mutex(i).try_lock_until(*deadline)) {
+                        unlock_layer(shared);
+                        return false;
+                    }
+                } else {
+                    mutex(i).lock();
+                }
+                mutex(i).unlock();
+#ifdef SYNCOPE_HAVE_COROUTINES
+                wake(i);
+#endif
+            }
+            return true;
+        }
+
+        //! Release the layer-wide lock, wakes up guards blocked by the gate
+        void unlock_layer(bool shared) {
+            {
+                std::lock_guard<std::mutex> lock(gate_mutex_);
+                int gate = shared ? gate_.load(std::memory_order_relaxed) - 1 : 0;
+                gate_.store(gate, std::memory_order_release);
+                if (gate != 0) {
+                    return;
+                }
+            }
+            gate_cv_.notify_all();
+#ifdef SYNCOPE_HAVE_COROUTINES
+            wake_gate();
+#endif
+        }
+
+        /** Wait for notification on the object.
+          * Guard must hold the mutex `ix`, it's released while waiting.
+          */
+        template<class Guard, class Clock, class Duration>
+        bool wait_once(Guard& guard, size_t ix, const void* addr, std::chrono::time_point<Clock, Duration> const* deadline) {
+            WaitQueues* waitq = waitq_.load(std::memory_order_acquire);
+            if (waitq == nullptr) {
+                std::unique_ptr<WaitQueues> tmp(new WaitQueues(size_));
+                if (waitq_.compare_exchange_strong(waitq, tmp.get(), std::memory_order_acq_rel)) {
+                    waitq = tmp.release();
+                }
+            }
+            return waitq->wait_until(guard, ix, addr, deadline);
+        }
+
+        //! Wait until `pred` returns true
+        template<class Guard, class Pred>
+        void wait(Guard& guard, size_t ix, const void* addr, Pred& pred) {
+            while (!pred()) {
+                wait_once(guard, ix, addr, static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+            }
+        }
+
+        //! Wait until `pred` returns true or deadline is reached, returns `pred()`
+        template<class Guard, class Clock, class Duration, class Pred>
+        bool wait_until(Guard& guard, size_t ix, const void* addr, std::chrono::time_point<Clock, Duration> const& deadline, Pred& pred) {
+            while (!pred()) {
+                if (!wait_once(guard, ix, addr, &deadline)) {
+                    return pred();
+                }
+            }
+            return true;
+        }
+
+        //! Wake up waiters of the object
+        void notify(size_t ix, const void* addr, bool all) {
+            WaitQueues* waitq = waitq_.load(std::memory_order_acquire);
+            if (waitq) {
+                waitq->notify(ix, addr, all);
+            }
+        }
+
+        //! Returns index of the mutex that corresponds to the hash value
+        size_t index(size_t hash) const {
+            return hash & mask_;
+        }
+
+        /** Sort hash values in locking order (by mutex index) and remove values
+          * that map to the same mutex, returns number of remaining values.
+          * Raw hash values are kept (lock recording needs them).
+          */
+        template<class It>
+        size_t sort_unique(It begin, It end) const {
+            size_t mask = mask_;
+            std::sort(begin, end, [mask](size_t a, size_t b) { return (a & mask) < (b & mask); });
+            auto it = std::unique(begin, end, [mask](size_t a, size_t b) { return (a & mask) == (b & mask); });
+            return static_cast<size_t>(std::distance(begin, it));
+        }
+
+        //! Returns number of mutexes
+        size_t size() const {
+            return size_;
+        }
+
+        int get_id() const {
+            return id_;
+        }
+
+        const char* get_name() const {
+            return name_;
+        }
+
+#ifdef SYNCOPE_COLLECT_STATS
+        LayerStats snapshot() const {
+            return counters_.snapshot();
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        /** Called by the guard at the call site `loc`, before the blocking acquisition
+          * or after the successful non-blocking one.
+          */
+        void site_lock(const char* loc) {
+#ifdef SYNCOPE_DETECT_DEADLOCKS
+            detector_lock(loc);
+#endif
+#ifdef SYNCOPE_TRACE
+            trace_lock(loc);
+#endif
+        }
+
+        /** Called by the guard before the lock is released.
+          * Locks can be released in any order, the record is matched by layer and call site.
+          */
+        void site_unlock(const char* loc) {
+#ifdef SYNCOPE_TRACE
+            trace_unlock(loc);
+#endif
+#ifdef SYNCOPE_DETECT_DEADLOCKS
+            detector_unlock(loc);
+#endif
+        }
+#endif
+
+#ifdef SYNCOPE_RECORD
+        void record(LockRecord::Op op, size_t hash, std::chrono::steady_clock::duration wait) {
+            TraceRoot& root = tls_root;
+            if (root.record == nullptr) {
+                root.record = RecordList::inst().acquire();
+            }
+            uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count());
+            // 0 means uncontended
+            root.record->record(op, id_, hash, wait.count() > 0 ? std::max<uint64_t>(ns, 1u) : 0u);
+        }
+#endif
+
+#ifdef SYNCOPE_TRACE
+        void trace_lock(const char* loc) {
+            TraceRoot& root = tls_root;
+            if (root.frames_top >= SYNCOPE_MAX_DEPTH) {
+                root.frames_overflow++;
+                return;
+            }
+            root.frames[root.frames_top] = TraceRoot::Frame{this, loc, trace_now(), 0u};
+            root.frames_top++;
+        }
+
+        //! Innermost frame of this layer pushed at `loc`, -1 if there is none
+        int trace_find(TraceRoot const& root, const char* loc) const {
+            for (int i = root.frames_top; i --> 0;) {
+                if (root.frames[i].layer == this && root.frames[i].loc == loc) {
+                    return i;
+                }
+            }
+            return -1;
+        }
+
+        //! Called by the guard after the blocking acquisition, the rest is hold time
+        void trace_acquired(const char* loc) {
+            TraceRoot& root = tls_root;
+            int i = trace_find(root, loc);
+            if (i >= 0) {
+                root.frames[i].acquired = trace_now();
+            }
+        }
+
+        void trace_unlock(const char* loc) {
+            TraceRoot& root = tls_root;
+            int i = trace_find(root, loc);
+            if (i < 0) {
+                // frame wasn't pushed because of the depth limit
+                if (root.frames_overflow) {
+                    root.frames_overflow--;
+                }
+                return;
+            }
+            TraceRoot::Frame const frame = root.frames[i];
+            std::copy(root.frames.get() + i + 1, root.frames.get() + root.frames_top, root.frames.get() + i);
+            root.frames_top--;
+            uint64_t now = trace_now();
+            uint64_t acquired = frame.acquired ? frame.acquired : frame.start;
+            if (root.trace == nullptr) {
+                root.trace = TraceList::inst().acquire();
+            }
+            root.trace->record(frame.layer->name_, frame.layer->id_, frame.loc, frame.start, acquired - frame.start, now - acquired);
+        }
+#endif
+
+#ifdef SYNCOPE_DETECT_DEADLOCKS
+
+        void detector_lock(const char* loc) {
+            TraceRoot& root = tls_root;
+            if (root.top >= SYNCOPE_MAX_DEPTH) {
+                root.overflow++;
+                report_error("max depth reached");
+                return;
+            }
+            root.owners[root.top] = std::make_tuple(this, loc);
+            root.top++;
+            if (root.top == 1 || !Detector::inst().sample(root, loc)) {
+                return;
+            }
+            for (int i = root.top - 2; i >= 0; i--) {
+                auto prev_id = std::get<0>(root.owners[i])->get_id();
+                size_t edge = prev_id*SYNCOPE_MAX_LAYERS + id_;
+                if (prev_id < SYNCOPE_MAX_LAYERS && id_ < SYNCOPE_MAX_LAYERS) {
+                    if (root.seen[edge/64] & (uint64_t(1u) << (edge % 64))) {
+                        continue;
+                    }
+                    root.seen[edge/64] |= uint64_t(1u) << (edge % 64);
+                }
+                Detector::inst().on_lock(root.owners[i], root.owners[root.top-1]);
+            }
+        }
+
+        void detector_unlock(const char* loc) {
+            TraceRoot& root = tls_root;
+            auto owner = std::make_tuple(this, loc);
+            for (int i = root.top; i --> 0;) {
+                if (root.owners[i] == owner) {
+                    std::copy(root.owners.get() + i + 1, root.owners.get() + root.top, root.owners.get() + i);
+                    root.top--;
+                    return;
+                }
+            }
+            if (root.overflow) {
+                root.overflow--;
+                return;
+            }
+            report_error("double unlock");
+        }
+
+        void report_error(std::string const& message, std::string const& cycle = std::string()) const {
+            TraceRoot& root = tls_root;
+            DeadlockReport report;
+            report.message = message;
+            report.cycle = cycle;
+            for (auto i = 0; i < root.top; i++) {
+                auto layer = std::get<0>(root.owners[i]);
+                auto loc = std::get<1>(root.owners[i]);
+                report.held.push_back(std::make_pair(layer->name_, loc));
+            }
+            Detector::inst().report(report);
+        }
+#endif
+    };
+
+    std::atomic<int> LockLayerImpl::layers_counter{0};
+    thread_local TraceRoot LockLayerImpl::tls_root;
+
+#ifdef SYNCOPE_DETECT_DEADLOCKS
+    inline std::vector<int> Detector::find_path(int from, int to) const {
+        std::vector<int> parent(MAX_LAYERS, -1);
+        std::vector<int> stack;
+        parent[from] = from;
+        stack.push_back(from);
+        while (!stack.empty()) {
+            int v = stack.back();
+            stack.pop_back();
+            if (v == to) {
+                std::vector<int> path;
+                for (int u = to; u != from; u = parent[u]) {
+                    path.push_back(u);
+                }
+                path.push_back(from);
+                std::reverse(path.begin(), path.end());
+                return path;
+            }
+            for (int u = 0; u < MAX_LAYERS; u++) {
+                if (edges_[v*MAX_LAYERS + u].from_loc && parent[u] < 0) {
+                    parent[u] = v;
+                    stack.push_back(u);
+                }
+            }
+        }
+        return std::vector<int>();
+    }
+
+    inline void Detector::on_lock(TraceRoot::Owner const& prev, TraceRoot::Owner const& curr) {
+        LockLayerImpl* prev_layer = std::get<0>(prev);
+        LockLayerImpl* curr_layer = std::get<0>(curr);
+        auto id_prev = prev_layer->get_id();
+        auto id_curr = curr_layer->get_id();
+        if (id_prev >= MAX_LAYERS || id_curr >= MAX_LAYERS) {
+            bool reported;
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                reported = too_many_layers_;
+                too_many_layers_ = true;
+            }
+            if (!reported) {
+                curr_layer->report_error("too many layers (SYNCOPE_MAX_LAYERS)");
+            }
+            return;
+        }
+        std::stringstream cycle;
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            Edge& edge = edges_[id_prev*MAX_LAYERS + id_curr];
+            if (edge.from_loc || edge.reported) {
+                return;
+            }
+            edge.reported = true;
+            if (id_prev != id_curr) {
+                auto path = find_path(id_curr, id_prev);
+                if (path.empty()) {
+                    edge = Edge{ prev_layer->get_name(), std::get<1>(prev)
+                               , curr_layer->get_name(), std::get<1>(curr), false };
+                    return;
+                }
+                cycle << "    " << prev_layer->get_name() << " (" << std::get<1>(prev) << ") -> "
+                      << curr_layer->get_name() << " (" << std::get<1>(curr) << ")" << std::endl;
+                for (size_t i = 1; i < path.size(); i++) {
+                    Edge const& e = edges_[path[i-1]*MAX_LAYERS + path[i]];
+                    cycle << "    " << e.from_name << " (" << e.from_loc << ") -> "
+                          << e.to_name << " (" << e.to_loc << ")" << std::endl;
+                }
+            }
+        }
+        if (id_prev == id_curr) {
+            curr_layer->report_error("recursion detected");
+        } else {
+            curr_layer->report_error("deadlock detected, lock-order cycle:", cycle.str());
+        }
+    }
+#endif
+} // namespace detail
+
+#ifdef SYNCOPE_DETECT_DEADLOCKS
+    /** Runtime configuration of the deadlock detector.
+      * Available only if SYNCOPE_DETECT_DEADLOCKS is defined.
+      */
+    struct DeadlockDetector {
+        /** Set fraction of the nested acquisitions that should be checked.
+          * 1.0 (default) checks every acquisition, 0.0 disables random sampling.
+          */
+        static void set_sample_rate(double rate) {
+            detail::Detector::inst().set_sample_rate(rate);
+        }
+
+        /** Always check first `n` nested acquisitions of every call site (per thread).
+          * Combined with the sample rate, 0 (default) disables this mode.
+          */
+        static void set_first_per_site(uint32_t n) {
+            detail::Detector::inst().set_first_per_site(n);
+        }
+
+        /** Set report handler.
+          * By default report is printed to stdout and std::terminate is called.
+          * Handler can be called from any thread that acquires locks. Every
+          * lock-order cycle is reported only once.
+          */
+        static void set_handler(DeadlockHandler handler) {
+            detail::Detector::inst().set_handler(handler);
+        }
+    };
+#endif
+
+#ifdef SYNCOPE_COLLECT_STATS
+    /** Registry of all live lock layers.
+      * Available only if SYNCOPE_COLLECT_STATS is defined.
+      */
+    struct LayerRegistry {
+        //! Returns names of all live layers
+        static std::vector<const char*> names() {
+            std::vector<const char*> res;
+            detail::LayerList::inst().for_each([&](detail::LayerCounters const& layer) {
+                res.push_back(layer.name());
+            });
+            return res;
+        }
+
+        //! Returns statistics of all live layers
+        static std::vector<LayerStats> snapshot() {
+            std::vector<LayerStats> res;
+            detail::LayerList::inst().for_each([&](detail::LayerCounters const& layer) {
+                res.push_back(layer.snapshot());
+            });
+            return res;
+        }
+
+        //! Returns statistics of all live layers with the given name
+        static std::vector<LayerStats> snapshot(const char* name) {
+            std::vector<LayerStats> res;
+            detail::LayerList::inst().for_each([&](detail::LayerCounters const& layer) {
+                if (std::strcmp(layer.name(), name) == 0) {
+                    res.push_back(layer.snapshot());
+                }
+            });
+            return res;
+        }
+    };
+#endif
+
+#ifdef SYNCOPE_TRACE
+    /** Lock tracing results (wait and hold time of every call site).
+      * Available only if SYNCOPE_TRACE is defined.
+      */
+    struct TraceRegistry {
+        //! Returns histograms of all call sites merged across threads
+        static std::vector<SiteTrace> snapshot() {
+            std::vector<SiteTrace> res;
+            detail::TraceList::inst().for_each([&](detail::ThreadTrace const& trace) {
+                trace.merge_into(res);
+            });
+            return res;
+        }
+
+        /** Write recent lock events of all threads (last SYNCOPE_TRACE_EVENTS per thread)
+          * in Chrome trace_event JSON format (chrome://tracing, Perfetto).
+          */
+        template<class Stream>
+        static void dump(Stream& stream) {
+            bool first = true;
+            stream << "{\"traceEvents\":[";
+            detail::TraceList::inst().for_each([&](detail::ThreadTrace const& trace) {
+                trace.for_each_event([&](const char* layer, const char* loc, uint64_t tid,
+                                         uint64_t start, uint64_t wait, uint64_t hold) {
+                    if (wait) {
+                        write_event(stream, first, layer, loc, "wait", tid, start, wait);
+                    }
+                    write_event(stream, first, layer, loc, "hold", tid, start + wait, hold);
+                });
+            });
+            stream << "]}\n";
+        }
+
+    private:
+        template<class Stream>
+        static void write_string(Stream& stream, const char* str) {
+            stream << '"';
+            for (; *str; str++) {
+                if (*str == '"' || *str == '\\') {
+                    stream << '\\';
+                }
+                stream << *str;
+            }
+            stream << '"';
+        }
+
+        //! Write nanoseconds as microseconds with three decimal places
+        template<class Stream>
+        static void write_us(Stream& stream, uint64_t ns) {
+            const char frac[] = {
+                char('0' + ns/100%10),
+                char('0' + ns/10%10),
+                char('0' + ns%10),
+                '\0'
+            };
+            stream << ns/1000 << '.' << frac;
+        }
+
+        template<class Stream>
+        static void write_event(Stream& stream, bool& first, const char* layer, const char* loc,
+                                const char* cat, uint64_t tid, uint64_t ts, uint64_t dur) {
+            stream << (first ? "\n" : ",\n") << "{\"name\":";
+            write_string(stream, layer);
+            stream << ",\"cat\":\"" << cat << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid << ",\"ts\":";
+            write_us(stream, ts);
+            stream << ",\"dur\":";
+            write_us(stream, dur);
+            stream << ",\"args\":{\"site\":";
+            write_string(stream, loc);
+            stream << "}}";
+            first = false;
+        }
+    };
+#endif
+
+#ifdef SYNCOPE_RECORD
+    /** Lock recorder.
+      * Every acquisition and release of the stripe is recorded (last SYNCOPE_RECORD_EVENTS
+      * records per thread, `drain` consumes them incrementally), the trace can be written in compact binary format and
+      * replayed offline against different layer configurations (see benchmark/syncope_replay.cpp).
+      */
+    struct LockRecorder {
+        //! Returns records of all threads, records of every thread are ordered by time
+        static LockTrace snapshot() {
+            LockTrace res;
+            res.layers = detail::RecordedLayers::inst().get();
+            std::vector<std::tuple<uint64_t, uint64_t, LockRecord>> all;
+            detail::RecordList::inst().for_each([&](detail::ThreadRecord const& buffer) {
+                buffer.for_each([&](uint64_t seqno, uint64_t tid, LockRecord const& r) {
+                    all.push_back(std::make_tuple(tid, seqno, r));
+                });
+            });
+            std::sort(all.begin(), all.end(), [](std::tuple<uint64_t, uint64_t, LockRecord> const& a,
+                                                 std::tuple<uint64_t, uint64_t, LockRecord> const& b) {
+                return std::make_pair(std::get<0>(a), std::get<1>(a)) < std::make_pair(std::get<0>(b), std::get<1>(b));
+            });
+            for (auto const& t: all) {
+                uint32_t tid = static_cast<uint32_t>(std::get<0>(t));
+                if (res.threads.empty() || res.threads.back().id != tid) {
+                    res.threads.push_back(LockTrace::Thread{tid, std::vector<LockRecord>()});
+                }
+                res.threads.back().records.push_back(std::get<2>(t));
+            }
+            return res;
+        }
+
+        //! Write the trace in binary format (stream should be opened in binary mode)
+        template<class Stream>
+        static void dump(Stream& stream) {
+            snapshot().write(stream);
+        }
+
+        /** Write records added since the previous `drain` as a separate trace.
+          * Traces written by consecutive calls can be appended to the same file,
+          * syncope_replay reads them as one trace. Returns number of records that
+          * were overwritten before they were drained (drain more often or increase
+          * SYNCOPE_RECORD_EVENTS if it isn't zero).
+          */
+        template<class Stream>
+        static uint64_t drain(Stream& stream) {
+            LockTrace res;
+            res.layers = detail::RecordedLayers::inst().get();
+            uint64_t dropped = 0u;
+            detail::RecordList::inst().for_each([&](detail::ThreadRecord& buffer) {
+                dropped += buffer.drain([&](uint64_t tid, LockRecord const& r) {
+                    // buffer of the exited thread is reused, it can hold records of two threads
+                    if (res.threads.empty() || res.threads.back().id != static_cast<uint32_t>(tid)) {
+                        res.threads.push_back(LockTrace::Thread{static_cast<uint32_t>(tid), std::vector<LockRecord>()});
+                    }
+                    res.threads.back().records.push_back(r);
+                });
+            });
+            std::sort(res.threads.begin(), res.threads.end(), [](LockTrace::Thread const& a, LockTrace::Thread const& b) {
+                return a.id < b.id;
+            });
+            res.write(stream);
+            return dropped;
+        }
+    };
+#endif
+
+// namespace locks
+
+    template<class T>
+    class LockGuard {
+        friend class detail::WaitQueues;
+        size_t value_;
+        bool owns_lock_;
+        detail::LockLayerImpl& lock_pool_;
+        detail::GateKind kind_;
+#ifdef SYNCOPE_CALL_SITES
+        const char* loc_;
+#endif
+
+        void lock() {
+#ifdef SYNCOPE_CALL_SITES
+            lock_pool_.site_lock(loc_);
+#endif
+            for (;;) {
+                lock_pool_.lock(value_);
+                if (lock_pool_.gate_open(kind_)) {
+                    break;
+                }
+                lock_pool_.unlock(value_);
+                lock_pool_.gate_wait(kind_, static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+            }
+#ifdef SYNCOPE_TRACE
+            lock_pool_.trace_acquired(loc_);
+#endif
+            owns_lock_ = true;
+        }
+
+        void unlock() {
+#ifdef SYNCOPE_CALL_SITES
+            lock_pool_.site_unlock(loc_);
+#endif
+            lock_pool_.unlock(value_);
+            owns_lock_ = false;
+        }
+    public:
+        template<typename Hash>
+        LockGuard( T const* ptr
+                 , detail::LockLayerImpl& lockpool
+#ifdef SYNCOPE_CALL_SITES
+                 , const char* loc
+#endif
+                 , Hash const& hash
+                 , detail::GateKind kind = detail::GateKind::EXCLUSIVE)
+            : value_(hash(reinterpret_cast<size_t>(ptr)))
+            , owns_lock_(false)
+            , lock_pool_(lockpool)
+            , kind_(kind)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            lock();
+        }
+
+        //! Creates guard that doesn't own the lock, try_lock or try_lock_until should be used
+        template<typename Hash>
+        LockGuard( T const* ptr
+                 , detail::LockLayerImpl& lockpool
+#ifdef SYNCOPE_CALL_SITES
+                 , const char* loc
+#endif
+                 , Hash const& hash
+                 , std::defer_lock_t
+                 , detail::GateKind kind = detail::GateKind::EXCLUSIVE)
+            : value_(hash(reinterpret_cast<size_t>(ptr)))
+            , owns_lock_(false)
+            , lock_pool_(lockpool)
+            , kind_(kind)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+        }
+
+        LockGuard(LockGuard const&) = delete;
+
+        LockGuard& operator = (LockGuard const&) = delete;
+
+        LockGuard(LockGuard&& other)
+            : value_(other.value_)
+            , owns_lock_(other.owns_lock_)
+            , lock_pool_(other.lock_pool_)
+            , kind_(other.kind_)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(other.loc_)
+#endif
+        {
+            other.owns_lock_ = false;
+        }
+
+        LockGuard& operator = (LockGuard&& other) {
+            assert(&lock_pool_ == &other.lock_pool_);
+            if (owns_lock_) {
+                unlock();
+            }
+            value_ = other.value_;
+            owns_lock_ = other.owns_lock_;
+            kind_ = other.kind_;
+            other.owns_lock_ = false;
+#ifdef SYNCOPE_CALL_SITES
+            loc_ = other.loc_;
+#endif
+            return *this;
+        }
+
+        ~LockGuard() {
+            if (owns_lock_) {
+                unlock();
+            }
+        }
+
+        //! Try to acquire the lock without blocking
+        bool try_lock() {
+            assert(!owns_lock_);
+            if (!lock_pool_.gate_open(kind_) || !lock_pool_.try_lock(value_)) {
+                return false;
+            }
+            if (!lock_pool_.gate_open(kind_)) {
+                lock_pool_.unlock(value_);
+                return false;
+            }
+#ifdef SYNCOPE_CALL_SITES
+            lock_pool_.site_lock(loc_);
+#endif
+            owns_lock_ = true;
+            return true;
+        }
+
+        //! Try to acquire the lock without blocking, on failure index of the busy mutex is stored in `busy`
+        bool try_lock(size_t* busy) {
+            // closed gate leaves `busy` untouched, the caller retries later
+            if (lock_pool_.gate_open(kind_)) {
+                *busy = lock_pool_.index(value_);
+            }
+            return try_lock();
+        }
+
+        //! Try to acquire the lock, block until deadline
+        template<class Clock, class Duration>
+        bool try_lock_until(std::chrono::time_point<Clock, Duration> const& deadline) {
+            assert(!owns_lock_);
+            for (;;) {
+                if (!lock_pool_.gate_wait(kind_, &deadline) || !lock_pool_.try_lock_until(value_, deadline)) {
+                    return false;
+                }
+                if (lock_pool_.gate_open(kind_)) {
+                    break;
+                }
+                lock_pool_.unlock(value_);
+            }
+#ifdef SYNCOPE_CALL_SITES
+            lock_pool_.site_lock(loc_);
+#endif
+            owns_lock_ = true;
+            return true;
+        }
+
+        //! Returns false if the layer-wide lock blocks this guard
+        bool passes_gate() const {
+            return lock_pool_.gate_open(kind_);
+        }
+
+        bool owns_lock() const {
+            return owns_lock_;
+        }
+
+        explicit operator bool () const {
+            return owns_lock_;
+        }
+    };
+
+    /** Precomputed lock plan for the fixed set of objects.
+      * Hash values are computed, sorted in locking order and deduplicated once,
+      * guards created from the plan only lock the mutexes. Plan can be used only
+      * with the layer that created it, this is checked in debug builds.
+      */
+    template<int P, typename... T>
+    class LockPlan {
+        template<int, typename...> friend class LockGuardMany;
+        static_assert(sizeof...(T) > 0, "Lock plan needs at least one object");
+        enum {
+            H = sizeof...(T)*P
+        };
+        std::array<size_t, H> hashes_;
+        size_t hashes_count_;
+#ifndef NDEBUG
+        detail::LockLayerImpl const* impl_;
+        int layer_id_;
+#endif
+    public:
+        template<typename Hash>
+        LockPlan(detail::LockLayerImpl const& impl, Hash const& hash, T const*... items) {
+            const size_t values[] = { reinterpret_cast<size_t>(items)... };
+            for (size_t k = 0; k < sizeof...(T); k++) {
+                for (int i = 0; i < P; i++) {
+                    hashes_[k*P + i] = hash(values[k], i);
+                }
+            }
+            hashes_count_ = impl.sort_unique(hashes_.begin(), hashes_.end());
+#ifndef NDEBUG
+            impl_ = &impl;
+            layer_id_ = impl.get_id();
+#endif
+        }
+
+        //! Returns false if the plan was created by another layer (always true in release builds)
+        bool check(detail::LockLayerImpl const& impl) const {
+#ifndef NDEBUG
+            return impl_ == &impl && layer_id_ == impl.get_id();
+#else
+            (void)impl;
+            return true;
+#endif
+        }
+
+        //! Returns number of mutexes to lock
+        size_t size() const {
+            return hashes_count_;
+        }
+
+        //! Call `fn(ix)` for every mutex index in locking order
+        template<class Fn>
+        void for_each_index(detail::LockLayerImpl const& impl, Fn const& fn) const {
+            for (size_t i = 0; i < hashes_count_; i++) {
+                fn(impl.index(hashes_[i]));
+            }
+        }
+    };
+
+    template<int P, typename... T>
+    class LockGuardMany {
+        friend class detail::WaitQueues;
+        enum {
+            H = sizeof...(T)*P  // hashes array size (can be greater than sizeof...(T))
+        };
+        detail::LockLayerImpl& impl_;
+        std::array<size_t, H> hashes_;
+        size_t hashes_count_;
+        bool owns_lock_;
+        detail::GateKind kind_;
+#ifdef SYNCOPE_CALL_SITES
+        const char* loc_;
+#endif
+
+        template<int I, int M, int H>
+        struct fill_hashes
+        {
+            template<typename Hash>
+            void operator () (std::array<size_t, H>& hashes, std::tuple<T const*...> const& items, Hash const& hash) {
+                const auto p = std::get<I>(items);
+                for (int i = 0; i < P; i++) {
+                    size_t h = hash(reinterpret_cast<size_t>(p), i);
+                    hashes[I*P + i] = h;
+                }
+                fill_hashes<I + 1, M, H> fh;
+                fh(hashes, items, hash);
+            }
+        };
+
+        template<int M, int H>
+        struct fill_hashes<M, M, H>{
+            template<typename Hash>
+            void operator() (std::array<size_t, H>& hashes, std::tuple<T const*...> const& items, Hash const& hash) {}
+        };
+
+        void lock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_lock(loc_);
+#endif
+            for (;;) {
+                for (size_t i = 0; i < hashes_count_; i++) {
+                    impl_.lock(hashes_[i]);
+                }
+                if (impl_.gate_open(kind_)) {
+                    break;
+                }
+                release(hashes_count_);
+                impl_.gate_wait(kind_, static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+            }
+#ifdef SYNCOPE_TRACE
+            impl_.trace_acquired(loc_);
+#endif
+            owns_lock_ = true;
+        }
+
+        void unlock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_unlock(loc_);
+#endif
+            release(hashes_count_);
+            owns_lock_ = false;
+        }
+
+        //! Unlock first `count` mutexes in reverse order
+        void release(size_t count) {
+            for (size_t i = count - 1; i != size_t(0u) - 1; i--) {
+                impl_.unlock(hashes_[i]);
+            }
+        }
+
+        template<typename Hash>
+        void init(Hash const& hash, T const*... others) {
+            auto all = std::tie(others...);
+            fill_hashes<0, sizeof...(others), H> fill_all;
+            fill_all(hashes_, all, hash);
+            init();
+        }
+
+        void init() {
+            hashes_count_ = impl_.sort_unique(hashes_.begin(), hashes_.end());
+        }
+
+    public:
+
+        template<typename Hash>
+        LockGuardMany( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                     , const char* loc
+#endif
+                     , Hash const& hash
+                     , T const*... others)
+            : impl_(impl)
+            , owns_lock_(false)
+            , kind_(detail::GateKind::EXCLUSIVE)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            init(hash, others...);
+            lock();
+        }
+
+        //! Creates guard from precomputed hash values
+        LockGuardMany( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                     , const char* loc
+#endif
+                     , std::array<size_t, H> const& hashes
+                     , detail::GateKind kind = detail::GateKind::EXCLUSIVE)
+            : impl_(impl)
+            , hashes_(hashes)
+            , owns_lock_(false)
+            , kind_(kind)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            init();
+            lock();
+        }
+
+        //! Creates guard from the lock plan, hash values are already sorted and deduplicated
+        LockGuardMany( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                     , const char* loc
+#endif
+                     , LockPlan<P, T...> const& plan)
+            : impl_(impl)
+            , hashes_(plan.hashes_)
+            , hashes_count_(plan.hashes_count_)
+            , owns_lock_(false)
+            , kind_(detail::GateKind::EXCLUSIVE)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            assert(plan.check(impl));
+            lock();
+        }
+
+        //! Creates guard that doesn't own the lock, try_lock or try_lock_until should be used
+        template<typename Hash>
+        LockGuardMany( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                     , const char* loc
+#endif
+                     , std::defer_lock_t
+                     , Hash const& hash
+                     , T const*... others)
+            : impl_(impl)
+            , owns_lock_(false)
+            , kind_(detail::GateKind::EXCLUSIVE)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            init(hash, others...);
+        }
+
+        ~LockGuardMany() {
+            if (owns_lock_) {
+                unlock();
+            }
+        }
+
+        LockGuardMany(LockGuardMany const&) = delete;
+        LockGuardMany& operator = (LockGuardMany const&) = delete;
+
+        LockGuardMany(LockGuardMany&& other)
+            : impl_(other.impl_)
+            , hashes_(other.hashes_)
+            , hashes_count_(other.hashes_count_)
+            , owns_lock_(other.owns_lock_)
+            , kind_(other.kind_)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(other.loc_)
+#endif
+        {
+            other.owns_lock_ = false;
+        }
+
+        LockGuardMany& operator = (LockGuardMany&& other) {
+            assert(&other.impl_ == &impl_);
+            if (owns_lock_) {
+                unlock();
+            }
+            std::swap(hashes_, other.hashes_);
+            hashes_count_ = other.hashes_count_;
+            owns_lock_ = other.owns_lock_;
+            kind_ = other.kind_;
+            other.owns_lock_ = false;
+#ifdef SYNCOPE_CALL_SITES
+            loc_ = other.loc_;
+#endif
+            return *this;
+        }
+
+        /** Try to acquire all locks without blocking.
+          * If some lock can't be acquired all previously acquired locks are released.
+          */
+        bool try_lock() {
+            size_t busy;
+            return try_lock(&busy);
+        }
+
+        //! Try to acquire all locks without blocking, on failure index of the busy mutex is stored in `busy`
+        bool try_lock(size_t* busy) {
+            assert(!owns_lock_);
+            if (!impl_.gate_open(kind_)) {
+                // `busy` is left untouched, the caller retries later
+                return false;
+            }
+            for (size_t i = 0; i < hashes_count_; i++) {
+                if (!impl_.try_lock(hashes_[i])) {
+                    release(i);
+                    *busy = impl_.index(hashes_[i]);
+                    return false;
+                }
+            }
+            if (!impl_.gate_open(kind_)) {
+                release(hashes_count_);
+                return false;
+            }
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_lock(loc_);
+#endif
+            owns_lock_ = true;
+            return true;
+        }
+
+        /** Try to acquire all locks, block until deadline.
+          * If some lock can't be acquired all previously acquired locks are released.
+          */
+        template<class Clock, class Duration>
+        bool try_lock_until(std::chrono::time_point<Clock, Duration> const& deadline) {
+            assert(!owns_lock_);
+            for (;;) {
+                if (!impl_.gate_wait(kind_, &deadline)) {
+                    return false;
+                }
+                for (size_t i = 0; i < hashes_count_; i++) {
+                    if (!impl_.try_lock_until(hashes_[i], deadline)) {
+                        release(i);
+                        return false;
+                    }
+                }
+                if (impl_.gate_open(kind_)) {
+                    break;
+                }
+                release(hashes_count_);
+            }
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_lock(loc_);
+#endif
+            owns_lock_ = true;
+            return true;
+        }
+
+        //! Returns false if the layer-wide lock blocks this guard
+        bool passes_gate() const {
+            return impl_.gate_open(kind_);
+        }
+
+        bool owns_lock() const {
+            return owns_lock_;
+        }
+
+        explicit operator bool () const {
+            return owns_lock_;
+        }
+    };
+
+    /** Upgradeable read lock.
+      * Holds the first (in locking order) of the P mutexes that writer acquires,
+      * so it coexists with plain readers that use other mutexes but excludes
+      * other upgraders and writers of the same object. Upgrade acquires only
+      * remaining P-1 mutexes in locking order.
+      */
+    template<int P, typename T>
+    class UpgradeLockGuard {
+        detail::LockLayerImpl& impl_;
+        std::array<size_t, P> hashes_;
+        size_t hashes_count_;
+        bool owns_lock_;
+        bool upgraded_;
+#ifdef SYNCOPE_CALL_SITES
+        const char* loc_;
+#endif
+
+        void lock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_lock(loc_);
+#endif
+            for (;;) {
+                impl_.lock(hashes_[0]);
+                if (impl_.gate_open(detail::GateKind::EXCLUSIVE)) {
+                    break;
+                }
+                impl_.unlock(hashes_[0]);
+                impl_.gate_wait(detail::GateKind::EXCLUSIVE, static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+            }
+#ifdef SYNCOPE_TRACE
+            impl_.trace_acquired(loc_);
+#endif
+            owns_lock_ = true;
+        }
+
+        void unlock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_unlock(loc_);
+#endif
+            if (upgraded_) {
+                downgrade();
+            }
+            impl_.unlock(hashes_[0]);
+            owns_lock_ = false;
+        }
+
+        //! Unlock mutexes [1, count) in reverse order
+        void release(size_t count) {
+            for (size_t i = count - 1; i != 0u && i != size_t(0u) - 1; i--) {
+                impl_.unlock(hashes_[i]);
+            }
+        }
+    public:
+
+        template<typename Hash>
+        UpgradeLockGuard( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                        , const char* loc
+#endif
+                        , Hash const& hash
+                        , T const* ptr)
+            : impl_(impl)
+            , owns_lock_(false)
+            , upgraded_(false)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            for (int i = 0; i < P; i++) {
+                hashes_[i] = hash(reinterpret_cast<size_t>(ptr), i);
+            }
+            hashes_count_ = impl_.sort_unique(hashes_.begin(), hashes_.end());
+            lock();
+        }
+
+        ~UpgradeLockGuard() {
+            if (owns_lock_) {
+                unlock();
+            }
+        }
+
+        UpgradeLockGuard(UpgradeLockGuard const&) = delete;
+        UpgradeLockGuard& operator = (UpgradeLockGuard const&) = delete;
+
+        UpgradeLockGuard(UpgradeLockGuard&& other)
+            : impl_(other.impl_)
+            , hashes_(other.hashes_)
+            , hashes_count_(other.hashes_count_)
+            , owns_lock_(other.owns_lock_)
+            , upgraded_(other.upgraded_)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(other.loc_)
+#endif
+        {
+            other.owns_lock_ = false;
+            other.upgraded_ = false;
+        }
+
+        UpgradeLockGuard& operator = (UpgradeLockGuard&& other) {
+            assert(&other.impl_ == &impl_);
+            if (owns_lock_) {
+                unlock();
+            }
+            hashes_ = other.hashes_;
+            hashes_count_ = other.hashes_count_;
+            owns_lock_ = other.owns_lock_;
+            upgraded_ = other.upgraded_;
+            other.owns_lock_ = false;
+            other.upgraded_ = false;
+#ifdef SYNCOPE_CALL_SITES
+            loc_ = other.loc_;
+#endif
+            return *this;
+        }
+
+        //! Upgrade to write lock, blocks until all readers of the object are gone
+        void upgrade() {
+            assert(owns_lock_ && !upgraded_);
+            for (size_t i = 1; i < hashes_count_; i++) {
+                impl_.lock(hashes_[i]);
+            }
+            upgraded_ = true;
+        }
+
+        //! Try to upgrade to write lock without blocking
+        bool try_upgrade() {
+            assert(owns_lock_ && !upgraded_);
+            for (size_t i = 1; i < hashes_count_; i++) {
+                if (!impl_.try_lock(hashes_[i])) {
+                    release(i);
+                    return false;
+                }
+            }
+            upgraded_ = true;
+            return true;
+        }
+
+        //! Downgrade write lock to upgradeable read lock
+        void downgrade() {
+            assert(owns_lock_ && upgraded_);
+            release(hashes_count_);
+            upgraded_ = false;
+        }
+
+        bool upgraded() const {
+            return upgraded_;
+        }
+
+        bool owns_lock() const {
+            return owns_lock_;
+        }
+
+        explicit operator bool () const {
+            return owns_lock_;
+        }
+    };
+
+    /** Lock guard for the runtime-sized set of objects.
+      * Mutex indexes are stored in the small inline buffer (no memory allocation
+      * for small sets), sorted, deduplicated and locked in one pass. If the set
+      * covers most of the mutexes, the whole mutex array is locked in order.
+      */
+    class LockGuardRange {
+        friend class detail::WaitQueues;
+        enum {
+            INLINE_SIZE = 16,
+        };
+        detail::LockLayerImpl& impl_;
+        detail::SmallVector<size_t, INLINE_SIZE> ixs_;
+        bool all_;
+        bool owns_lock_;
+        detail::GateKind kind_;
+#ifdef SYNCOPE_CALL_SITES
+        const char* loc_;
+#endif
+
+        void unlock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_unlock(loc_);
+#endif
+            release();
+            owns_lock_ = false;
+        }
+
+        //! Unlock all mutexes in reverse order
+        void release() {
+            if (all_) {
+                for (size_t i = impl_.size(); i --> 0;) {
+                    impl_.unlock(i);
+                }
+            } else {
+                for (size_t i = ixs_.size(); i --> 0;) {
+                    impl_.unlock(ixs_[i]);
+                }
+            }
+        }
+
+        template<class Hash, class It>
+        void init(Hash const& hash, int P, It begin, It end) {
+            for (auto it = begin; it != end; ++it) {
+                for (int i = 0; i < P; i++) {
+                    ixs_.push_back(impl_.index(hash(reinterpret_cast<size_t>(*it), i)));
+                }
+            }
+            const size_t nlocks = impl_.size();
+            if (ixs_.size() > nlocks/4) {
+                // Large set, use bitmap instead of sorting
+                std::vector<uint64_t> bitmap((nlocks + 63)/64, 0u);
+                for (auto ix: ixs_) {
+                    bitmap[ix/64] |= uint64_t(1u) << (ix % 64);
+                }
+                size_t count = 0;
+                for (auto word: bitmap) {
+                    count += __builtin_popcountll(word);
+                }
+                if (count*4 >= nlocks*3) {
+                    all_ = true;
+                    ixs_.clear();
+                    return;
+                }
+                ixs_.clear();
+                for (size_t i = 0; i < nlocks; i++) {
+                    if (bitmap[i/64] & (uint64_t(1u) << (i % 64))) {
+                        ixs_.push_back(i);
+                    }
+                }
+            } else {
+                std::sort(ixs_.begin(), ixs_.end());
+                auto it = std::unique(ixs_.begin(), ixs_.end());
+                ixs_.resize(std::distance(ixs_.begin(), it));
+            }
+        }
+
+    public:
+
+        /** Creates guard that doesn't own the lock.
+          * @param hash hash function
+          * @param P number of mutexes per object
+          * @param begin range of pointers
+          */
+        template<class Hash, class It>
+        LockGuardRange( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                      , const char* loc
+#endif
+                      , std::defer_lock_t
+                      , Hash const& hash
+                      , int P
+                      , It begin
+                      , It end
+                      , detail::GateKind kind = detail::GateKind::EXCLUSIVE)
+            : impl_(impl)
+            , all_(false)
+            , owns_lock_(false)
+            , kind_(kind)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            init(hash, P, begin, end);
+        }
+
+        template<class Hash, class It>
+        LockGuardRange( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                      , const char* loc
+#endif
+                      , Hash const& hash
+                      , int P
+                      , It begin
+                      , It end
+                      , detail::GateKind kind = detail::GateKind::EXCLUSIVE)
+            : impl_(impl)
+            , all_(false)
+            , owns_lock_(false)
+            , kind_(kind)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            init(hash, P, begin, end);
+            lock();
+        }
+
+        ~LockGuardRange() {
+            if (owns_lock_) {
+                unlock();
+            }
+        }
+
+        LockGuardRange(LockGuardRange const&) = delete;
+        LockGuardRange& operator = (LockGuardRange const&) = delete;
+
+        LockGuardRange(LockGuardRange&& other)
+            : impl_(other.impl_)
+            , ixs_(std::move(other.ixs_))
+            , all_(other.all_)
+            , owns_lock_(other.owns_lock_)
+            , kind_(other.kind_)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(other.loc_)
+#endif
+        {
+            other.owns_lock_ = false;
+        }
+
+        LockGuardRange& operator = (LockGuardRange&& other) {
+            assert(&other.impl_ == &impl_);
+            if (owns_lock_) {
+                unlock();
+            }
+            ixs_ = std::move(other.ixs_);
+            all_ = other.all_;
+            owns_lock_ = other.owns_lock_;
+            kind_ = other.kind_;
+            other.owns_lock_ = false;
+#ifdef SYNCOPE_CALL_SITES
+            loc_ = other.loc_;
+#endif
+            return *this;
+        }
+
+        void lock() {
+            assert(!owns_lock_);
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_lock(loc_);
+#endif
+            for (;;) {
+                for_each_index([this](size_t ix) { impl_.lock(ix); });
+                if (impl_.gate_open(kind_)) {
+                    break;
+                }
+                release();
+                impl_.gate_wait(kind_, static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+            }
+#ifdef SYNCOPE_TRACE
+            impl_.trace_acquired(loc_);
+#endif
+            owns_lock_ = true;
+        }
+
+        //! Call `fn` for every mutex index (in locking order)
+        template<class Fn>
+        void for_each_index(Fn const& fn) {
+            if (all_) {
+                for (size_t i = 0; i < impl_.size(); i++) {
+                    fn(i);
+                }
+            } else {
+                for (auto ix: ixs_) {
+                    fn(ix);
+                }
+            }
+        }
+
+        //! Returns number of mutexes
+        size_t size() const {
+            return all_ ? impl_.size() : ixs_.size();
+        }
+
+        bool owns_lock() const {
+            return owns_lock_;
+        }
+
+        explicit operator bool () const {
+            return owns_lock_;
+        }
+    };
+
+    /** Layer-wide lock guard.
+      * Exclusive lock excludes every lock guard of the layer and other layer-wide
+      * locks, shared lock excludes lock guards and exclusive layer-wide lock but
+      * not other shared ones. Read locks of the asymmetric layer are not excluded
+      * by the shared lock. Waiting exclusive lock blocks new shared ones. Can be
+      * used to take consistent snapshot of all objects protected by the layer.
+      * Objects of the same layer can't be locked while the layer-wide lock is
+      * held (this will deadlock).
+      */
+    class LayerGuard {
+        detail::LockLayerImpl& impl_;
+        bool shared_;
+        bool owns_lock_;
+#ifdef SYNCOPE_CALL_SITES
+        const char* loc_;
+#endif
+
+        void lock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_lock(loc_);
+#endif
+            impl_.lock_layer(shared_, static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+#ifdef SYNCOPE_TRACE
+            impl_.trace_acquired(loc_);
+#endif
+            owns_lock_ = true;
+        }
+
+        void unlock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_unlock(loc_);
+#endif
+            impl_.unlock_layer(shared_);
+            owns_lock_ = false;
+        }
+    public:
+        LayerGuard( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                  , const char* loc
+#endif
+                  , bool shared)
+            : impl_(impl)
+            , shared_(shared)
+            , owns_lock_(false)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            lock();
+        }
+
+        //! Creates guard that doesn't own the lock, try_lock_until should be used
+        LayerGuard( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                  , const char* loc
+#endif
+                  , bool shared
+                  , std::defer_lock_t)
+            : impl_(impl)
+            , shared_(shared)
+            , owns_lock_(false)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+        }
+
+        ~LayerGuard() {
+            if (owns_lock_) {
+                unlock();
+            }
+        }
+
+        LayerGuard(LayerGuard const&) = delete;
+        LayerGuard& operator = (LayerGuard const&) = delete;
+
+        LayerGuard(LayerGuard&& other)
+            : impl_(other.impl_)
+            , shared_(other.shared_)
+            , owns_lock_(other.owns_lock_)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(other.loc_)
+#endif
+        {
+            other.owns_lock_ = false;
+        }
+
+        LayerGuard& operator = (LayerGuard&& other) {
+            assert(&other.impl_ == &impl_);
+            if (owns_lock_) {
+                unlock();
+            }
+            shared_ = other.shared_;
+            owns_lock_ = other.owns_lock_;
+            other.owns_lock_ = false;
+#ifdef SYNCOPE_CALL_SITES
+            loc_ = other.loc_;
+#endif
+            return *this;
+        }
+
+        //! Try to acquire the layer-wide lock, block until deadline
+        template<class Clock, class Duration>
+        bool try_lock_until(std::chrono::time_point<Clock, Duration> const& deadline) {
+            assert(!owns_lock_);
+            if (impl_.lock_layer(shared_, &deadline)) {
+#ifdef SYNCOPE_CALL_SITES
+                impl_.site_lock(loc_);
+#endif
+                owns_lock_ = true;
+            }
+            return owns_lock_;
+        }
+
+        bool shared() const {
+            return shared_;
+        }
+
+        bool owns_lock() const {
+            return owns_lock_;
+        }
+
+        explicit operator bool () const {
+            return owns_lock_;
+        }
+    };
+
+    /** Write guard of the optimistic lock layer.
+      * Holds the mutex of the stripe, stripe version is odd while the guard
+      * owns the lock.
+      */
+    class OptimisticWriteGuard {
+        friend class detail::WaitQueues;
+        detail::LockLayerImpl& impl_;
+        std::atomic<uint64_t>* version_;
+        size_t ix_;
+        bool owns_lock_;
+#ifdef SYNCOPE_CALL_SITES
+        const char* loc_;
+#endif
+
+        void begin_write() {
+            auto v = version_->load(std::memory_order_relaxed);
+            version_->store(v + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            owns_lock_ = true;
+        }
+
+        void lock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_lock(loc_);
+#endif
+            impl_.lock(ix_);
+#ifdef SYNCOPE_TRACE
+            impl_.trace_acquired(loc_);
+#endif
+            begin_write();
+        }
+
+        void unlock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_unlock(loc_);
+#endif
+            version_->store(version_->load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            impl_.unlock(ix_);
+            owns_lock_ = false;
+        }
+    public:
+        //! Creates guard that doesn't own the lock, try_lock or try_lock_until should be used
+        OptimisticWriteGuard( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                            , const char* loc
+#endif
+                            , std::atomic<uint64_t>& version
+                            , size_t ix
+                            , std::defer_lock_t)
+            : impl_(impl)
+            , version_(&version)
+            , ix_(ix)
+            , owns_lock_(false)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+        }
+
+        OptimisticWriteGuard( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                            , const char* loc
+#endif
+                            , std::atomic<uint64_t>& version
+                            , size_t ix)
+            : impl_(impl)
+            , version_(&version)
+            , ix_(ix)
+            , owns_lock_(false)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            lock();
+        }
+
+        OptimisticWriteGuard(OptimisticWriteGuard const&) = delete;
+        OptimisticWriteGuard& operator = (OptimisticWriteGuard const&) = delete;
+
+        OptimisticWriteGuard(OptimisticWriteGuard&& other)
+            : impl_(other.impl_)
+            , version_(other.version_)
+            , ix_(other.ix_)
+            , owns_lock_(other.owns_lock_)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(other.loc_)
+#endif
+        {
+            other.owns_lock_ = false;
+        }
+
+        OptimisticWriteGuard& operator = (OptimisticWriteGuard&& other) {
+            assert(&impl_ == &other.impl_);
+            if (owns_lock_) {
+                unlock();
+            }
+            version_ = other.version_;
+            ix_ = other.ix_;
+            owns_lock_ = other.owns_lock_;
+            other.owns_lock_ = false;
+#ifdef SYNCOPE_CALL_SITES
+            loc_ = other.loc_;
+#endif
+            return *this;
+        }
+
+        ~OptimisticWriteGuard() {
+            if (owns_lock_) {
+                unlock();
+            }
+        }
+
+        //! Try to acquire the lock without blocking
+        bool try_lock() {
+            assert(!owns_lock_);
+            if (impl_.try_lock(ix_)) {
+#ifdef SYNCOPE_CALL_SITES
+                impl_.site_lock(loc_);
+#endif
+                begin_write();
+            }
+            return owns_lock_;
+        }
+
+        //! Try to acquire the lock, block until deadline
+        template<class Clock, class Duration>
+        bool try_lock_until(std::chrono::time_point<Clock, Duration> const& deadline) {
+            assert(!owns_lock_);
+            if (impl_.try_lock_until(ix_, deadline)) {
+#ifdef SYNCOPE_CALL_SITES
+                impl_.site_lock(loc_);
+#endif
+                begin_write();
+            }
+            return owns_lock_;
+        }
+
+        bool owns_lock() const {
+            return owns_lock_;
+        }
+
+        explicit operator bool () const {
+            return owns_lock_;
+        }
+    };
+
+    namespace detail {
+
+    class StaticString {
+        const char* str_;
+    public:
+        StaticString(const char* s) : str_(s) {
+            // TODO: assert(string is static)
+        }
+
+        const char* str() const { return str_; }
+    };
+
+    //! Murmur3 64-bit finalizer
+    inline uint64_t fmix64(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdull;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ull;
+        k ^= k >> 33;
+        return k;
+    }
+
+    //! Returns new random salt value (different for every call)
+    inline size_t random_salt() {
+        static std::atomic<uint64_t> counter{0};
+        uint64_t seed = static_cast<uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+        seed ^= (counter++ + 1)*0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(fmix64(seed));
+    }
+
+    //! Simple hash - simply returns hash of the argument
+    template<class Hash>
+    struct SimpleHash {
+        Hash hash;
+        size_t operator() (size_t value) const {
+            return hash(value);
+        }
+    };
+
+    //! Simple hash
+    template<class Hash>
+    struct SimpleHash2 {
+        Hash hash;
+        size_t operator() (size_t value, int bias) const {
+            return hash(value);
+        }
+    };
+
+    template<int P, class Hash>
+    struct BiasedHash {
+        static_assert((P & (P - 1)) == 0, "P must be a power of two");
+        Hash hash;
+        size_t operator() (size_t value) const {
+            std::hash<std::thread::id> idhash;
+            auto id = std::this_thread::get_id();
+            size_t bias = idhash(id);
+            return hash(value) + (bias & (P - 1));
+        }
+    };
+
+    template<int P, class Hash>
+    struct BiasedHash2 {
+        static_assert((P & (P - 1)) == 0, "P must be a power of two");
+        Hash hash;
+        size_t operator() (size_t value, int bias) const {
+            return hash(value) + (bias & (P - 1));
+        }
+    };
+
+    //! Returns number of the CPU that runs the calling thread or -1 if it can't be determined
+    inline int current_cpu() {
+#if defined(SYNCOPE_HAVE_RSEQ)
+        if (__rseq_size != 0) {
+            auto area = reinterpret_cast<struct rseq const volatile*>(
+                        static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+            int cpu = static_cast<int>(area->cpu_id);
+            if (cpu >= 0) {
+                return cpu;
+            }
+        }
+#endif
+#if defined(__linux__) && defined(_GNU_SOURCE)
+        return sched_getcpu();
+#else
+        return -1;
+#endif
+    }
+
+    //! Returns slot number assigned to the calling thread (round-robin, on first use)
+    inline int thread_slot() {
+        static std::atomic<int> counter{0};
+        static thread_local int slot = counter++;
+        return slot;
+    }
+
+    /** Per-CPU reader hash.
+      * Every object owns an aligned group of P consecutive mutexes and reader
+      * takes the mutex that corresponds to its CPU. Readers running on different
+      * CPUs never share a mutex (if P is large enough) and neighbouring objects
+      * never share groups partially.
+      */
+    template<int P, class Hash>
+    struct CpuBiasedHash {
+        static_assert((P & (P - 1)) == 0, "P must be a power of two");
+        Hash hash;
+        size_t operator() (size_t value) const {
+            int cpu = current_cpu();
+            size_t bias = cpu < 0 ? thread_slot() : cpu;
+            return hash(value)*P + (bias & (P - 1));
+        }
+    };
+
+    template<int P, class Hash>
+    struct CpuBiasedHash2 {
+        static_assert((P & (P - 1)) == 0, "P must be a power of two");
+        Hash hash;
+        size_t operator() (size_t value, int bias) const {
+            return hash(value)*P + (bias & (P - 1));
+        }
+    };
+
+    //! Hash value computed in advance
+    struct FixedHash {
+        size_t value;
+        size_t operator() (size_t) const {
+            return value;
+        }
+    };
+
+    //! Adapts single argument hash to the (value, bias) interface
+    template<class Hash>
+    struct UnbiasedHash {
+        Hash hash;
+        size_t operator() (size_t value, int) const {
+            return hash(value);
+        }
+    };
+
+    /** Writer's intent to acquire P mutexes for each of K objects.
+      * Announced in c-tor, retracted in d-tor (after the write lock is acquired).
+      */
+    template<int P, int K, class Writers>
+    class WriteIntent {
+        Writers& writers_;
+        std::array<size_t, P*K> ixs_;
+    public:
+        template<class Hash, class... T>
+        WriteIntent(Writers& writers, LockLayerImpl const& impl, Hash const& hash, T const*... ptrs)
+            : writers_(writers)
+        {
+            static_assert(sizeof...(T) == K, "K must be equal to the number of objects");
+            if (Writers::enabled) {
+                const size_t values[] = { reinterpret_cast<size_t>(ptrs)... };
+                for (int k = 0; k < K; k++) {
+                    for (int i = 0; i < P; i++) {
+                        ixs_[k*P + i] = impl.index(hash(values[k], i));
+                        writers_.announce(ixs_[k*P + i]);
+                    }
+                }
+            }
+        }
+
+        ~WriteIntent() {
+            if (Writers::enabled) {
+                for (int i = 0; i < P*K; i++) {
+                    writers_.retract(ixs_[i]);
+                }
+            }
+        }
+
+        WriteIntent(WriteIntent const&) = delete;
+        WriteIntent& operator = (WriteIntent const&) = delete;
+    };
+
+    //! Writer's intent to acquire mutexes of the lock plan
+    template<class Writers, class Plan>
+    class PlanIntent {
+        Writers& writers_;
+        LockLayerImpl const& impl_;
+        Plan const& plan_;
+    public:
+        PlanIntent(Writers& writers, LockLayerImpl const& impl, Plan const& plan)
+            : writers_(writers)
+            , impl_(impl)
+            , plan_(plan)
+        {
+            if (Writers::enabled) {
+                plan_.for_each_index(impl_, [this](size_t ix) { writers_.announce(ix); });
+            }
+        }
+
+        ~PlanIntent() {
+            if (Writers::enabled) {
+                plan_.for_each_index(impl_, [this](size_t ix) { writers_.retract(ix); });
+            }
+        }
+
+        PlanIntent(PlanIntent const&) = delete;
+        PlanIntent& operator = (PlanIntent const&) = delete;
+    };
+
+    //! Closure submitted to the combining layer
+    struct CombinerTask {
+        void (*run)(CombinerTask*);
+        CombinerTask* next;
+    };
+
+    //! Storage for the result of the closure
+    template<class R>
+    class TaskResult {
+        typename std::aligned_storage<sizeof(R), alignof(R)>::type storage_;
+        bool has_value_;
+    public:
+        TaskResult() : has_value_(false) {}
+
+        ~TaskResult() {
+            if (has_value_) {
+                reinterpret_cast<R*>(&storage_)->~R();
+            }
+        }
+
+        template<class Fn>
+        void set(Fn& fn) {
+            new (&storage_) R(fn());
+            has_value_ = true;
+        }
+
+        R get() {
+            return std::move(*reinterpret_cast<R*>(&storage_));
+        }
+    };
+
+    template<>
+    class TaskResult<void> {
+    public:
+        template<class Fn>
+        void set(Fn& fn) {
+            fn();
+        }
+
+        void get() {}
+    };
+
+    //! Closure of the blocking `execute` call, lives on the stack of the submitter
+    template<class Fn>
+    struct SyncTask : CombinerTask {
+        typedef decltype(std::declval<Fn&>()()) R;
+        Fn& fn;
+        TaskResult<R> result;
+        std::exception_ptr error;
+        std::atomic<bool> done;
+
+        SyncTask(Fn& f)
+            : fn(f)
+            , done{false}
+        {
+            run = &SyncTask::run_task;
+            next = nullptr;
+        }
+
+        static void run_task(CombinerTask* base) {
+            SyncTask* self = static_cast<SyncTask*>(base);
+            try {
+                self->result.set(self->fn);
+            } catch (...) {
+                self->error = std::current_exception();
+            }
+            // Submitter can destroy the task as soon as `done` is set
+            self->done.store(true, std::memory_order_release);
+        }
+    };
+
+    //! Closure of the `execute_async` call, owns itself
+    template<class R>
+    struct AsyncTask : CombinerTask {
+        std::packaged_task<R()> task;
+
+        template<class Fn>
+        AsyncTask(Fn&& fn)
+            : task(std::forward<Fn>(fn))
+        {
+            run = &AsyncTask::run_task;
+            next = nullptr;
+        }
+
+        static void run_task(CombinerTask* base) {
+            AsyncTask* self = static_cast<AsyncTask*>(base);
+            self->task();
+            delete self;
+        }
+    };
+
+    /** Flat combining.
+      * Every mutex has a stack of submitted closures. Thread that holds the mutex
+      * runs all closures submitted for it in a batch before releasing it.
+      */
+    class Combiner {
+        struct Head {
+            std::atomic<CombinerTask*> value;
+            char pad[64 - sizeof(std::atomic<CombinerTask*>)];
+            Head()
+                : value{nullptr}
+            {
+            }
+        };
+        std::unique_ptr<Head[]> heads_;
+
+        //! Run all pending closures, mutex `ix` must be held
+        void drain(size_t ix) {
+            while (CombinerTask* list = heads_[ix].value.exchange(nullptr, std::memory_order_acquire)) {
+                // Stack is LIFO, run closures in submission order
+                CombinerTask* prev = nullptr;
+                while (list) {
+                    CombinerTask* next = list->next;
+                    list->next = prev;
+                    prev = list;
+                    list = next;
+                }
+#ifndef NDEBUG
+                running_closures() = true;
+#endif
+                while (prev) {
+                    CombinerTask* next = prev->next;
+                    prev->run(prev);
+                    prev = next;
+                }
+#ifndef NDEBUG
+                running_closures() = false;
+#endif
+            }
+        }
+    public:
+        Combiner(size_t size)
+            : heads_(new Head[size])
+        {
+        }
+
+        /** Submit closure and try to become the combiner.
+          * If the mutex is busy, the thread that holds it will run the closure.
+          */
+        void submit(LockLayerImpl& impl, size_t ix, CombinerTask* task) {
+            auto& head = heads_[ix].value;
+            task->next = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(task->next, task, std::memory_order_release, std::memory_order_relaxed)) {
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (impl.try_lock(ix)) {
+                release(impl, ix);
+            }
+        }
+
+        //! Run pending closures and unlock mutex `ix`
+        void release(LockLayerImpl& impl, size_t ix) {
+            while (true) {
+                drain(ix);
+                impl.unlock(ix);
+                // Closure can be submitted after `drain` while the mutex is still locked,
+                // its submitter won't be able to lock the mutex and run it itself
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (heads_[ix].value.load(std::memory_order_relaxed) == nullptr || !impl.try_lock(ix)) {
+                    return;
+                }
+            }
+        }
+
+        //! Submit closure and wait until it's executed by this or another thread
+        template<class Fn>
+        auto execute(LockLayerImpl& impl, size_t ix, Fn& fn) -> decltype(fn()) {
+            SyncTask<Fn> task(fn);
+            submit(impl, ix, &task);
+            for (int i = 0; !task.done.load(std::memory_order_acquire); i++) {
+                if (i > 100) {
+                    // Combiner should run the closure before unlocking the mutex
+                    impl.lock(ix);
+                    release(impl, ix);
+                    assert(task.done.load());
+                }
+            }
+            if (task.error) {
+                std::rethrow_exception(task.error);
+            }
+            return task.result.get();
+        }
+
+        //! Submit closure, returns future
+        template<class Fn>
+        auto execute_async(LockLayerImpl& impl, size_t ix, Fn&& fn) -> std::future<decltype(fn())> {
+            typedef decltype(fn()) R;
+            auto task = new AsyncTask<R>(std::forward<Fn>(fn));
+            auto future = task->task.get_future();
+            submit(impl, ix, task);
+            return future;
+        }
+    };
+
+    }
+
+    /** Hash policy.
+      * Drops cache line offset bits of the pointer and uses the rest as is.
+      * Salt is ignored. Objects allocated with large power of two stride
+      * (slab allocators) collide on a small subset of mutexes.
+      */
+    struct ShiftHash {
+        ShiftHash(size_t = 0) {}
+
+        size_t operator() (size_t value) const {
+            return value >> detail::CACHE_LINE_BITS;
+        }
+    };
+
+    /** Hash policy.
+      * Fibonacci (multiplicative) hashing, high bits of the product are returned.
+      */
+    struct FibonacciHash {
+        uint64_t salt;
+
+        FibonacciHash(size_t s = 0) : salt(s) {}
+
+        size_t operator() (size_t value) const {
+            return static_cast<size_t>(((value ^ salt)*0x9E3779B97F4A7C15ull) >> 32);
+        }
+    };
+
+    /** Hash policy.
+      * Murmur3 finalizer, the strongest and the most expensive one.
+      */
+    struct MurmurHash {
+        uint64_t salt;
+
+        MurmurHash(size_t s = 0) : salt(s) {}
+
+        size_t operator() (size_t value) const {
+            return static_cast<size_t>(detail::fmix64(value ^ salt));
+        }
+    };
+
+    /** Reader slot policy.
+      * Reader's mutex is chosen by hashing of the std::thread::id.
+      */
+    struct ThreadIdReaders {
+        template<int P, class Hash> using ReadHash = detail::BiasedHash<P, Hash>;
+        template<int P, class Hash> using WriteHash = detail::BiasedHash2<P, Hash>;
+    };
+
+    /** Reader slot policy.
+      * Reader's mutex is chosen by the number of the CPU that runs the reader
+      * (rseq or sched_getcpu). If CPU number is not available, thread gets
+      * cached round-robin slot number.
+      */
+    struct PerCpuReaders {
+        template<int P, class Hash> using ReadHash = detail::CpuBiasedHash<P, Hash>;
+        template<int P, class Hash> using WriteHash = detail::CpuBiasedHash2<P, Hash>;
+    };
+
+    /** Writer policy.
+      * Readers never wait for writers, writers can be starved by the stream of readers.
+      */
+    struct ReaderPreference {
+        enum { enabled = false };
+
+        ReaderPreference(size_t) {}
+
+        void wait(size_t) const {}
+
+        template<class Clock, class Duration>
+        bool wait_until(size_t, std::chrono::time_point<Clock, Duration> const&) const {
+            return true;
+        }
+
+        bool pending(size_t) const {
+            return false;
+        }
+
+        void announce(size_t) {}
+
+        void retract(size_t) {}
+    };
+
+    /** Writer policy.
+      * Writer announces its intent before acquiring mutexes. New readers that
+      * use one of the writer's mutexes back off until the writer acquires all
+      * of them, so writer waits only for readers that already hold the lock.
+      * Uncontended read path is a single load plus a single lock. Readers spin
+      * for a while and then sleep until the last pending writer of the mutex
+      * retracts its intent.
+      */
+    class WriterPreference {
+        enum {
+            SPIN_LIMIT = 100,
+            MAX_BUCKETS = 64,
+        };
+        //! Sleeping readers, shared by the mutexes with the same index modulo number of buckets
+        struct Bucket {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::atomic<uint32_t> sleepers;
+            Bucket() : sleepers{0u} {}
+        };
+        std::unique_ptr<std::atomic<uint32_t>[]> intents_;
+        std::unique_ptr<Bucket[]> buckets_;
+        const size_t buckets_mask_;
+
+        Bucket& bucket(size_t ix) const {
+            return buckets_[ix & buckets_mask_];
+        }
+
+        //! Spin until there is no pending writers, returns false if the reader should sleep
+        bool spin(size_t ix) const {
+            for (int i = 0; i < SPIN_LIMIT; i++) {
+                if (!pending(ix)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    public:
+        enum { enabled = true };
+
+        WriterPreference(size_t size)
+            : intents_(new std::atomic<uint32_t>[size])
+            , buckets_(new Bucket[std::min<size_t>(size, MAX_BUCKETS)])
+            , buckets_mask_(std::min<size_t>(size, MAX_BUCKETS) - 1)
+        {
+            for (size_t i = 0; i < size; i++) {
+                intents_[i].store(0u, std::memory_order_relaxed);
+            }
+        }
+
+        //! Wait until there is no pending writers that want to acquire mutex `ix`
+        void wait(size_t ix) const {
+            if (spin(ix)) {
+                return;
+            }
+            Bucket& b = bucket(ix);
+            std::unique_lock<std::mutex> lock(b.mutex);
+            // pairs with the last retract, one of them sees the other's update
+            b.sleepers.fetch_add(1u, std::memory_order_seq_cst);
+            while (intents_[ix].load(std::memory_order_seq_cst) != 0u) {
+                b.cv.wait(lock);
+            }
+            b.sleepers.fetch_sub(1u, std::memory_order_relaxed);
+        }
+
+        template<class Clock, class Duration>
+        bool wait_until(size_t ix, std::chrono::time_point<Clock, Duration> const& deadline) const {
+            if (spin(ix)) {
+                return true;
+            }
+            Bucket& b = bucket(ix);
+            std::unique_lock<std::mutex> lock(b.mutex);
+            b.sleepers.fetch_add(1u, std::memory_order_seq_cst);
+            bool res = true;
+            while (intents_[ix].load(std::memory_order_seq_cst) != 0u) {
+                if (b.cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+                    res = !pending(ix);
+                    break;
+                }
+            }
+            b.sleepers.fetch_sub(1u, std::memory_order_relaxed);
+            return res;
+        }
+
+        bool pending(size_t ix) const {
+            return intents_[ix].load(std::memory_order_acquire) != 0u;
+        }
+
+        void announce(size_t ix) {
+            intents_[ix].fetch_add(1u, std::memory_order_acq_rel);
+        }
+
+        void retract(size_t ix) {
+            if (intents_[ix].fetch_sub(1u, std::memory_order_seq_cst) == 1u) {
+                Bucket& b = bucket(ix);
+                if (b.sleepers.load(std::memory_order_seq_cst) != 0u) {
+                    // sleeper is either waiting on cv or will see zero intent
+                    { std::lock_guard<std::mutex> lock(b.mutex); }
+                    b.cv.notify_all();
+                }
+            }
+        }
+    };
+
+    /** Stripe occupancy histogram.
+      * Number of objects mapped to every mutex of the layer.
+      */
+    struct StripeHistogram {
+        std::vector<size_t> counts;
+        size_t objects;
+
+        StripeHistogram(size_t nstripes)
+            : counts(nstripes, 0u)
+            , objects(0u)
+        {
+        }
+
+        //! Number of mutexes used by at least one object
+        size_t used() const {
+            return static_cast<size_t>(counts.size() - std::count(counts.begin(), counts.end(), 0u));
+        }
+
+        //! Number of objects mapped to the most loaded mutex
+        size_t max() const {
+            return counts.empty() ? 0u : *std::max_element(counts.begin(), counts.end());
+        }
+
+        //! Number of object pairs that share a mutex
+        size_t collisions() const {
+            size_t res = 0;
+            for (auto c: counts) {
+                res += c*(c - 1)/2;
+            }
+            return res;
+        }
+
+        //! Write histogram to output stream (one "index count" line per used mutex)
+        template<class Stream>
+        void dump(Stream& stream) const {
+            stream << "objects " << objects << " stripes " << counts.size()
+                   << " used " << used() << " max " << max()
+                   << " collisions " << collisions() << "\n";
+            for (size_t i = 0; i < counts.size(); i++) {
+                if (counts[i]) {
+                    stream << i << " " << counts[i] << "\n";
+                }
+            }
+        }
+    };
+
+#ifdef SYNCOPE_HAVE_COROUTINES
+    /** Guard returned by `co_await` on the asynchronous lock.
+      * Mutex belongs to the thread that resumed the coroutine, the guard must be
+      * released by the same thread (checked in debug builds).
+      */
+    template<class Guard>
+    class AsyncGuard : public Guard {
+#ifndef NDEBUG
+        std::thread::id owner_;
+#endif
+
+        void check_owner() const {
+            assert((!Guard::owns_lock() || owner_ == std::this_thread::get_id())
+                   && "asynchronous lock must be released by the thread that acquired it");
+        }
+    public:
+        explicit AsyncGuard(Guard&& guard)
+            : Guard(std::move(guard))
+#ifndef NDEBUG
+            , owner_(std::this_thread::get_id())
+#endif
+        {
+        }
+
+        AsyncGuard(AsyncGuard&& other) = default;
+
+        AsyncGuard& operator = (AsyncGuard&& other) {
+            check_owner();
+            Guard::operator = (std::move(other));
+#ifndef NDEBUG
+            owner_ = other.owner_;
+#endif
+            return *this;
+        }
+
+        ~AsyncGuard() {
+            check_owner();
+        }
+    };
+
+    /** Result of the asynchronous lock acquisition.
+      * Uncontended lock is acquired immediately, otherwise the acquisition is performed by
+      * the coroutine that starts on `co_await`. The guard is returned as the result of `co_await`.
+      */
+    template<class Guard>
+    class [[nodiscard]] AsyncLock {
+    public:
+        struct promise_type {
+            std::optional<Guard> guard;
+            std::exception_ptr error;
+            std::coroutine_handle<> continuation;
+
+            struct FinalAwaiter {
+                bool await_ready() const noexcept {
+                    return false;
+                }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    return handle.promise().continuation;
+                }
+                void await_resume() const noexcept {}
+            };
+
+            AsyncLock get_return_object() {
+                return AsyncLock(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() const noexcept {
+                return {};
+            }
+
+            FinalAwaiter final_suspend() const noexcept {
+                return {};
+            }
+
+            void return_value(Guard&& result) {
+                guard.emplace(std::move(result));
+            }
+
+            void unhandled_exception() {
+                error = std::current_exception();
+            }
+        };
+    private:
+        std::optional<Guard> ready_;
+        std::coroutine_handle<promise_type> handle_;
+
+        explicit AsyncLock(std::coroutine_handle<promise_type> handle)
+            : handle_(handle)
+        {
+        }
+    public:
+        //! Lock that was acquired without suspension
+        explicit AsyncLock(Guard&& guard)
+            : ready_(std::move(guard))
+            , handle_(nullptr)
+        {
+        }
+
+        AsyncLock(AsyncLock&& other)
+            : ready_(std::move(other.ready_))
+            , handle_(other.handle_)
+        {
+            other.handle_ = nullptr;
+        }
+
+        AsyncLock(AsyncLock const&) = delete;
+        AsyncLock& operator = (AsyncLock const&) = delete;
+        AsyncLock& operator = (AsyncLock&&) = delete;
+
+        ~AsyncLock() {
+            if (handle_) {
+                handle_.destroy();
+            }
+        }
+
+        bool await_ready() const noexcept {
+            return ready_.has_value();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) {
+            handle_.promise().continuation = continuation;
+            return handle_;
+        }
+
+        AsyncGuard<Guard> await_resume() {
+            if (ready_) {
+                return AsyncGuard<Guard>(std::move(*ready_));
+            }
+            if (handle_.promise().error) {
+                std::rethrow_exception(handle_.promise().error);
+            }
+            return AsyncGuard<Guard>(std::move(*handle_.promise().guard));
+        }
+    };
+
+namespace detail {
+
+    /** Awaitable that suspends the coroutine until the mutex `ix` is released.
+      * Resumed coroutine is scheduled by the executor, it should retry the acquisition.
+      */
+    template<class Executor>
+    class StripeReleased {
+        LockLayerImpl& impl_;
+        size_t ix_;
+        Executor& executor_;
+        AsyncQueues::Node node_;
+
+        static void dispatch(void* executor, std::coroutine_handle<> handle) {
+            (*static_cast<Executor*>(executor))(handle);
+        }
+    public:
+        StripeReleased(LockLayerImpl& impl, size_t ix, Executor& executor)
+            : impl_(impl)
+            , ix_(ix)
+            , executor_(executor)
+        {
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            node_.handle = handle;
+            node_.dispatch = &dispatch;
+            node_.executor = &executor_;
+            node_.state.store(AsyncQueues::PARKING, std::memory_order_relaxed);
+            impl_.park(ix_, &node_);
+            // pairs with AsymmetricFence::light in LockLayerImpl::wake
+            AsymmetricFence::heavy();
+            // mutex could be released before the node was parked, unlock wakes up the queue
+            if (impl_.try_lock(ix_)) {
+                impl_.unlock(ix_);
+            }
+            // if the node was woken up while parking, retry without suspension,
+            // otherwise coroutine can be resumed by another thread from now on
+            return node_.state.exchange(AsyncQueues::PARKED, std::memory_order_acq_rel) != AsyncQueues::WOKEN;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    //! Awaitable that reschedules the coroutine using the executor
+    template<class Executor>
+    class Reschedule {
+        Executor& executor_;
+    public:
+        Reschedule(Executor& executor)
+            : executor_(executor)
+        {
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            executor_(handle);
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    /** Awaitable that suspends the coroutine until the layer-wide lock lets the guard through.
+      * Coroutine is parked on the wait list of the gate, unlock_layer resumes all of them.
+      */
+    template<class Guard, class Executor>
+    class GateOpened {
+        LockLayerImpl& impl_;
+        Guard const& guard_;
+        Executor& executor_;
+        AsyncQueues::Node node_;
+
+        static void dispatch(void* executor, std::coroutine_handle<> handle) {
+            (*static_cast<Executor*>(executor))(handle);
+        }
+    public:
+        GateOpened(LockLayerImpl& impl, Guard const& guard, Executor& executor)
+            : impl_(impl)
+            , guard_(guard)
+            , executor_(executor)
+        {
+        }
+
+        bool await_ready() const noexcept {
+            return guard_.passes_gate();
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            node_.handle = handle;
+            node_.dispatch = &dispatch;
+            node_.executor = &executor_;
+            node_.state.store(AsyncQueues::PARKING, std::memory_order_relaxed);
+            impl_.park(impl_.size(), &node_);
+            // pairs with AsymmetricFence::light in LockLayerImpl::wake_gate
+            AsymmetricFence::heavy();
+            // gate could be opened before the node was parked
+            if (guard_.passes_gate()) {
+                impl_.wake_gate();
+            }
+            return node_.state.exchange(AsyncQueues::PARKED, std::memory_order_acq_rel) != AsyncQueues::WOKEN;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    //! Acquisition without intent and back-off (symmetric layer)
+    struct NoIntent {
+        int operator() () const {
+            return 0;
+        }
+    };
+
+    struct NoBackoff {
+        bool operator() () const {
+            return false;
+        }
+    };
+
+    //! Contended path of the asynchronous acquisition (see lock_async)
+    template<class Guard, class Executor, class Intent, class Backoff>
+    AsyncLock<Guard> lock_slow(LockLayerImpl& impl, Guard guard, Executor executor, Intent intent, Backoff backoff) {
+        static const size_t NONE = ~size_t(0);
+        auto scope = intent();
+        (void)scope;
+        size_t woken = NONE;
+        for (;;) {
+            size_t busy = NONE;
+            bool postponed = backoff();
+            if (!postponed && guard.try_lock(&busy)) {
+                break;
+            }
+            if (woken != busy && woken != NONE) {
+                // the wake-up wasn't used to acquire the mutex, pass it to the next coroutine
+                impl.wake(woken);
+            }
+            woken = busy;
+            if (postponed) {
+                co_await Reschedule<Executor>(executor);
+            } else if (busy == NONE) {
+                // the gate is closed
+                co_await GateOpened<Guard, Executor>(impl, guard, executor);
+            } else {
+                co_await StripeReleased<Executor>(impl, busy, executor);
+            }
+        }
+        co_return std::move(guard);
+    }
+
+    /** Acquire the guard asynchronously.
+      * @param guard guard that doesn't own the lock (created with std::defer_lock)
+      * @param intent called before the contended acquisition, the result is kept alive until the guard is locked
+      * @param backoff returns true if the acquisition should be postponed (pending writer)
+      */
+    template<class Guard, class Executor, class Intent, class Backoff>
+    AsyncLock<Guard> lock_async(LockLayerImpl& impl, Guard guard, Executor executor, Intent intent, Backoff backoff) {
+        size_t busy;
+        if (!backoff() && guard.try_lock(&busy)) {
+            return AsyncLock<Guard>(std::move(guard));
+        }
+        return lock_slow(impl, std::move(guard), std::move(executor), std::move(intent), std::move(backoff));
+    }
+
+    template<class Executor>
+    using EnableIfExecutor = typename std::enable_if<std::is_invocable<Executor&, std::coroutine_handle<>>::value>::type;
+
+}  // namespace detail
+#endif
+
+    /** Lock hierarchy layer.
+      * @param Hash hash policy (ShiftHash, FibonacciHash or MurmurHash)
+      * @param Stripes number of mutexes (power of two)
+      * @param Align alignment of every mutex in bytes (0 - no padding, 64 - one mutex per cache line)
+      */
+    template<class Hash = ShiftHash, size_t Stripes = SYNCOPE_NUM_LOCKS, size_t Align = SYNCOPE_STRIPE_ALIGN>
+    class BasicSymmetricLockLayer {
+        static_assert((Stripes & (Stripes - 1)) == 0, "Stripes must be a power of two");
+        detail::LockLayerImpl impl_;
+        Hash hash_;
+    public:
+
+        /** C-tor
+          * @param name statically initialized string
+          * @param salt hash salt, random by default
+          */
+        BasicSymmetricLockLayer(detail::StaticString name, int level = -1, size_t salt = detail::random_salt())
+            : impl_(name.str(), level, Stripes, Align)
+            , hash_(salt)
+        {
+        }
+
+
+#ifdef SYNCOPE_CALL_SITES
+        template<class T>
+        LockGuard<T> synchronize(
+                const char* loc,
+                T const* ptr) {
+            return std::move(LockGuard<T>(ptr, impl_, loc, detail::SimpleHash<Hash>{hash_}));
+        }
+#else
+        template<class T>
+        LockGuard<T> synchronize(T const* ptr) {
+            return std::move(LockGuard<T>(ptr, impl_, detail::SimpleHash<Hash>{hash_}));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        template<typename... T>
+        LockGuardMany<1, T...> synchronize_all(
+                const char* loc,
+                T const*... args) {
+            return std::move(LockGuardMany<1, T...>(impl_, loc, detail::SimpleHash2<Hash>{hash_}, args...));
+        }
+#else
+        template<typename... T>
+        LockGuardMany<1, T...> synchronize_all(T const*... args) {
+            return std::move(LockGuardMany<1, T...>(impl_, detail::SimpleHash2<Hash>{hash_}, args...));
+        }
+#endif
+
+        //! Precompute lock plan for the objects that are locked together many times
+        template<typename... T>
+        LockPlan<1, T...> plan_all(T const*... args) const {
+            return LockPlan<1, T...>(impl_, detail::SimpleHash2<Hash>{hash_}, args...);
+        }
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Lock all objects of the plan created by `plan_all`
+        template<typename... T>
+        LockGuardMany<1, T...> synchronize_all(
+                const char* loc,
+                LockPlan<1, T...> const& plan) {
+            return std::move(LockGuardMany<1, T...>(impl_, loc, plan));
+        }
+#else
+        //! Lock all objects of the plan created by `plan_all`
+        template<typename... T>
+        LockGuardMany<1, T...> synchronize_all(LockPlan<1, T...> const& plan) {
+            return std::move(LockGuardMany<1, T...>(impl_, plan));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Try to lock object without blocking (or until deadline, or for timeout)
+        template<class T>
+        LockGuard<T> try_synchronize(const char* loc, T const* ptr) {
+            LockGuard<T> guard(ptr, impl_, loc, detail::SimpleHash<Hash>{hash_}, std::defer_lock);
+            guard.try_lock();
+            return guard;
+        }
+
+        template<class Clock, class Duration, class T>
+        LockGuard<T> try_synchronize(const char* loc, std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            LockGuard<T> guard(ptr, impl_, loc, detail::SimpleHash<Hash>{hash_}, std::defer_lock);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period, class T>
+        LockGuard<T> try_synchronize(const char* loc, std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize(loc, std::chrono::steady_clock::now() + timeout, ptr);
+        }
+#else
+        //! Try to lock object without blocking (or until deadline, or for timeout)
+        template<class T>
+        LockGuard<T> try_synchronize(T const* ptr) {
+            LockGuard<T> guard(ptr, impl_, detail::SimpleHash<Hash>{hash_}, std::defer_lock);
+            guard.try_lock();
+            return guard;
+        }
+
+        template<class Clock, class Duration, class T>
+        LockGuard<T> try_synchronize(std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            LockGuard<T> guard(ptr, impl_, detail::SimpleHash<Hash>{hash_}, std::defer_lock);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period, class T>
+        LockGuard<T> try_synchronize(std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize(std::chrono::steady_clock::now() + timeout, ptr);
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Try to lock all objects without blocking (or until deadline, or for timeout)
+        template<typename... T>
+        LockGuardMany<1, T...> try_synchronize_all(const char* loc, T const*... args) {
+            LockGuardMany<1, T...> guard(impl_, loc, std::defer_lock, detail::SimpleHash2<Hash>{hash_}, args...);
+            guard.try_lock();
+            return guard;
+        }
+
+        template<class Clock, class Duration, typename... T>
+        LockGuardMany<1, T...> try_synchronize_all(const char* loc, std::chrono::time_point<Clock, Duration> const& deadline, T const*... args) {
+            LockGuardMany<1, T...> guard(impl_, loc, std::defer_lock, detail::SimpleHash2<Hash>{hash_}, args...);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period, typename... T>
+        LockGuardMany<1, T...> try_synchronize_all(const char* loc, std::chrono::duration<Rep, Period> const& timeout, T const*... args) {
+            return try_synchronize_all(loc, std::chrono::steady_clock::now() + timeout, args...);
+        }
+#else
+        //! Try to lock all objects without blocking (or until deadline, or for timeout)
+        template<typename... T>
+        LockGuardMany<1, T...> try_synchronize_all(T const*... args) {
+            LockGuardMany<1, T...> guard(impl_, std::defer_lock, detail::SimpleHash2<Hash>{hash_}, args...);
+            guard.try_lock();
+            return guard;
+        }
+
+        template<class Clock, class Duration, typename... T>
+        LockGuardMany<1, T...> try_synchronize_all(std::chrono::time_point<Clock, Duration> const& deadline, T const*... args) {
+            LockGuardMany<1, T...> guard(impl_, std::defer_lock, detail::SimpleHash2<Hash>{hash_}, args...);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period, typename... T>
+        LockGuardMany<1, T...> try_synchronize_all(std::chrono::duration<Rep, Period> const& timeout, T const*... args) {
+            return try_synchronize_all(std::chrono::steady_clock::now() + timeout, args...);
+        }
+#endif
+
+#ifdef SYNCOPE_HAVE_COROUTINES
+#ifdef SYNCOPE_CALL_SITES
+        /** Lock object asynchronously: `auto guard = co_await layer.lock_async(executor, ptr);`
+          * Coroutine is suspended instead of blocking the thread, after the mutex
+          * is released the coroutine is resumed by the executor. Executor is called
+          * by the unlocking thread and must not resume the coroutine inline, it should
+          * post the handle to a queue or a thread pool. Mutex belongs to the thread that
+          * resumed the coroutine, the guard must be released by that thread.
+          */
+        template<class Executor, class T, class = detail::EnableIfExecutor<Executor>>
+        AsyncLock<LockGuard<T>> lock_async(const char* loc, Executor executor, T const* ptr) {
+            LockGuard<T> guard(ptr, impl_, loc, detail::SimpleHash<Hash>{hash_}, std::defer_lock);
+            return detail::lock_async(impl_, std::move(guard), std::move(executor), detail::NoIntent(), detail::NoBackoff());
+        }
+
+        //! Lock all objects asynchronously
+        template<class Executor, typename... T, class = detail::EnableIfExecutor<Executor>>
+        AsyncLock<LockGuardMany<1, T...>> lock_all_async(const char* loc, Executor executor, T const*... args) {
+            LockGuardMany<1, T...> guard(impl_, loc, std::defer_lock, detail::SimpleHash2<Hash>{hash_}, args...);
+            return detail::lock_async(impl_, std::move(guard), std::move(executor), detail::NoIntent(), detail::NoBackoff());
+        }
+#else
+        /** Lock object asynchronously: `auto guard = co_await layer.lock_async(executor, ptr);`
+          * Coroutine is suspended instead of blocking the thread, after the mutex
+          * is released the coroutine is resumed by the executor. Executor is called
+          * by the unlocking thread and must not resume the coroutine inline, it should
+          * post the handle to a queue or a thread pool. Mutex belongs to the thread that
+          * resumed the coroutine, the guard must be released by that thread.
+          */
+        template<class Executor, class T, class = detail::EnableIfExecutor<Executor>>
+        AsyncLock<LockGuard<T>> lock_async(Executor executor, T const* ptr) {
+            LockGuard<T> guard(ptr, impl_, detail::SimpleHash<Hash>{hash_}, std::defer_lock);
+            return detail::lock_async(impl_, std::move(guard), std::move(executor), detail::NoIntent(), detail::NoBackoff());
+        }
+
+        //! Lock all objects asynchronously
+        template<class Executor, typename... T, class = detail::EnableIfExecutor<Executor>>
+        AsyncLock<LockGuardMany<1, T...>> lock_all_async(Executor executor, T const*... args) {
+            LockGuardMany<1, T...> guard(impl_, std::defer_lock, detail::SimpleHash2<Hash>{hash_}, args...);
+            return detail::lock_async(impl_, std::move(guard), std::move(executor), detail::NoIntent(), detail::NoBackoff());
+        }
+#endif
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Lock all objects from the range of pointers
+        template<class It>
+        LockGuardRange synchronize_range(const char* loc, It begin, It end) {
+            return std::move(LockGuardRange(impl_, loc, detail::SimpleHash2<Hash>{hash_}, 1, begin, end));
+        }
+#else
+        //! Lock all objects from the range of pointers
+        template<class It>
+        LockGuardRange synchronize_range(It begin, It end) {
+            return std::move(LockGuardRange(impl_, detail::SimpleHash2<Hash>{hash_}, 1, begin, end));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Lock the whole layer exclusively (e.g. to take a snapshot of all objects)
+        LayerGuard synchronize_layer(const char* loc) {
+            return std::move(LayerGuard(impl_, loc, false));
+        }
+
+        //! Lock the whole layer in shared mode, per-object locks are excluded
+        LayerGuard synchronize_layer_shared(const char* loc) {
+            return std::move(LayerGuard(impl_, loc, true));
+        }
+
+        //! Try to lock the whole layer exclusively until deadline (or for timeout)
+        template<class Clock, class Duration>
+        LayerGuard try_synchronize_layer(const char* loc, std::chrono::time_point<Clock, Duration> const& deadline) {
+            LayerGuard guard(impl_, loc, false, std::defer_lock);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period>
+        LayerGuard try_synchronize_layer(const char* loc, std::chrono::duration<Rep, Period> const& timeout) {
+            return try_synchronize_layer(loc, std::chrono::steady_clock::now() + timeout);
+        }
+#else
+        //! Lock the whole layer exclusively (e.g. to take a snapshot of all objects)
+        LayerGuard synchronize_layer() {
+            return std::move(LayerGuard(impl_, false));
+        }
+
+        //! Lock the whole layer in shared mode, per-object locks are excluded
+        LayerGuard synchronize_layer_shared() {
+            return std::move(LayerGuard(impl_, true));
+        }
+
+        //! Try to lock the whole layer exclusively until deadline (or for timeout)
+        template<class Clock, class Duration>
+        LayerGuard try_synchronize_layer(std::chrono::time_point<Clock, Duration> const& deadline) {
+            LayerGuard guard(impl_, false, std::defer_lock);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period>
+        LayerGuard try_synchronize_layer(std::chrono::duration<Rep, Period> const& timeout) {
+            return try_synchronize_layer(std::chrono::steady_clock::now() + timeout);
+        }
+#endif
+
+        /** Wait until `pred` returns true.
+          * Guard must hold the lock of the object (write lock for asymmetric layer),
+          * it's released while waiting and reacquired before `pred` is checked.
+          */
+        template<class Guard, class T, class Pred>
+        void wait(Guard& guard, T const* ptr, Pred pred) {
+            impl_.wait(guard, impl_.index(detail::SimpleHash<Hash>{hash_}(reinterpret_cast<size_t>(ptr))), ptr, pred);
+        }
+
+        //! Wait until `pred` returns true or deadline is reached, returns `pred()`
+        template<class Guard, class T, class Clock, class Duration, class Pred>
+        bool wait_until(Guard& guard, T const* ptr, std::chrono::time_point<Clock, Duration> const& deadline, Pred pred) {
+            return impl_.wait_until(guard, impl_.index(detail::SimpleHash<Hash>{hash_}(reinterpret_cast<size_t>(ptr))), ptr, deadline, pred);
+        }
+
+        //! Wait until `pred` returns true or timeout expires, returns `pred()`
+        template<class Guard, class T, class Rep, class Period, class Pred>
+        bool wait_for(Guard& guard, T const* ptr, std::chrono::duration<Rep, Period> const& timeout, Pred pred) {
+            return impl_.wait_until(guard, impl_.index(detail::SimpleHash<Hash>{hash_}(reinterpret_cast<size_t>(ptr))), ptr, std::chrono::steady_clock::now() + timeout, pred);
+        }
+
+        //! Wake up all threads waiting on the object
+        template<class T>
+        void notify(T const* ptr) {
+            impl_.notify(impl_.index(detail::SimpleHash<Hash>{hash_}(reinterpret_cast<size_t>(ptr))), ptr, true);
+        }
+
+        //! Wake up one thread waiting on the object
+        template<class T>
+        void notify_one(T const* ptr) {
+            impl_.notify(impl_.index(detail::SimpleHash<Hash>{hash_}(reinterpret_cast<size_t>(ptr))), ptr, false);
+        }
+
+        /** Build stripe occupancy histogram for the range of pointers.
+          * Can be used to check hash policy against real allocation patterns.
+          */
+        template<class It>
+        StripeHistogram histogram(It begin, It end) const {
+            StripeHistogram res(impl_.size());
+            detail::SimpleHash<Hash> hash{hash_};
+            for (auto it = begin; it != end; ++it) {
+                res.counts[impl_.index(hash(reinterpret_cast<size_t>(*it)))]++;
+                res.objects++;
+            }
+            return res;
+        }
+
+#ifdef SYNCOPE_COLLECT_STATS
+        //! Returns lock statistics of the layer
+        LayerStats snapshot() const {
+            return impl_.snapshot();
+        }
+#endif
+    };
+
+    typedef BasicSymmetricLockLayer<> SymmetricLockLayer;
+
+    /** Asymmetric lock hierarchy layer.
+      * @param Readers reader slot policy (ThreadIdReaders or PerCpuReaders)
+      * @param Hash hash policy (ShiftHash, FibonacciHash or MurmurHash)
+      * @param Writers writer policy (ReaderPreference or WriterPreference)
+      * @param Stripes number of mutexes (power of two)
+      * @param P number of mutexes acquired by writer (read side parallelism)
+      * @param Align alignment of every mutex in bytes (0 - no padding, 64 - one mutex per cache line)
+      */
+    template< class Readers = ThreadIdReaders
+            , class Hash = ShiftHash
+            , class Writers = ReaderPreference
+            , size_t Stripes = SYNCOPE_NUM_LOCKS
+            , int P = SYNCOPE_READ_SIDE_PARALLELISM  // Parallelism factor for readers and writers
+            , size_t Align = SYNCOPE_STRIPE_ALIGN
+            >
+    class BasicAsymmetricLockLayer {
+        static_assert((Stripes & (Stripes - 1)) == 0, "Stripes must be a power of two");
+        static_assert(P > 0 && (P & (P - 1)) == 0 && size_t(P) <= Stripes, "P must be a power of two not greater than Stripes");
+        detail::LockLayerImpl impl_;
+        typedef typename Readers::template ReadHash<P, Hash> ReadHash;
+        typedef typename Readers::template WriteHash<P, Hash> WriteHash;
+        typedef detail::WriteIntent<P, 1, Writers> WriteIntent;
+        Hash hash_;
+        Writers writers_;
+
+        //! Compute reader's hash value
+        template<class T>
+        size_t read_hash(T const* ptr) const {
+            return ReadHash{hash_}(reinterpret_cast<size_t>(ptr));
+        }
+
+        //! Compute readers' hash values for all objects and wait for pending writers
+        template<class... T>
+        std::array<size_t, sizeof...(T)> read_hashes(T const*... ptrs) {
+            std::array<size_t, sizeof...(T)> res = {{ read_hash(ptrs)... }};
+            for (auto hash: res) {
+                writers_.wait(impl_.index(hash));
+            }
+            return res;
+        }
+
+        LockGuardRange read_range(LockGuardRange&& guard) {
+            if (Writers::enabled) {
+                guard.for_each_index([this](size_t ix) { writers_.wait(ix); });
+            }
+            guard.lock();
+            return std::move(guard);
+        }
+
+        LockGuardRange write_range(LockGuardRange&& guard) {
+            if (Writers::enabled) {
+                guard.for_each_index([this](size_t ix) { writers_.announce(ix); });
+            }
+            guard.lock();
+            if (Writers::enabled) {
+                guard.for_each_index([this](size_t ix) { writers_.retract(ix); });
+            }
+            return std::move(guard);
+        }
+
+        //! Compute index of the mutex acquired by upgradeable lock (first in locking order)
+        template<class T>
+        size_t upgrade_index(T const* ptr) const {
+            WriteHash hash{hash_};
+            size_t res = impl_.index(hash(reinterpret_cast<size_t>(ptr), 0));
+            for (int i = 1; i < P; i++) {
+                res = std::min(res, impl_.index(hash(reinterpret_cast<size_t>(ptr), i)));
+            }
+            return res;
+        }
+    public:
+
+        /** C-tor
+          * @param name statically initialized string
+          * @param salt hash salt, random by default
+          */
+        BasicAsymmetricLockLayer(detail::StaticString name, int level = -1, size_t salt = detail::random_salt())
+            : impl_(name.str(), level, Stripes, Align)
+            , hash_(salt)
+            , writers_(impl_.size())
+        {
+        }
+
+#ifdef SYNCOPE_CALL_SITES
+        template<class T>
+        LockGuard<T> synchronize_read(
+                const char* loc,
+                T const* ptr) {
+            size_t hash = read_hash(ptr);
+            writers_.wait(impl_.index(hash));
+            return std::move(LockGuard<T>(ptr, impl_, loc, detail::FixedHash{hash}, detail::GateKind::READ));
+        }
+#else
+        template<class T>
+        LockGuard<T> synchronize_read(T const* ptr) {
+            size_t hash = read_hash(ptr);
+            writers_.wait(impl_.index(hash));
+            return std::move(LockGuard<T>(ptr, impl_, detail::FixedHash{hash}, detail::GateKind::READ));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        template<typename T>
+        LockGuardMany<P, T> synchronize_write(
+                const char* loc,
+                T const* arg) {
+            WriteIntent intent(writers_, impl_, WriteHash{hash_}, arg);
+            return std::move(LockGuardMany<P, T>(impl_, loc, WriteHash{hash_}, arg));
+        }
+#else
+        template<typename T>
+        LockGuardMany<P, T> synchronize_write(T const* arg) {
+            WriteIntent intent(writers_, impl_, WriteHash{hash_}, arg);
+            return std::move(LockGuardMany<P, T>(impl_, WriteHash{hash_}, arg));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Acquire write locks for all objects
+        template<typename... T>
+        LockGuardMany<P, T...> synchronize_write_all(
+                const char* loc,
+                T const*... args) {
+            detail::WriteIntent<P, sizeof...(T), Writers> intent(writers_, impl_, WriteHash{hash_}, args...);
+            return std::move(LockGuardMany<P, T...>(impl_, loc, WriteHash{hash_}, args...));
+        }
+#else
+        //! Acquire write locks for all objects
+        template<typename... T>
+        LockGuardMany<P, T...> synchronize_write_all(T const*... args) {
+            detail::WriteIntent<P, sizeof...(T), Writers> intent(writers_, impl_, WriteHash{hash_}, args...);
+            return std::move(LockGuardMany<P, T...>(impl_, WriteHash{hash_}, args...));
+        }
+#endif
+
+        //! Precompute write lock plan (all P mutexes of every object) for the objects that are written many times
+        template<typename... T>
+        LockPlan<P, T...> plan_write(T const*... args) const {
+            return LockPlan<P, T...>(impl_, WriteHash{hash_}, args...);
+        }
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Acquire write locks for all objects of the plan created by `plan_write`
+        template<typename... T>
+        LockGuardMany<P, T...> synchronize_write(
+                const char* loc,
+                LockPlan<P, T...> const& plan) {
+            detail::PlanIntent<Writers, LockPlan<P, T...>> intent(writers_, impl_, plan);
+            return std::move(LockGuardMany<P, T...>(impl_, loc, plan));
+        }
+#else
+        //! Acquire write locks for all objects of the plan created by `plan_write`
+        template<typename... T>
+        LockGuardMany<P, T...> synchronize_write(LockPlan<P, T...> const& plan) {
+            detail::PlanIntent<Writers, LockPlan<P, T...>> intent(writers_, impl_, plan);
+            return std::move(LockGuardMany<P, T...>(impl_, plan));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Acquire read locks for all objects
+        template<typename... T>
+        LockGuardMany<1, T...> synchronize_read_all(
+                const char* loc,
+                T const*... args) {
+            return std::move(LockGuardMany<1, T...>(impl_, loc, read_hashes(args...), detail::GateKind::READ));
+        }
+#else
+        //! Acquire read locks for all objects
+        template<typename... T>
+        LockGuardMany<1, T...> synchronize_read_all(T const*... args) {
+            return std::move(LockGuardMany<1, T...>(impl_, read_hashes(args...), detail::GateKind::READ));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Acquire read locks for all objects from the range of pointers
+        template<class It>
+        LockGuardRange synchronize_read_range(const char* loc, It begin, It end) {
+            LockGuardRange guard(impl_, loc, std::defer_lock, detail::UnbiasedHash<ReadHash>{hash_}, 1, begin, end, detail::GateKind::READ);
+            return read_range(std::move(guard));
+        }
+#else
+        //! Acquire read locks for all objects from the range of pointers
+        template<class It>
+        LockGuardRange synchronize_read_range(It begin, It end) {
+            LockGuardRange guard(impl_, std::defer_lock, detail::UnbiasedHash<ReadHash>{hash_}, 1, begin, end, detail::GateKind::READ);
+            return read_range(std::move(guard));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Acquire write locks for all objects from the range of pointers
+        template<class It>
+        LockGuardRange synchronize_write_range(const char* loc, It begin, It end) {
+            LockGuardRange guard(impl_, loc, std::defer_lock, WriteHash{hash_}, P, begin, end);
+            return write_range(std::move(guard));
+        }
+#else
+        //! Acquire write locks for all objects from the range of pointers
+        template<class It>
+        LockGuardRange synchronize_write_range(It begin, It end) {
+            LockGuardRange guard(impl_, std::defer_lock, WriteHash{hash_}, P, begin, end);
+            return write_range(std::move(guard));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Lock the whole layer exclusively (e.g. to take a snapshot of all objects)
+        LayerGuard synchronize_layer(const char* loc) {
+            return std::move(LayerGuard(impl_, loc, false));
+        }
+
+        //! Lock the whole layer in shared mode, per-object locks are excluded
+        LayerGuard synchronize_layer_shared(const char* loc) {
+            return std::move(LayerGuard(impl_, loc, true));
+        }
+
+        //! Try to lock the whole layer exclusively until deadline (or for timeout)
+        template<class Clock, class Duration>
+        LayerGuard try_synchronize_layer(const char* loc, std::chrono::time_point<Clock, Duration> const& deadline) {
+            LayerGuard guard(impl_, loc, false, std::defer_lock);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period>
+        LayerGuard try_synchronize_layer(const char* loc, std::chrono::duration<Rep, Period> const& timeout) {
+            return try_synchronize_layer(loc, std::chrono::steady_clock::now() + timeout);
+        }
+#else
+        //! Lock the whole layer exclusively (e.g. to take a snapshot of all objects)
+        LayerGuard synchronize_layer() {
+            return std::move(LayerGuard(impl_, false));
+        }
+
+        //! Lock the whole layer in shared mode, per-object locks are excluded
+        LayerGuard synchronize_layer_shared() {
+            return std::move(LayerGuard(impl_, true));
+        }
+
+        //! Try to lock the whole layer exclusively until deadline (or for timeout)
+        template<class Clock, class Duration>
+        LayerGuard try_synchronize_layer(std::chrono::time_point<Clock, Duration> const& deadline) {
+            LayerGuard guard(impl_, false, std::defer_lock);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period>
+        LayerGuard try_synchronize_layer(std::chrono::duration<Rep, Period> const& timeout) {
+            return try_synchronize_layer(std::chrono::steady_clock::now() + timeout);
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Acquire upgradeable read lock
+        template<typename T>
+        UpgradeLockGuard<P, T> synchronize_upgrade(
+                const char* loc,
+                T const* arg) {
+            if (Writers::enabled) {
+                writers_.wait(upgrade_index(arg));
+            }
+            return std::move(UpgradeLockGuard<P, T>(impl_, loc, WriteHash{hash_}, arg));
+        }
+#else
+        //! Acquire upgradeable read lock
+        template<typename T>
+        UpgradeLockGuard<P, T> synchronize_upgrade(T const* arg) {
+            if (Writers::enabled) {
+                writers_.wait(upgrade_index(arg));
+            }
+            return std::move(UpgradeLockGuard<P, T>(impl_, WriteHash{hash_}, arg));
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Try to acquire read lock without blocking (or until deadline, or for timeout)
+        template<class T>
+        LockGuard<T> try_synchronize_read(const char* loc, T const* ptr) {
+            size_t hash = read_hash(ptr);
+            LockGuard<T> guard(ptr, impl_, loc, detail::FixedHash{hash}, std::defer_lock, detail::GateKind::READ);
+            if (!writers_.pending(impl_.index(hash))) {
+                guard.try_lock();
+            }
+            return guard;
+        }
+
+        template<class Clock, class Duration, class T>
+        LockGuard<T> try_synchronize_read(const char* loc, std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            size_t hash = read_hash(ptr);
+            LockGuard<T> guard(ptr, impl_, loc, detail::FixedHash{hash}, std::defer_lock, detail::GateKind::READ);
+            if (writers_.wait_until(impl_.index(hash), deadline)) {
+                guard.try_lock_until(deadline);
+            }
+            return guard;
+        }
+
+        template<class Rep, class Period, class T>
+        LockGuard<T> try_synchronize_read(const char* loc, std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize_read(loc, std::chrono::steady_clock::now() + timeout, ptr);
+        }
+#else
+        //! Try to acquire read lock without blocking (or until deadline, or for timeout)
+        template<class T>
+        LockGuard<T> try_synchronize_read(T const* ptr) {
+            size_t hash = read_hash(ptr);
+            LockGuard<T> guard(ptr, impl_, detail::FixedHash{hash}, std::defer_lock, detail::GateKind::READ);
+            if (!writers_.pending(impl_.index(hash))) {
+                guard.try_lock();
+            }
+            return guard;
+        }
+
+        template<class Clock, class Duration, class T>
+        LockGuard<T> try_synchronize_read(std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            size_t hash = read_hash(ptr);
+            LockGuard<T> guard(ptr, impl_, detail::FixedHash{hash}, std::defer_lock, detail::GateKind::READ);
+            if (writers_.wait_until(impl_.index(hash), deadline)) {
+                guard.try_lock_until(deadline);
+            }
+            return guard;
+        }
+
+        template<class Rep, class Period, class T>
+        LockGuard<T> try_synchronize_read(std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize_read(std::chrono::steady_clock::now() + timeout, ptr);
+        }
+#endif
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Try to acquire write lock without blocking (or until deadline, or for timeout)
+        template<typename T>
+        LockGuardMany<P, T> try_synchronize_write(const char* loc, T const* arg) {
+            LockGuardMany<P, T> guard(impl_, loc, std::defer_lock, WriteHash{hash_}, arg);
+            guard.try_lock();
+            return guard;
+        }
+
+        template<class Clock, class Duration, typename T>
+        LockGuardMany<P, T> try_synchronize_write(const char* loc, std::chrono::time_point<Clock, Duration> const& deadline, T const* arg) {
+            WriteIntent intent(writers_, impl_, WriteHash{hash_}, arg);
+            LockGuardMany<P, T> guard(impl_, loc, std::defer_lock, WriteHash{hash_}, arg);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period, typename T>
+        LockGuardMany<P, T> try_synchronize_write(const char* loc, std::chrono::duration<Rep, Period> const& timeout, T const* arg) {
+            return try_synchronize_write(loc, std::chrono::steady_clock::now() + timeout, arg);
+        }
+#else
+        //! Try to acquire write lock without blocking (or until deadline, or for timeout)
+        template<typename T>
+        LockGuardMany<P, T> try_synchronize_write(T const* arg) {
+            LockGuardMany<P, T> guard(impl_, std::defer_lock, WriteHash{hash_}, arg);
+            guard.try_lock();
+            return guard;
+        }
+
+        template<class Clock, class Duration, typename T>
+        LockGuardMany<P, T> try_synchronize_write(std::chrono::time_point<Clock, Duration> const& deadline, T const* arg) {
+            WriteIntent intent(writers_, impl_, WriteHash{hash_}, arg);
+            LockGuardMany<P, T> guard(impl_, std::defer_lock, WriteHash{hash_}, arg);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period, typename T>
+        LockGuardMany<P, T> try_synchronize_write(std::chrono::duration<Rep, Period> const& timeout, T const* arg) {
+            return try_synchronize_write(std::chrono::steady_clock::now() + timeout, arg);
+        }
+#endif
+
+#ifdef SYNCOPE_HAVE_COROUTINES
+#ifdef SYNCOPE_CALL_SITES
+        //! Acquire read lock asynchronously (see BasicSymmetricLockLayer::lock_async)
+        template<class Executor, class T, class = detail::EnableIfExecutor<Executor>>
+        AsyncLock<LockGuard<T>> lock_read_async(const char* loc, Executor executor, T const* ptr) {
+            size_t hash = read_hash(ptr);
+            size_t ix = impl_.index(hash);
+            LockGuard<T> guard(ptr, impl_, loc, detail::FixedHash{hash}, std::defer_lock, detail::GateKind::READ);
+            return detail::lock_async(impl_, std::move(guard), std::move(executor),
+                                      detail::NoIntent(), [this, ix] { return writers_.pending(ix); });
+        }
+
+        //! Acquire write lock asynchronously
+        template<class Executor, class T, class = detail::EnableIfExecutor<Executor>>
+        AsyncLock<LockGuardMany<P, T>> lock_write_async(const char* loc, Executor executor, T const* arg) {
+            LockGuardMany<P, T> guard(impl_, loc, std::defer_lock, WriteHash{hash_}, arg);
+            return detail::lock_async(impl_, std::move(guard), std::move(executor),
+                                      [this, arg] { return WriteIntent(writers_, impl_, WriteHash{hash_}, arg); },
+                                      detail::NoBackoff());
+        }
+#else
+        //! Acquire read lock asynchronously (see BasicSymmetricLockLayer::lock_async)
+        template<class Executor, class T, class = detail::EnableIfExecutor<Executor>>
+        AsyncLock<LockGuard<T>> lock_read_async(Executor executor, T const* ptr) {
+            size_t hash = read_hash(ptr);
+            size_t ix = impl_.index(hash);
+            LockGuard<T> guard(ptr, impl_, detail::FixedHash{hash}, std::defer_lock, detail::GateKind::READ);
+            return detail::lock_async(impl_, std::move(guard), std::move(executor),
+                                      detail::NoIntent(), [this, ix] { return writers_.pending(ix); });
+        }
+
+        //! Acquire write lock asynchronously
+        template<class Executor, class T, class = detail::EnableIfExecutor<Executor>>
+        AsyncLock<LockGuardMany<P, T>> lock_write_async(Executor executor, T const* arg) {
+            LockGuardMany<P, T> guard(impl_, std::defer_lock, WriteHash{hash_}, arg);
+            return detail::lock_async(impl_, std::move(guard), std::move(executor),
+                                      [this, arg] { return WriteIntent(writers_, impl_, WriteHash{hash_}, arg); },
+                                      detail::NoBackoff());
+        }
+#endif
+#endif
+
+        /** Wait until `pred` returns true.
+          * Guard must hold the lock of the object (write lock for asymmetric layer),
+          * it's released while waiting and reacquired before `pred` is checked.
+          */
+        template<class Guard, class T, class Pred>
+        void wait(Guard& guard, T const* ptr, Pred pred) {
+            impl_.wait(guard, upgrade_index(ptr), ptr, pred);
+        }
+
+        //! Wait until `pred` returns true or deadline is reached, returns `pred()`
+        template<class Guard, class T, class Clock, class Duration, class Pred>
+        bool wait_until(Guard& guard, T const* ptr, std::chrono::time_point<Clock, Duration> const& deadline, Pred pred) {
+            return impl_.wait_until(guard, upgrade_index(ptr), ptr, deadline, pred);
+        }
+
+        //! Wait until `pred` returns true or timeout expires, returns `pred()`
+        template<class Guard, class T, class Rep, class Period, class Pred>
+        bool wait_for(Guard& guard, T const* ptr, std::chrono::duration<Rep, Period> const& timeout, Pred pred) {
+            return impl_.wait_until(guard, upgrade_index(ptr), ptr, std::chrono::steady_clock::now() + timeout, pred);
+        }
+
+        //! Wake up all threads waiting on the object
+        template<class T>
+        void notify(T const* ptr) {
+            impl_.notify(upgrade_index(ptr), ptr, true);
+        }
+
+        //! Wake up one thread waiting on the object
+        template<class T>
+        void notify_one(T const* ptr) {
+            impl_.notify(upgrade_index(ptr), ptr, false);
+        }
+
+        /** Build stripe occupancy histogram for the range of pointers.
+          * Every object is counted once for each of the P mutexes acquired by writer.
+          */
+        template<class It>
+        StripeHistogram histogram(It begin, It end) const {
+            StripeHistogram res(impl_.size());
+            WriteHash hash{hash_};
+            for (auto it = begin; it != end; ++it) {
+                std::array<size_t, P> ixs;
+                for (int i = 0; i < P; i++) {
+                    ixs[i] = impl_.index(hash(reinterpret_cast<size_t>(*it), i));
+                }
+                std::sort(ixs.begin(), ixs.end());
+                auto last = std::unique(ixs.begin(), ixs.end());
+                for (auto ix = ixs.begin(); ix != last; ++ix) {
+                    res.counts[*ix]++;
+                }
+                res.objects++;
+            }
+            return res;
+        }
+
+#ifdef SYNCOPE_COLLECT_STATS
+        //! Returns lock statistics of the layer
+        LayerStats snapshot() const {
+            return impl_.snapshot();
+        }
+#endif
+    };
+
+    typedef BasicAsymmetricLockLayer<> AsymmetricLockLayer;
+
+    //! Asymmetric lock layer with per-CPU reader slots
+    typedef BasicAsymmetricLockLayer<PerCpuReaders> PerCpuAsymmetricLockLayer;
+
+    //! Asymmetric lock layer with bounded writer latency
+    typedef BasicAsymmetricLockLayer<ThreadIdReaders, ShiftHash, WriterPreference> WriterPreferringLockLayer;
+
+namespace detail {
+
+    /** Table of visible readers shared by all reader-biased layers.
+      * Fast path reader publishes itself by storing the address of the stripe's
+      * bias flag into the table. Every flag owns a window of WINDOW slots, one per
+      * thread slot and one cache line apart (so readers of the same object don't
+      * share cache lines). Windows of different flags overlap. Writer that revokes
+      * the bias scans only the window of its flag, not the whole table.
+      */
+    class VisibleReaders {
+        static_assert((SYNCOPE_VISIBLE_READERS & (SYNCOPE_VISIBLE_READERS - 1)) == 0,
+                      "SYNCOPE_VISIBLE_READERS must be a power of two");
+        enum {
+            //! Distance between slots of the window
+            STRIDE = 64/sizeof(std::atomic<const void*>),
+            WINDOW = SYNCOPE_VISIBLE_READERS/STRIDE < 64 ? SYNCOPE_VISIBLE_READERS/STRIDE : 64,
+            MASK = SYNCOPE_VISIBLE_READERS - 1,
+        };
+        std::atomic<const void*> slots_[SYNCOPE_VISIBLE_READERS];
+
+        VisibleReaders() {
+            for (auto& slot: slots_) {
+                slot.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        //! First slot of the window
+        static size_t base(const void* flag) {
+            uint64_t x = reinterpret_cast<size_t>(flag);
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdull;
+            x ^= x >> 33;
+            return static_cast<size_t>(x);
+        }
+    public:
+        static VisibleReaders& instance() {
+            static VisibleReaders table;
+            return table;
+        }
+
+        //! Returns slot of the calling thread for the bias flag `flag`
+        std::atomic<const void*>* slot(const void* flag) {
+            size_t ix = base(flag) + static_cast<size_t>(thread_slot() % WINDOW)*STRIDE;
+            return &slots_[ix & MASK];
+        }
+
+        //! Wait until all readers published with `flag` leave, returns false if deadline is reached first
+        template<class Clock, class Duration>
+        bool drain(const void* flag, std::chrono::time_point<Clock, Duration> const* deadline) {
+            size_t first = base(flag);
+            for (size_t w = 0; w < WINDOW; w++) {
+                auto& slot = slots_[(first + w*STRIDE) & MASK];
+                // Fast path reader publishes itself before checking the flag, writer
+                // clears the flag before the scan (both sides are sequentially consistent)
+                for (int i = 0; slot.load(std::memory_order_seq_cst) == flag; i++) {
+                    if (deadline && Clock::now() >= *deadline) {
+                        return false;
+                    }
+                    if (i > 100) {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+            return true;
+        }
+    };
+}  // namespace detail
+
+    /** Read guard of the reader-biased layer.
+      * Owns either a slot of the visible readers table (fast path) or
+      * the read mutex of the layer (slow path).
+      */
+    template<class T>
+    class BiasedReadGuard {
+        std::atomic<const void*>* slot_;
+        LockGuard<T> guard_;
+#ifdef SYNCOPE_CALL_SITES
+        detail::LockLayerImpl* impl_;
+        const char* loc_;
+#endif
+
+        void unlock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_->site_unlock(loc_);
+#endif
+            slot_->store(nullptr, std::memory_order_release);
+            slot_ = nullptr;
+        }
+    public:
+        //! Slow path guard
+        explicit BiasedReadGuard(LockGuard<T>&& guard)
+            : slot_(nullptr)
+            , guard_(std::move(guard))
+#ifdef SYNCOPE_CALL_SITES
+            , impl_(nullptr)
+            , loc_(nullptr)
+#endif
+        {
+        }
+
+        //! Fast path guard, `guard` doesn't own the lock
+        BiasedReadGuard( std::atomic<const void*>* slot
+#ifdef SYNCOPE_CALL_SITES
+                       , detail::LockLayerImpl& impl
+                       , const char* loc
+#endif
+                       , LockGuard<T>&& guard)
+            : slot_(slot)
+            , guard_(std::move(guard))
+#ifdef SYNCOPE_CALL_SITES
+            , impl_(&impl)
+            , loc_(loc)
+#endif
+        {
+        }
+
+        BiasedReadGuard(BiasedReadGuard const&) = delete;
+        BiasedReadGuard& operator = (BiasedReadGuard const&) = delete;
+
+        BiasedReadGuard(BiasedReadGuard&& other)
+            : slot_(other.slot_)
+            , guard_(std::move(other.guard_))
+#ifdef SYNCOPE_CALL_SITES
+            , impl_(other.impl_)
+            , loc_(other.loc_)
+#endif
+        {
+            other.slot_ = nullptr;
+        }
+
+        ~BiasedReadGuard() {
+            if (slot_) {
+                unlock();
+            }
+        }
+
+        //! Returns true if the lock was taken without touching the mutex
+        bool biased() const {
+            return slot_ != nullptr;
+        }
+
+        bool owns_lock() const {
+            return slot_ != nullptr || guard_.owns_lock();
+        }
+
+        explicit operator bool () const {
+            return owns_lock();
+        }
+    };
+
+    /** Reader-biased lock hierarchy layer (BRAVO).
+      * Asymmetric layer with the fast path for readers. While the bias of the
+      * object's stripe is enabled, reader doesn't touch the mutexes at all: it
+      * publishes itself in the global table of visible readers with a single CAS
+      * (falls back to the mutex if the slot is taken by another reader). Writer
+      * locks its mutexes as in asymmetric layer, revokes the bias and waits until
+      * published readers of the stripe leave. Slow path reader re-enables the bias,
+      * but not earlier than INHIBIT_FACTOR times the duration of the last revocation
+      * after it, so the revocation cost stays bounded in write-heavy workloads.
+      * Read-all, range, upgrade, asynchronous and wait operations aren't supported,
+      * lock statistics count slow path acquisitions only.
+      * @param Readers reader slot policy of the slow path (ThreadIdReaders or PerCpuReaders)
+      * @param Hash hash policy (ShiftHash, FibonacciHash or MurmurHash)
+      * @param Writers writer policy (ReaderPreference or WriterPreference)
+      * @param Stripes number of mutexes and bias flags (power of two)
+      * @param P number of mutexes acquired by writer (read side parallelism)
+      * @param Align alignment of every mutex in bytes (0 - no padding, 64 - one mutex per cache line)
+      */
+    template< class Readers = ThreadIdReaders
+            , class Hash = ShiftHash
+            , class Writers = ReaderPreference
+            , size_t Stripes = SYNCOPE_NUM_LOCKS
+            , int P = SYNCOPE_READ_SIDE_PARALLELISM
+            , size_t Align = SYNCOPE_STRIPE_ALIGN
+            >
+    class BasicReaderBiasedLockLayer {
+        static_assert((Stripes & (Stripes - 1)) == 0, "Stripes must be a power of two");
+        static_assert(P > 0 && (P & (P - 1)) == 0 && size_t(P) <= Stripes, "P must be a power of two not greater than Stripes");
+        typedef typename Readers::template ReadHash<P, Hash> ReadHash;
+        typedef typename Readers::template WriteHash<P, Hash> WriteHash;
+        typedef detail::WriteIntent<P, 1, Writers> WriteIntent;
+
+        struct Bias {
+            std::atomic<bool> enabled;
+            //! Bias can't be enabled until this time (ns), written under the write lock
+            uint64_t inhibit_until;
+        };
+
+        detail::LockLayerImpl impl_;
+        Hash hash_;
+        Writers writers_;
+        std::unique_ptr<Bias[]> biases_;
+
+        static uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        //! Index of the bias flag (same for readers and writers of the object)
+        template<class T>
+        size_t bias_index(T const* ptr) const {
+            return impl_.index(WriteHash{hash_}(reinterpret_cast<size_t>(ptr), 0));
+        }
+
+        template<class T>
+        size_t read_hash(T const* ptr) const {
+            return ReadHash{hash_}(reinterpret_cast<size_t>(ptr));
+        }
+
+        //! Try to take the fast path, returns published slot or nullptr
+        std::atomic<const void*>* publish(size_t bx) {
+            auto& flag = biases_[bx].enabled;
+            if (!flag.load(std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            auto slot = detail::VisibleReaders::instance().slot(&flag);
+            const void* expected = nullptr;
+            if (!slot->compare_exchange_strong(expected, &flag, std::memory_order_seq_cst)) {
+                return nullptr;
+            }
+            if (flag.load(std::memory_order_seq_cst)) {
+                return slot;
+            }
+            slot->store(nullptr, std::memory_order_release);
+            return nullptr;
+        }
+
+        /** Re-enable the bias, must be called under the read lock.
+          * Clock is checked on every 16th slow path read of the thread (it's not cheap
+          * on some VMs). Release store publishes writes of the previous writer to the
+          * fast path readers.
+          */
+        void enable(size_t bx) {
+            static thread_local unsigned ticks = 0u;
+            Bias& bias = biases_[bx];
+            if (!bias.enabled.load(std::memory_order_relaxed) && (++ticks & 15u) == 0u && now() >= bias.inhibit_until) {
+                bias.enabled.store(true, std::memory_order_release);
+            }
+        }
+
+        /** Revoke the bias and wait for fast path readers, must be called under the write lock.
+          * Returns false (bias is restored) if deadline is reached first.
+          */
+        template<class Clock, class Duration>
+        bool revoke(size_t bx, std::chrono::time_point<Clock, Duration> const* deadline) {
+            Bias& bias = biases_[bx];
+            if (!bias.enabled.load(std::memory_order_relaxed)) {
+                return true;
+            }
+            uint64_t start = now();
+            bias.enabled.store(false, std::memory_order_seq_cst);
+            if (!detail::VisibleReaders::instance().drain(&bias.enabled, deadline)) {
+                bias.enabled.store(true, std::memory_order_release);
+                return false;
+            }
+            uint64_t end = now();
+            bias.inhibit_until = end + (end - start)*INHIBIT_FACTOR;
+            return true;
+        }
+
+        //! Revoke the bias if the write lock is acquired, release the lock on timeout
+        template<class Guard, class Clock, class Duration>
+        Guard revoke_until(Guard guard, size_t bx, std::chrono::time_point<Clock, Duration> const& deadline) {
+            if (guard.owns_lock() && !revoke(bx, &deadline)) {
+                Guard tmp(std::move(guard));
+            }
+            return guard;
+        }
+    public:
+        enum {
+            //! Bias is inhibited for INHIBIT_FACTOR times the duration of the last revocation
+            INHIBIT_FACTOR = 9
+        };
+
+        /** C-tor
+          * @param name statically initialized string
+          * @param salt hash salt, random by default
+          */
+        BasicReaderBiasedLockLayer(detail::StaticString name, int level = -1, size_t salt = detail::random_salt())
+            : impl_(name.str(), level, Stripes, Align)
+            , hash_(salt)
+            , writers_(impl_.size())
+            , biases_(new Bias[Stripes])
+        {
+            for (size_t i = 0; i < Stripes; i++) {
+                biases_[i].enabled.store(true, std::memory_order_relaxed);
+                biases_[i].inhibit_until = 0u;
+            }
+        }
+
+#ifdef SYNCOPE_CALL_SITES
+        template<class T>
+        BiasedReadGuard<T> synchronize_read(const char* loc, T const* ptr) {
+            size_t bx = bias_index(ptr);
+            if (auto slot = publish(bx)) {
+                impl_.site_lock(loc);
+                return BiasedReadGuard<T>(slot, impl_, loc, LockGuard<T>(ptr, impl_, loc, detail::FixedHash{0}, std::defer_lock));
+            }
+            size_t hash = read_hash(ptr);
+            writers_.wait(impl_.index(hash));
+            LockGuard<T> guard(ptr, impl_, loc, detail::FixedHash{hash});
+            enable(bx);
+            return BiasedReadGuard<T>(std::move(guard));
+        }
+
+        template<typename T>
+        LockGuardMany<P, T> synchronize_write(const char* loc, T const* arg) {
+            WriteIntent intent(writers_, impl_, WriteHash{hash_}, arg);
+            LockGuardMany<P, T> guard(impl_, loc, WriteHash{hash_}, arg);
+            revoke(bias_index(arg), static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+            return guard;
+        }
+
+        //! Try to acquire read lock without blocking (or until deadline, or for timeout)
+        template<class T>
+        BiasedReadGuard<T> try_synchronize_read(const char* loc, T const* ptr) {
+            size_t bx = bias_index(ptr);
+            if (auto slot = publish(bx)) {
+                impl_.site_lock(loc);
+                return BiasedReadGuard<T>(slot, impl_, loc, LockGuard<T>(ptr, impl_, loc, detail::FixedHash{0}, std::defer_lock));
+            }
+            size_t hash = read_hash(ptr);
+            LockGuard<T> guard(ptr, impl_, loc, detail::FixedHash{hash}, std::defer_lock);
+            if (!writers_.pending(impl_.index(hash)) && guard.try_lock()) {
+                enable(bx);
+            }
+            return BiasedReadGuard<T>(std::move(guard));
+        }
+
+        template<class Clock, class Duration, class T>
+        BiasedReadGuard<T> try_synchronize_read(const char* loc, std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            size_t bx = bias_index(ptr);
+            if (auto slot = publish(bx)) {
+                impl_.site_lock(loc);
+                return BiasedReadGuard<T>(slot, impl_, loc, LockGuard<T>(ptr, impl_, loc, detail::FixedHash{0}, std::defer_lock));
+            }
+            size_t hash = read_hash(ptr);
+            LockGuard<T> guard(ptr, impl_, loc, detail::FixedHash{hash}, std::defer_lock);
+            if (writers_.wait_until(impl_.index(hash), deadline) && guard.try_lock_until(deadline)) {
+                enable(bx);
+            }
+            return BiasedReadGuard<T>(std::move(guard));
+        }
+
+        template<class Rep, class Period, class T>
+        BiasedReadGuard<T> try_synchronize_read(const char* loc, std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize_read(loc, std::chrono::steady_clock::now() + timeout, ptr);
+        }
+
+        //! Try to acquire write lock without blocking (or until deadline, or for timeout)
+        template<typename T>
+        LockGuardMany<P, T> try_synchronize_write(const char* loc, T const* arg) {
+            LockGuardMany<P, T> guard(impl_, loc, std::defer_lock, WriteHash{hash_}, arg);
+            guard.try_lock();
+            return revoke_until(std::move(guard), bias_index(arg), std::chrono::steady_clock::now());
+        }
+
+        template<class Clock, class Duration, typename T>
+        LockGuardMany<P, T> try_synchronize_write(const char* loc, std::chrono::time_point<Clock, Duration> const& deadline, T const* arg) {
+            WriteIntent intent(writers_, impl_, WriteHash{hash_}, arg);
+            LockGuardMany<P, T> guard(impl_, loc, std::defer_lock, WriteHash{hash_}, arg);
+            guard.try_lock_until(deadline);
+            return revoke_until(std::move(guard), bias_index(arg), deadline);
+        }
+
+        template<class Rep, class Period, typename T>
+        LockGuardMany<P, T> try_synchronize_write(const char* loc, std::chrono::duration<Rep, Period> const& timeout, T const* arg) {
+            return try_synchronize_write(loc, std::chrono::steady_clock::now() + timeout, arg);
+        }
+#else
+        template<class T>
+        BiasedReadGuard<T> synchronize_read(T const* ptr) {
+            size_t bx = bias_index(ptr);
+            if (auto slot = publish(bx)) {
+                return BiasedReadGuard<T>(slot, LockGuard<T>(ptr, impl_, detail::FixedHash{0}, std::defer_lock));
+            }
+            size_t hash = read_hash(ptr);
+            writers_.wait(impl_.index(hash));
+            LockGuard<T> guard(ptr, impl_, detail::FixedHash{hash});
+            enable(bx);
+            return BiasedReadGuard<T>(std::move(guard));
+        }
+
+        template<typename T>
+        LockGuardMany<P, T> synchronize_write(T const* arg) {
+            WriteIntent intent(writers_, impl_, WriteHash{hash_}, arg);
+            LockGuardMany<P, T> guard(impl_, WriteHash{hash_}, arg);
+            revoke(bias_index(arg), static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+            return guard;
+        }
+
+        //! Try to acquire read lock without blocking (or until deadline, or for timeout)
+        template<class T>
+        BiasedReadGuard<T> try_synchronize_read(T const* ptr) {
+            size_t bx = bias_index(ptr);
+            if (auto slot = publish(bx)) {
+                return BiasedReadGuard<T>(slot, LockGuard<T>(ptr, impl_, detail::FixedHash{0}, std::defer_lock));
+            }
+            size_t hash = read_hash(ptr);
+            LockGuard<T> guard(ptr, impl_, detail::FixedHash{hash}, std::defer_lock);
+            if (!writers_.pending(impl_.index(hash)) && guard.try_lock()) {
+                enable(bx);
+            }
+            return BiasedReadGuard<T>(std::move(guard));
+        }
+
+        template<class Clock, class Duration, class T>
+        BiasedReadGuard<T> try_synchronize_read(std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            size_t bx = bias_index(ptr);
+            if (auto slot = publish(bx)) {
+                return BiasedReadGuard<T>(slot, LockGuard<T>(ptr, impl_, detail::FixedHash{0}, std::defer_lock));
+            }
+            size_t hash = read_hash(ptr);
+            LockGuard<T> guard(ptr, impl_, detail::FixedHash{hash}, std::defer_lock);
+            if (writers_.wait_until(impl_.index(hash), deadline) && guard.try_lock_until(deadline)) {
+                enable(bx);
+            }
+            return BiasedReadGuard<T>(std::move(guard));
+        }
+
+        template<class Rep, class Period, class T>
+        BiasedReadGuard<T> try_synchronize_read(std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize_read(std::chrono::steady_clock::now() + timeout, ptr);
+        }
+
+        //! Try to acquire write lock without blocking (or until deadline, or for timeout)
+        template<typename T>
+        LockGuardMany<P, T> try_synchronize_write(T const* arg) {
+            LockGuardMany<P, T> guard(impl_, std::defer_lock, WriteHash{hash_}, arg);
+            guard.try_lock();
+            return revoke_until(std::move(guard), bias_index(arg), std::chrono::steady_clock::now());
+        }
+
+        template<class Clock, class Duration, typename T>
+        LockGuardMany<P, T> try_synchronize_write(std::chrono::time_point<Clock, Duration> const& deadline, T const* arg) {
+            WriteIntent intent(writers_, impl_, WriteHash{hash_}, arg);
+            LockGuardMany<P, T> guard(impl_, std::defer_lock, WriteHash{hash_}, arg);
+            guard.try_lock_until(deadline);
+            return revoke_until(std::move(guard), bias_index(arg), deadline);
+        }
+
+        template<class Rep, class Period, typename T>
+        LockGuardMany<P, T> try_synchronize_write(std::chrono::duration<Rep, Period> const& timeout, T const* arg) {
+            return try_synchronize_write(std::chrono::steady_clock::now() + timeout, arg);
+        }
+#endif
+
+        //! Returns true if fast path is enabled for the object
+        template<class T>
+        bool biased(T const* ptr) const {
+            return biases_[bias_index(ptr)].enabled.load(std::memory_order_relaxed);
+        }
+
+#ifdef SYNCOPE_COLLECT_STATS
+        //! Returns lock statistics of the layer (slow path only)
+        LayerStats snapshot() const {
+            return impl_.snapshot();
+        }
+#endif
+    };
+
+    typedef BasicReaderBiasedLockLayer<> ReaderBiasedLockLayer;
+
+    /** Optimistic (seqlock) lock hierarchy layer.
+      * Every stripe has a version counter. Writers lock the mutex of the stripe
+      * and make the version odd for the duration of the critical section.
+      * Readers don't write to shared memory at all: they read the version,
+      * read the object and retry if the version was changed.
+      * Data read optimistically can be inconsistent until validated, so the
+      * reader must tolerate concurrent modification (read std::atomic fields
+      * with relaxed ordering or copy small trivially copyable objects) and
+      * shouldn't follow pointers read from the object without validation.
+      * @param Hash hash policy (ShiftHash, FibonacciHash or MurmurHash)
+      * @param Stripes number of mutexes and version counters (power of two)
+      * @param Align alignment of every mutex in bytes (version counters are always padded)
+      */
+    template<class Hash = ShiftHash, size_t Stripes = SYNCOPE_NUM_LOCKS, size_t Align = SYNCOPE_STRIPE_ALIGN>
+    class BasicOptimisticLockLayer {
+        static_assert((Stripes & (Stripes - 1)) == 0, "Stripes must be a power of two");
+        struct Version {
+            std::atomic<uint64_t> value;
+            char pad[64 - sizeof(std::atomic<uint64_t>)];
+            Version()
+                : value{0u}
+            {
+            }
+        };
+        detail::LockLayerImpl impl_;
+        Hash hash_;
+        std::unique_ptr<char[]> buffer_;
+        //! Cache line aligned array of versions
+        Version* versions_;
+
+        template<class T>
+        size_t index(T const* ptr) const {
+            return impl_.index(detail::SimpleHash<Hash>{hash_}(reinterpret_cast<size_t>(ptr)));
+        }
+    public:
+        //! Snapshot of the stripe version taken by the reader
+        struct ReadToken {
+            size_t ix;
+            uint64_t version;
+        };
+
+        /** C-tor
+          * @param name statically initialized string
+          * @param salt hash salt, random by default
+          */
+        BasicOptimisticLockLayer(detail::StaticString name, int level = -1, size_t salt = detail::random_salt())
+            : impl_(name.str(), level, Stripes, Align)
+            , hash_(salt)
+            , buffer_(new char[sizeof(Version)*(Stripes + 1)])
+        {
+            size_t addr = reinterpret_cast<size_t>(buffer_.get());
+            versions_ = reinterpret_cast<Version*>(buffer_.get() + (sizeof(Version) - addr % sizeof(Version)) % sizeof(Version));
+            for (size_t i = 0; i < Stripes; i++) {
+                new (versions_ + i) Version();
+            }
+        }
+
+        BasicOptimisticLockLayer(BasicOptimisticLockLayer const&) = delete;
+        BasicOptimisticLockLayer& operator = (BasicOptimisticLockLayer const&) = delete;
+
+        //! Start optimistic read, waits while the object is being written
+        template<class T>
+        ReadToken read_begin(T const* ptr) const {
+            ReadToken token = { index(ptr), 0u };
+            auto const& version = versions_[token.ix].value;
+            for (int i = 0;; i++) {
+                token.version = version.load(std::memory_order_acquire);
+                if ((token.version & 1) == 0) {
+                    break;
+                }
+                if (i > 100) {
+                    std::this_thread::yield();
+                }
+            }
+            return token;
+        }
+
+        //! Returns true if the object wasn't modified since `read_begin`
+        bool read_validate(ReadToken const& token) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return versions_[token.ix].value.load(std::memory_order_relaxed) == token.version;
+        }
+
+        /** Call `fn` until it observes consistent state of the object.
+          * `fn` can be called many times and should only read the object.
+          * Must not be called by the thread that holds the write lock of the same object.
+          */
+        template<class T, class Fn>
+        void read(T const* ptr, Fn const& fn) const {
+            while (true) {
+                auto token = read_begin(ptr);
+                fn();
+                if (read_validate(token)) {
+                    return;
+                }
+            }
+        }
+
+#ifdef SYNCOPE_CALL_SITES
+        template<class T>
+        OptimisticWriteGuard synchronize_write(const char* loc, T const* ptr) {
+            auto ix = index(ptr);
+            return std::move(OptimisticWriteGuard(impl_, loc, versions_[ix].value, ix));
+        }
+
+        //! Try to lock object without blocking (or until deadline, or for timeout)
+        template<class T>
+        OptimisticWriteGuard try_synchronize_write(const char* loc, T const* ptr) {
+            auto ix = index(ptr);
+            OptimisticWriteGuard guard(impl_, loc, versions_[ix].value, ix, std::defer_lock);
+            guard.try_lock();
+            return guard;
+        }
+
+        template<class Clock, class Duration, class T>
+        OptimisticWriteGuard try_synchronize_write(const char* loc, std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            auto ix = index(ptr);
+            OptimisticWriteGuard guard(impl_, loc, versions_[ix].value, ix, std::defer_lock);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period, class T>
+        OptimisticWriteGuard try_synchronize_write(const char* loc, std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize_write(loc, std::chrono::steady_clock::now() + timeout, ptr);
+        }
+#else
+        template<class T>
+        OptimisticWriteGuard synchronize_write(T const* ptr) {
+            auto ix = index(ptr);
+            return std::move(OptimisticWriteGuard(impl_, versions_[ix].value, ix));
+        }
+
+        //! Try to lock object without blocking (or until deadline, or for timeout)
+        template<class T>
+        OptimisticWriteGuard try_synchronize_write(T const* ptr) {
+            auto ix = index(ptr);
+            OptimisticWriteGuard guard(impl_, versions_[ix].value, ix, std::defer_lock);
+            guard.try_lock();
+            return guard;
+        }
+
+        template<class Clock, class Duration, class T>
+        OptimisticWriteGuard try_synchronize_write(std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            auto ix = index(ptr);
+            OptimisticWriteGuard guard(impl_, versions_[ix].value, ix, std::defer_lock);
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period, class T>
+        OptimisticWriteGuard try_synchronize_write(std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize_write(std::chrono::steady_clock::now() + timeout, ptr);
+        }
+#endif
+
+        //! Build stripe occupancy histogram for the range of pointers
+        template<class It>
+        StripeHistogram histogram(It begin, It end) const {
+            StripeHistogram res(impl_.size());
+            for (auto it = begin; it != end; ++it) {
+                res.counts[index(*it)]++;
+                res.objects++;
+            }
+            return res;
+        }
+
+#ifdef SYNCOPE_COLLECT_STATS
+        //! Returns lock statistics of the layer (writers only)
+        LayerStats snapshot() const {
+            return impl_.snapshot();
+        }
+#endif
+    };
+
+    typedef BasicOptimisticLockLayer<> OptimisticLockLayer;
+
+    /** Guard of the combining lock layer.
+      * Runs closures submitted by other threads before releasing the mutex.
+      */
+    class CombiningGuard {
+        detail::LockLayerImpl& impl_;
+        detail::Combiner& combiner_;
+        size_t ix_;
+        bool owns_lock_;
+#ifdef SYNCOPE_CALL_SITES
+        const char* loc_;
+#endif
+
+        void lock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_lock(loc_);
+#endif
+            impl_.lock(ix_);
+#ifdef SYNCOPE_TRACE
+            impl_.trace_acquired(loc_);
+#endif
+            owns_lock_ = true;
+        }
+
+        void unlock() {
+#ifdef SYNCOPE_CALL_SITES
+            impl_.site_unlock(loc_);
+#endif
+            combiner_.release(impl_, ix_);
+            owns_lock_ = false;
+        }
+    public:
+        CombiningGuard( detail::LockLayerImpl& impl
+#ifdef SYNCOPE_CALL_SITES
+                      , const char* loc
+#endif
+                      , detail::Combiner& combiner
+                      , size_t ix)
+            : impl_(impl)
+            , combiner_(combiner)
+            , ix_(ix)
+            , owns_lock_(false)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(loc)
+#endif
+        {
+            lock();
+        }
+
+        CombiningGuard(CombiningGuard const&) = delete;
+        CombiningGuard& operator = (CombiningGuard const&) = delete;
+
+        CombiningGuard(CombiningGuard&& other)
+            : impl_(other.impl_)
+            , combiner_(other.combiner_)
+            , ix_(other.ix_)
+            , owns_lock_(other.owns_lock_)
+#ifdef SYNCOPE_CALL_SITES
+            , loc_(other.loc_)
+#endif
+        {
+            other.owns_lock_ = false;
+        }
+
+        ~CombiningGuard() {
+            if (owns_lock_) {
+                unlock();
+            }
+        }
+
+        bool owns_lock() const {
+            return owns_lock_;
+        }
+
+        explicit operator bool () const {
+            return owns_lock_;
+        }
+    };
+
+    /** Flat combining lock hierarchy layer.
+      * Critical sections are submitted as closures. Thread that holds the mutex
+      * runs closures of all threads waiting for the same mutex in a batch, so
+      * protected data stays in its cache and the mutex isn't handed over
+      * between threads. Closures run on the combiner's thread and shouldn't
+      * rely on thread-local state of the submitter. The combiner can hold locks
+      * of other layers, so closures must not acquire any locks (lock order
+      * wouldn't be seen by the deadlock detector and level checks), this is
+      * checked by `assert` in debug builds.
+      * @param Hash hash policy (ShiftHash, FibonacciHash or MurmurHash)
+      * @param Stripes number of mutexes (power of two)
+      * @param Align alignment of every mutex in bytes (0 - no padding, 64 - one mutex per cache line)
+      */
+    template<class Hash = ShiftHash, size_t Stripes = SYNCOPE_NUM_LOCKS, size_t Align = SYNCOPE_STRIPE_ALIGN>
+    class BasicCombiningLockLayer {
+        static_assert((Stripes & (Stripes - 1)) == 0, "Stripes must be a power of two");
+        detail::LockLayerImpl impl_;
+        Hash hash_;
+        detail::Combiner combiner_;
+
+        template<class T>
+        size_t index(T const* ptr) const {
+            return impl_.index(detail::SimpleHash<Hash>{hash_}(reinterpret_cast<size_t>(ptr)));
+        }
+    public:
+        /** C-tor
+          * @param name statically initialized string
+          * @param salt hash salt, random by default
+          */
+        BasicCombiningLockLayer(detail::StaticString name, int level = -1, size_t salt = detail::random_salt())
+            : impl_(name.str(), level, Stripes, Align)
+            , hash_(salt)
+            , combiner_(Stripes)
+        {
+        }
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Lock object, closures submitted by other threads are executed on unlock
+        template<class T>
+        CombiningGuard synchronize(const char* loc, T const* ptr) {
+            return std::move(CombiningGuard(impl_, loc, combiner_, index(ptr)));
+        }
+
+        //! Execute `fn` under the lock of the object (possibly by another thread), returns result of `fn`
+        template<class T, class Fn>
+        auto execute(const char* loc, T const* ptr, Fn fn) -> decltype(fn()) {
+            impl_.site_lock(loc);
+            struct Unlock {
+                detail::LockLayerImpl& impl;
+                const char* loc;
+                ~Unlock() { impl.site_unlock(loc); }
+            } unlock = { impl_, loc };
+            return combiner_.execute(impl_, index(ptr), fn);
+        }
+
+        //! Submit `fn` for execution under the lock of the object without waiting
+        template<class T, class Fn>
+        auto execute_async(const char* loc, T const* ptr, Fn fn) -> std::future<decltype(fn())> {
+            impl_.site_lock(loc);
+            impl_.site_unlock(loc);
+            return combiner_.execute_async(impl_, index(ptr), std::move(fn));
+        }
+#else
+        //! Lock object, closures submitted by other threads are executed on unlock
+        template<class T>
+        CombiningGuard synchronize(T const* ptr) {
+            return std::move(CombiningGuard(impl_, combiner_, index(ptr)));
+        }
+
+        //! Execute `fn` under the lock of the object (possibly by another thread), returns result of `fn`
+        template<class T, class Fn>
+        auto execute(T const* ptr, Fn fn) -> decltype(fn()) {
+            return combiner_.execute(impl_, index(ptr), fn);
+        }
+
+        //! Submit `fn` for execution under the lock of the object without waiting
+        template<class T, class Fn>
+        auto execute_async(T const* ptr, Fn fn) -> std::future<decltype(fn())> {
+            return combiner_.execute_async(impl_, index(ptr), std::move(fn));
+        }
+#endif
+
+        //! Build stripe occupancy histogram for the range of pointers
+        template<class It>
+        StripeHistogram histogram(It begin, It end) const {
+            StripeHistogram res(impl_.size());
+            for (auto it = begin; it != end; ++it) {
+                res.counts[index(*it)]++;
+                res.objects++;
+            }
+            return res;
+        }
+
+#ifdef SYNCOPE_COLLECT_STATS
+        //! Returns lock statistics of the layer
+        LayerStats snapshot() const {
+            return impl_.snapshot();
+        }
+#endif
+    };
+
+    typedef BasicCombiningLockLayer<> CombiningLockLayer;
+
+namespace detail {
+
+    /** Epoch-based reclamation domain shared by all RCU layers.
+      * Every thread owns a record with the epoch it entered the read-side
+      * critical section at (0 - quiescent). Readers write only to their own
+      * record. Global epoch advances when all active readers have seen the
+      * current epoch, object retired at epoch `e` can be freed when the
+      * global epoch reaches `e + 2` (every reader that could see it has left).
+      */
+    class EpochDomain {
+        //! Per-thread record, padded to the cache line
+        struct Record {
+            std::atomic<uint64_t> epoch;
+            std::atomic<bool> used;
+            int nesting;
+            Record* next;
+            char pad[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>) - sizeof(int) - sizeof(Record*)];
+
+            Record() : epoch{0u}, used{true}, nesting(0), next(nullptr) {}
+        };
+
+        //! Returns record to the domain when thread exits
+        struct Holder {
+            Record* record;
+            Holder() : record(nullptr) {}
+            ~Holder() {
+                if (record) {
+                    record->epoch.store(0u, std::memory_order_release);
+                    record->used.store(false, std::memory_order_release);
+                }
+            }
+        };
+
+        std::atomic<uint64_t> global_;
+        //! Records are never freed, exited thread's record is reused
+        std::atomic<Record*> head_;
+
+        EpochDomain() : global_{1u}, head_{nullptr} {}
+
+        Record* acquire() {
+            for (Record* r = head_.load(std::memory_order_acquire); r; r = r->next) {
+                bool used = false;
+                if (!r->used.load(std::memory_order_relaxed) &&
+                    r->used.compare_exchange_strong(used, true, std::memory_order_acquire)) {
+                    return r;
+                }
+            }
+            Record* r = new Record();
+            Record* head = head_.load(std::memory_order_relaxed);
+            do {
+                r->next = head;
+            } while (!head_.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+            return r;
+        }
+
+        Record& local() {
+            static thread_local Holder holder;
+            if (holder.record == nullptr) {
+                holder.record = acquire();
+            }
+            return *holder.record;
+        }
+    public:
+        static EpochDomain& inst() {
+            static EpochDomain domain;
+            return domain;
+        }
+
+        //! Enter read-side critical section (can be nested)
+        void enter() {
+            Record& r = local();
+            if (r.nesting++ == 0) {
+                r.epoch.store(global_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                // pointers can be loaded only after the epoch is visible to writers,
+                // pairs with AsymmetricFence::heavy in retire_epoch and try_advance
+                AsymmetricFence::light();
+            }
+        }
+
+        void exit() {
+            Record& r = local();
+            if (--r.nesting == 0) {
+                r.epoch.store(0u, std::memory_order_release);
+            }
+        }
+
+        //! Epoch of the object that was unlinked before this call
+        uint64_t retire_epoch() {
+            AsymmetricFence::heavy();
+            return global_.load(std::memory_order_seq_cst);
+        }
+
+        //! Advance global epoch if all active readers have seen it, returns global epoch
+        uint64_t try_advance() {
+            AsymmetricFence::heavy();
+            uint64_t global = global_.load(std::memory_order_seq_cst);
+            for (Record* r = head_.load(std::memory_order_acquire); r; r = r->next) {
+                uint64_t e = r->epoch.load(std::memory_order_acquire);
+                if (e != 0u && e != global) {
+                    return global;
+                }
+            }
+            if (global_.compare_exchange_strong(global, global + 1, std::memory_order_acq_rel)) {
+                return global + 1;
+            }
+            return global;
+        }
+
+        //! Returns true if object retired at `epoch` can be freed
+        bool is_safe(uint64_t epoch) const {
+            return global_.load(std::memory_order_acquire) >= epoch + 2;
+        }
+
+        //! Wait until object retired at `epoch` can be freed or deadline is reached
+        template<class Clock, class Duration>
+        bool wait_until(uint64_t epoch, std::chrono::time_point<Clock, Duration> const* deadline) {
+            while (try_advance() < epoch + 2) {
+                if (deadline && Clock::now() >= *deadline) {
+                    return false;
+                }
+                std::this_thread::yield();
+            }
+            return true;
+        }
+
+        //! Returns true if the calling thread is inside the read-side critical section
+        bool in_critical_section() {
+            return local().nesting != 0;
+        }
+    };
+
+    //! Object waiting for the grace period
+    struct Retired {
+        void* ptr;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+
+    template<class T>
+    void delete_object(void* ptr) {
+        delete static_cast<T*>(ptr);
+    }
+
+}  // namespace detail
+
+    /** Read-side critical section of the RCU layer.
+      * Doesn't lock anything, objects retired while the guard is alive are
+      * not freed. Must be destroyed by the thread that created it.
+      */
+    class RcuReadGuard {
+        bool owns_lock_;
+    public:
+        RcuReadGuard() : owns_lock_(true) {
+            detail::EpochDomain::inst().enter();
+        }
+
+        ~RcuReadGuard() {
+            if (owns_lock_) {
+                detail::EpochDomain::inst().exit();
+            }
+        }
+
+        RcuReadGuard(RcuReadGuard const&) = delete;
+        RcuReadGuard& operator = (RcuReadGuard const&) = delete;
+
+        RcuReadGuard(RcuReadGuard&& other) : owns_lock_(other.owns_lock_) {
+            other.owns_lock_ = false;
+        }
+
+        bool owns_lock() const {
+            return owns_lock_;
+        }
+
+        explicit operator bool () const {
+            return owns_lock_;
+        }
+    };
+
+    /** RCU layer.
+      * For read-mostly objects published through atomic pointers. Readers enter
+      * the epoch critical section (no locks, no writes to shared memory) and load
+      * the pointer, writers of the same object are serialized by the layer's
+      * mutexes, publish new version and retire the old one. Retired objects are
+      * freed in batches after the grace period (when all readers that could see
+      * them have left the critical section).
+      *
+      * If `max_pending` is not zero, writer that retires an object when `max_pending`
+      * objects are already waiting blocks until the grace period ends, so memory
+      * stays bounded even if some reader stalls (writers stall instead).
+      */
+    template<class Hash = ShiftHash, size_t Stripes = SYNCOPE_NUM_LOCKS, size_t Align = SYNCOPE_STRIPE_ALIGN>
+    class BasicRcuLayer {
+        static_assert((Stripes & (Stripes - 1)) == 0, "Stripes must be a power of two");
+        enum {
+            //! Reclamation is attempted once per BATCH retired objects
+            BATCH = 64,
+        };
+        detail::LockLayerImpl impl_;
+        Hash hash_;
+        const size_t max_pending_;
+        std::mutex mutex_;
+        std::vector<detail::Retired> retired_;
+        size_t since_reclaim_;
+
+        static void free_all(std::vector<detail::Retired>& objects) {
+            for (auto const& r: objects) {
+                r.deleter(r.ptr);
+            }
+            objects.clear();
+        }
+
+        //! Move objects that passed the grace period out of the list (under mutex_)
+        void collect(std::vector<detail::Retired>& ready) {
+            auto& domain = detail::EpochDomain::inst();
+            // two steps are needed to free objects retired at the current epoch
+            domain.try_advance();
+            domain.try_advance();
+            auto it = std::partition(retired_.begin(), retired_.end(), [&](detail::Retired const& r) {
+                return !domain.is_safe(r.epoch);
+            });
+            ready.assign(it, retired_.end());
+            retired_.erase(it, retired_.end());
+        }
+
+        template<class Clock, class Duration>
+        bool synchronize_until(std::chrono::time_point<Clock, Duration> const* deadline) {
+            assert(!detail::EpochDomain::inst().in_critical_section());
+            auto& domain = detail::EpochDomain::inst();
+            if (!domain.wait_until(domain.retire_epoch(), deadline)) {
+                return false;
+            }
+            reclaim();
+            return true;
+        }
+    public:
+
+        /** C-tor
+          * @param name statically initialized string
+          * @param max_pending max number of retired objects waiting for the grace period (0 - unbounded)
+          * @param salt hash salt, random by default
+          */
+        BasicRcuLayer(detail::StaticString name, int level = -1, size_t max_pending = 0, size_t salt = detail::random_salt())
+            : impl_(name.str(), level, Stripes, Align)
+            , hash_(salt)
+            , max_pending_(max_pending)
+            , since_reclaim_(0)
+        {
+        }
+
+        //! Layer must outlive its readers, pending objects are freed without waiting
+        ~BasicRcuLayer() {
+            free_all(retired_);
+        }
+
+        BasicRcuLayer(BasicRcuLayer const&) = delete;
+        BasicRcuLayer& operator = (BasicRcuLayer const&) = delete;
+
+#ifdef SYNCOPE_CALL_SITES
+        //! Enter read-side critical section, `ptr` is not locked
+        template<class T>
+        RcuReadGuard synchronize_read(const char*, T const*) {
+            return RcuReadGuard();
+        }
+
+        //! Lock the object for update (writers of the same object are serialized)
+        template<class T>
+        LockGuard<T> synchronize_write(const char* loc, T const* ptr) {
+            return std::move(LockGuard<T>(ptr, impl_, loc, detail::SimpleHash<Hash>{hash_}));
+        }
+#else
+        //! Enter read-side critical section, `ptr` is not locked
+        template<class T>
+        RcuReadGuard synchronize_read(T const*) {
+            return RcuReadGuard();
+        }
+
+        //! Lock the object for update (writers of the same object are serialized)
+        template<class T>
+        LockGuard<T> synchronize_write(T const* ptr) {
+            return std::move(LockGuard<T>(ptr, impl_, detail::SimpleHash<Hash>{hash_}));
+        }
+#endif
+
+        /** Free the object after the grace period.
+          * Object must be already unlinked (unreachable for new readers).
+          */
+        void retire(void* ptr, void (*deleter)(void*)) {
+            auto& domain = detail::EpochDomain::inst();
+            detail::Retired r = { ptr, deleter, domain.retire_epoch() };
+            bool full = false;
+            std::vector<detail::Retired> ready;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                retired_.push_back(r);
+                if (++since_reclaim_ >= BATCH) {
+                    since_reclaim_ = 0;
+                    collect(ready);
+                }
+                full = max_pending_ && retired_.size() > max_pending_;
+            }
+            free_all(ready);
+            if (full) {
+                synchronize();
+            }
+        }
+
+        template<class T>
+        void retire(T* ptr) {
+            retire(const_cast<void*>(static_cast<const void*>(ptr)), &detail::delete_object<T>);
+        }
+
+        /** Publish new version of the object and retire the old one.
+          * Should be called under the write lock of the slot.
+          */
+        template<class T>
+        void replace(std::atomic<T*>& slot, T* value) {
+            T* old = slot.exchange(value, std::memory_order_acq_rel);
+            if (old) {
+                retire(old);
+            }
+        }
+
+        //! Free retired objects that passed the grace period
+        void reclaim() {
+            std::vector<detail::Retired> ready;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                since_reclaim_ = 0;
+                collect(ready);
+            }
+            free_all(ready);
+        }
+
+        /** Wait for the grace period and free all objects retired before the call.
+          * Must not be called inside the read-side critical section (it would wait forever).
+          */
+        void synchronize() {
+            synchronize_until(static_cast<std::chrono::steady_clock::time_point const*>(nullptr));
+        }
+
+        //! Wait for the grace period until deadline, returns false on timeout
+        template<class Clock, class Duration>
+        bool try_synchronize(std::chrono::time_point<Clock, Duration> const& deadline) {
+            return synchronize_until(&deadline);
+        }
+
+        template<class Rep, class Period>
+        bool try_synchronize(std::chrono::duration<Rep, Period> const& timeout) {
+            return try_synchronize(std::chrono::steady_clock::now() + timeout);
+        }
+
+        //! Returns number of retired objects waiting for the grace period
+        size_t pending() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return retired_.size();
+        }
+
+#ifdef SYNCOPE_COLLECT_STATS
+        //! Returns lock statistics of the layer (writers only)
+        LayerStats snapshot() const {
+            return impl_.snapshot();
+        }
+#endif
+    };
+
+    typedef BasicRcuLayer<> RcuLayer;
+
+#ifdef SYNCOPE_HAVE_PROCESS_SHARED
+namespace detail {
+
+    /** Table of process-shared mutexes placed in the shared memory region.
+      * Memory must be zero-filled before the first process attaches (fresh
+      * anonymous shared mapping or the file created by shm_open + ftruncate).
+      * The first process initializes the header and the mutexes, others wait
+      * for it and check that the layout matches. If the initializing process
+      * dies halfway, a waiting process takes over (all processes must share the
+      * pid namespace). Mutexes are robust, if the holder dies the next locker
+      * gets the mutex and is told about it.
+      */
+    class SharedLockTable {
+        enum : uint64_t {
+            MAGIC = 0x53594e434f504531ull,  // "SYNCOPE1"
+        };
+        enum : uint32_t {
+            EMPTY,
+            INITIALIZING,
+            READY,
+        };
+        struct Header {
+            uint64_t magic;
+            uint64_t stripes;
+            uint64_t stride;
+            uint64_t salt;
+            //! State in the low 32 bits, pid of the initializing process in the high 32 bits
+            std::atomic<uint64_t> state;
+        };
+        Header* header_;
+        char* mutexes_;
+        const size_t size_;
+        const size_t stride_;
+
+        static size_t stride(size_t align) {
+            if (align <= alignof(pthread_mutex_t)) {
+                return sizeof(pthread_mutex_t);
+            }
+            return (sizeof(pthread_mutex_t) + align - 1)/align*align;
+        }
+
+        static size_t header_size(size_t align) {
+            size_t a = std::max(align, alignof(pthread_mutex_t));
+            return (sizeof(Header) + a - 1)/a*a;
+        }
+
+        pthread_mutex_t* mutex(size_t ix) const {
+            return reinterpret_cast<pthread_mutex_t*>(mutexes_ + ix*stride_);
+        }
+
+        static void check(int rc) {
+            if (rc != 0) {
+                throw std::system_error(rc, std::system_category(), "syncope: process-shared mutex");
+            }
+        }
+
+        void init(size_t salt) {
+            pthread_mutexattr_t attr;
+            check(pthread_mutexattr_init(&attr));
+            check(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED));
+            check(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST));
+            for (size_t i = 0; i < size_; i++) {
+                check(pthread_mutex_init(mutex(i), &attr));
+            }
+            pthread_mutexattr_destroy(&attr);
+            header_->magic = MAGIC;
+            header_->stripes = size_;
+            header_->stride = stride_;
+            header_->salt = salt;
+        }
+
+        static uint64_t initializing() {
+            return static_cast<uint64_t>(getpid()) << 32 | INITIALIZING;
+        }
+
+        //! Returns true if the process that started initialization is gone
+        static bool initializer_died(uint64_t state) {
+            pid_t pid = static_cast<pid_t>(state >> 32);
+            return kill(pid, 0) != 0 && errno == ESRCH;
+        }
+
+        /** Handle the result of the lock call, returns true if the mutex is acquired.
+          * `died` is set if the previous owner died while holding the mutex.
+          * Mutex is not held if an exception is thrown.
+          */
+        bool acquired(int rc, size_t ix, bool* died) {
+            if (rc == EOWNERDEAD) {
+                // protected objects could be left in inconsistent state, the guard reports this to the caller
+                rc = pthread_mutex_consistent(mutex(ix));
+                if (rc != 0) {
+                    pthread_mutex_unlock(mutex(ix));
+                    check(rc);
+                }
+                *died = true;
+                return true;
+            }
+            if (rc == EBUSY || rc == ETIMEDOUT) {
+                return false;
+            }
+            check(rc);
+            return true;
+        }
+    public:
+        //! Returns size of the table in bytes
+        static size_t table_size(size_t size, size_t align) {
+            return header_size(align) + size*stride(align);
+        }
+
+        /** C-tor
+          * @param table memory of the table (table_size bytes) in the shared region, aligned by `align`
+          * @param size number of mutexes (power of two)
+          * @param salt hash salt, used only by the process that initializes the table
+          */
+        SharedLockTable(void* table, size_t size, size_t align, size_t salt)
+            : header_(static_cast<Header*>(table))
+            , mutexes_(static_cast<char*>(table) + header_size(align))
+            , size_(size)
+            , stride_(stride(align))
+        {
+            assert(size && (size & (size - 1)) == 0);
+            assert(reinterpret_cast<size_t>(table) % std::max(align, alignof(pthread_mutex_t)) == 0);
+            uint64_t state = header_->state.load(std::memory_order_acquire);
+            while (state != READY) {
+                bool owner = false;
+                if (state == EMPTY) {
+                    owner = header_->state.compare_exchange_strong(state, initializing(), std::memory_order_acquire);
+                } else if (initializer_died(state)) {
+                    // mutexes are not used by anybody before the table is ready, initialize them again
+                    owner = header_->state.compare_exchange_strong(state, initializing(), std::memory_order_acquire);
+                } else {
+                    std::this_thread::yield();
+                    state = header_->state.load(std::memory_order_acquire);
+                }
+                if (owner) {
+                    init(salt);
+                    header_->state.store(READY, std::memory_order_release);
+                    break;
+                }
+            }
+            if (header_->magic != MAGIC || header_->stripes != size_ || header_->stride != stride_) {
+                throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+                                        "syncope: lock table layout mismatch");
+            }
+        }
+
+        SharedLockTable(SharedLockTable const&) = delete;
+        SharedLockTable& operator = (SharedLockTable const&) = delete;
+
+        //! Hash salt chosen by the process that initialized the table
+        size_t salt() const {
+            return static_cast<size_t>(header_->salt);
+        }
 
-        template<int M, int H>
-        struct fill_hashes<M, M, H>{
-            template<typename Hash>
-            void operator() (std::array<size_t, H>& hashes, std::tuple<T const*...> const& items, Hash const& hash) {}
-        };
+        size_t size() const {
+            return size_;
+        }
 
-        void lock() {
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-            impl_.detector_lock(loc_);
-#endif
-            for (size_t i = 0; i < hashes_count_; i++) {
-                impl_.lock(hashes_[i]);
-            }
-            owns_lock_ = true;
+        void lock(size_t ix, bool* died) {
+            acquired(pthread_mutex_lock(mutex(ix)), ix, died);
         }
 
-        void unlock() {
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-            impl_.detector_unlock();
+        bool try_lock(size_t ix, bool* died) {
+            return acquired(pthread_mutex_trylock(mutex(ix)), ix, died);
+        }
+
+        template<class Clock, class Duration>
+        bool try_lock_until(size_t ix, std::chrono::time_point<Clock, Duration> const& deadline, bool* died) {
+#ifdef SYNCOPE_HAVE_CLOCKLOCK
+            // steady_clock is CLOCK_MONOTONIC, wall clock adjustments don't affect the deadline
+            typedef std::chrono::steady_clock Steady;
+            clockid_t clock = CLOCK_MONOTONIC;
+#else
+            // pthread_mutex_timedlock uses CLOCK_REALTIME
+            typedef std::chrono::system_clock Steady;
+#endif
+            auto abs = Steady::now() + std::chrono::duration_cast<Steady::duration>(deadline - Clock::now());
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(abs.time_since_epoch()).count();
+            timespec ts;
+            ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+            ts.tv_nsec = static_cast<long>(ns % 1000000000);
+#ifdef SYNCOPE_HAVE_CLOCKLOCK
+            return acquired(pthread_mutex_clocklock(mutex(ix), clock, &ts), ix, died);
+#else
+            return acquired(pthread_mutex_timedlock(mutex(ix), &ts), ix, died);
 #endif
-            for (size_t i = hashes_count_ - 1; i != size_t(0u) - 1; i--) {
-                impl_.unlock(hashes_[i]);
-            }
-            owns_lock_ = false;
         }
 
-    public:
+        void unlock(size_t ix) {
+            pthread_mutex_unlock(mutex(ix));
+        }
+    };
+}  // namespace detail
 
-        template<typename Hash>
-        LockGuardMany( detail::LockLayerImpl& impl
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-                     , const char* loc
-#endif
-                     , Hash const& hash
-                     , T const*... others)
-            : impl_(impl)
+    /** Lock guard of the process-shared lock layer.
+      * Holds up to N mutexes sorted in locking order. If some holder process
+      * (or thread) died while holding one of the mutexes, `owner_died` returns true
+      * and the caller should repair or validate the objects.
+      */
+    template<size_t N>
+    class ProcessSharedLockGuard {
+        detail::SharedLockTable* table_;
+        std::array<size_t, N> ixs_;
+        size_t count_;
+        bool owns_lock_;
+        bool owner_died_;
+
+        //! Unlock first `count` mutexes in reverse order
+        void release(size_t count) {
+            for (size_t i = count; i --> 0;) {
+                table_->unlock(ixs_[i]);
+            }
+        }
+    public:
+        //! Creates guard that doesn't own the lock
+        ProcessSharedLockGuard(detail::SharedLockTable& table, std::array<size_t, N> const& ixs)
+            : table_(&table)
+            , ixs_(ixs)
             , owns_lock_(false)
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-            , loc_(loc)
-#endif
+            , owner_died_(false)
         {
-            auto all = std::tie(others...);
-            fill_hashes<0, sizeof...(others), H> fill_all;
-            fill_all(hashes_, all, hash);
-            std::sort(hashes_.begin(), hashes_.end());
-            auto it = std::unique(hashes_.begin(), hashes_.end());
-            hashes_count_ = std::distance(hashes_.begin(), it);
-            lock();
+            std::sort(ixs_.begin(), ixs_.end());
+            count_ = static_cast<size_t>(std::distance(ixs_.begin(), std::unique(ixs_.begin(), ixs_.end())));
         }
 
-        ~LockGuardMany() {
+        ~ProcessSharedLockGuard() {
             if (owns_lock_) {
                 unlock();
             }
         }
 
-        LockGuardMany(LockGuardMany const&) = delete;
-        LockGuardMany& operator = (LockGuardMany const&) = delete;
+        ProcessSharedLockGuard(ProcessSharedLockGuard const&) = delete;
+        ProcessSharedLockGuard& operator = (ProcessSharedLockGuard const&) = delete;
 
-        LockGuardMany(LockGuardMany&& other)
-            : impl_(other.impl_)
-            , hashes_count_(other.hashes_count_)
+        ProcessSharedLockGuard(ProcessSharedLockGuard&& other)
+            : table_(other.table_)
+            , ixs_(other.ixs_)
+            , count_(other.count_)
             , owns_lock_(other.owns_lock_)
+            , owner_died_(other.owner_died_)
         {
-            std::swap(hashes_, other.hashes_);
             other.owns_lock_ = false;
         }
 
-        LockGuardMany& operator = (LockGuardMany&& other) {
-            assert(&other.impl_ == &impl_);
-            std::swap(hashes_, other.hashes_);
-            hashes_count_ = other.hashes_count_;
+        ProcessSharedLockGuard& operator = (ProcessSharedLockGuard&& other) {
+            if (owns_lock_) {
+                unlock();
+            }
+            table_ = other.table_;
+            ixs_ = other.ixs_;
+            count_ = other.count_;
             owns_lock_ = other.owns_lock_;
+            owner_died_ = other.owner_died_;
             other.owns_lock_ = false;
+            return *this;
         }
-    };
 
-    namespace detail {
+        void lock() {
+            assert(!owns_lock_);
+            for (size_t i = 0; i < count_; i++) {
+                try {
+                    table_->lock(ixs_[i], &owner_died_);
+                } catch (...) {
+                    release(i);
+                    throw;
+                }
+            }
+            owns_lock_ = true;
+        }
 
-    class StaticString {
-        const char* str_;
-    public:
-        StaticString(const char* s) : str_(s) {
-            // TODO: assert(string is static)
+        void unlock() {
+            assert(owns_lock_);
+            release(count_);
+            owns_lock_ = false;
         }
 
-        const char* str() const { return str_; }
-    };
+        //! Try to acquire all mutexes without blocking
+        bool try_lock() {
+            assert(!owns_lock_);
+            for (size_t i = 0; i < count_; i++) {
+                bool res;
+                try {
+                    res = table_->try_lock(ixs_[i], &owner_died_);
+                } catch (...) {
+                    release(i);
+                    throw;
+                }
+                if (!res) {
+                    release(i);
+                    return false;
+                }
+            }
+            owns_lock_ = true;
+            return true;
+        }
 
-    //! Simple hash - simply returns it's argument
-    struct SimpleHash {
-        size_t operator() (size_t value) const {
-            return value >> CACHE_LINE_BITS;
+        //! Try to acquire all mutexes, block until deadline
+        template<class Clock, class Duration>
+        bool try_lock_until(std::chrono::time_point<Clock, Duration> const& deadline) {
+            assert(!owns_lock_);
+            for (size_t i = 0; i < count_; i++) {
+                bool res;
+                try {
+                    res = table_->try_lock_until(ixs_[i], deadline, &owner_died_);
+                } catch (...) {
+                    release(i);
+                    throw;
+                }
+                if (!res) {
+                    release(i);
+                    return false;
+                }
+            }
+            owns_lock_ = true;
+            return true;
         }
-    };
 
-    //! Simple hash
-    struct SimpleHash2 {
-        size_t operator() (size_t value, int bias) const {
-            return value >> CACHE_LINE_BITS;
+        //! Returns true if the previous holder of some mutex died while holding it
+        bool owner_died() const {
+            return owner_died_;
         }
-    };
 
-    template<int P>
-    struct BiasedHash {
-        static_assert((P & (P - 1)) == 0, "P must be a power of two");
-        size_t operator() (size_t value) const {
-            std::hash<std::thread::id> hash;
-            auto id = std::this_thread::get_id();
-            size_t bias = hash(id);
-            return (value >> CACHE_LINE_BITS) + (bias & (P - 1));
+        bool owns_lock() const {
+            return owns_lock_;
         }
-    };
 
-    template<int P>
-    struct BiasedHash2 {
-        static_assert((P & (P - 1)) == 0, "P must be a power of two");
-        size_t operator() (size_t value, int bias) const {
-            return (value >> CACHE_LINE_BITS) + (bias & (P - 1));
+        explicit operator bool () const {
+            return owns_lock_;
         }
     };
 
-    }
-
-    /** Lock hierarchy layer.
+    /** Process-shared lock layer.
+      * Mutexes live in the lock table placed in the memory region shared by
+      * several processes (mmap or shm_open), every process creates its own layer
+      * object on top of the same table. Objects are hashed by their offset from
+      * the start of the region, so the object maps to the same mutex in every
+      * process regardless of the address the region is mapped at.
+      * Available on Linux (robust process-shared pthread mutexes).
+      * @param Hash hash policy (ShiftHash, FibonacciHash or MurmurHash), salt is stored in the table
+      * @param Stripes number of mutexes (power of two)
+      * @param Align alignment of every mutex in bytes
       */
-    class SymmetricLockLayer {
-        detail::LockLayerImpl impl_;
+    template<class Hash = ShiftHash, size_t Stripes = SYNCOPE_NUM_LOCKS, size_t Align = 64>
+    class BasicProcessSharedLockLayer {
+        static_assert((Stripes & (Stripes - 1)) == 0, "Stripes must be a power of two");
+        const char* name_;
+        detail::SharedLockTable table_;
+        const char* base_;
+        const size_t size_;
+        Hash hash_;
+
+        template<class T>
+        size_t index(T const* ptr) const {
+            size_t addr = reinterpret_cast<size_t>(ptr);
+            size_t base = reinterpret_cast<size_t>(base_);
+            assert(addr >= base && addr - base < size_ && "object is outside of the shared region");
+            return hash_(addr - base) & (Stripes - 1);
+        }
     public:
+        //! Returns size of the lock table in bytes (should be reserved in the shared region)
+        static size_t table_size() {
+            return detail::SharedLockTable::table_size(Stripes, Align);
+        }
 
         /** C-tor
           * @param name statically initialized string
+          * @param table lock table in the shared region (table_size() bytes, zero-filled before first use)
+          * @param base start of the shared region
+          * @param size size of the shared region in bytes
+          * @param salt hash salt, used only by the process that initializes the table
           */
-        SymmetricLockLayer(detail::StaticString name, int level = -1) : impl_(name.str(), level) {}
-
+        BasicProcessSharedLockLayer(detail::StaticString name, void* table, void const* base, size_t size, size_t salt = detail::random_salt())
+            : name_(name.str())
+            , table_(table, Stripes, Align, salt)
+            , base_(static_cast<const char*>(base))
+            , size_(size)
+            , hash_(table_.salt())
+        {
+        }
 
-#ifdef SYNCOPE_DETECT_DEADLOCKS
+#ifdef SYNCOPE_CALL_SITES
         template<class T>
-        LockGuard<T> synchronize(
-                const char* loc,
-                T const* ptr) {
-            return std::move(LockGuard<T>(ptr, impl_, loc, detail::SimpleHash()));
+        ProcessSharedLockGuard<1> synchronize(const char*, T const* ptr) {
+            return synchronize(ptr);
         }
-#else
+
+        template<typename... T>
+        ProcessSharedLockGuard<sizeof...(T)> synchronize_all(const char*, T const*... args) {
+            return synchronize_all(args...);
+        }
+
+        //! Try to lock object without blocking (or until deadline, or for timeout)
         template<class T>
-        LockGuard<T> synchronize(T const* ptr) {
-            return std::move(LockGuard<T>(ptr, impl_, detail::SimpleHash()));
+        ProcessSharedLockGuard<1> try_synchronize(const char*, T const* ptr) {
+            return try_synchronize(ptr);
+        }
+
+        template<class Clock, class Duration, class T>
+        ProcessSharedLockGuard<1> try_synchronize(const char*, std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            return try_synchronize(deadline, ptr);
+        }
+
+        template<class Rep, class Period, class T>
+        ProcessSharedLockGuard<1> try_synchronize(const char*, std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize(timeout, ptr);
         }
 #endif
 
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-        template<typename... T>
-        LockGuardMany<1, T...> synchronize_all(
-                const char* loc,
-                T const*... args) {
-            return std::move(LockGuardMany<1, T...>(impl_, loc, detail::SimpleHash2(), args...));
+        template<class T>
+        ProcessSharedLockGuard<1> synchronize(T const* ptr) {
+            ProcessSharedLockGuard<1> guard(table_, {{ index(ptr) }});
+            guard.lock();
+            return guard;
         }
-#else
+
         template<typename... T>
-        LockGuardMany<1, T...> synchronize_all(T const*... args) {
-            return std::move(LockGuardMany<1, T...>(impl_, detail::SimpleHash2(), args...));
+        ProcessSharedLockGuard<sizeof...(T)> synchronize_all(T const*... args) {
+            ProcessSharedLockGuard<sizeof...(T)> guard(table_, {{ index(args)... }});
+            guard.lock();
+            return guard;
+        }
+
+        //! Try to lock object without blocking (or until deadline, or for timeout)
+        template<class T>
+        ProcessSharedLockGuard<1> try_synchronize(T const* ptr) {
+            ProcessSharedLockGuard<1> guard(table_, {{ index(ptr) }});
+            guard.try_lock();
+            return guard;
+        }
+
+        template<class Clock, class Duration, class T>
+        ProcessSharedLockGuard<1> try_synchronize(std::chrono::time_point<Clock, Duration> const& deadline, T const* ptr) {
+            ProcessSharedLockGuard<1> guard(table_, {{ index(ptr) }});
+            guard.try_lock_until(deadline);
+            return guard;
+        }
+
+        template<class Rep, class Period, class T>
+        ProcessSharedLockGuard<1> try_synchronize(std::chrono::duration<Rep, Period> const& timeout, T const* ptr) {
+            return try_synchronize(std::chrono::steady_clock::now() + timeout, ptr);
+        }
+
+        const char* name() const {
+            return name_;
         }
-#endif
     };
 
-    /** Asymmetric lock hierarchy layer.
+    typedef BasicProcessSharedLockLayer<> ProcessSharedLockLayer;
+#endif
+
+    //! Handler of the lock hierarchy violation (level of the held layer and level of the layer being locked)
+    typedef void (*HierarchyHandler)(int held, int acquired);
+
+namespace detail {
+
+    inline std::atomic<HierarchyHandler>& hierarchy_handler() {
+        static std::atomic<HierarchyHandler> handler{nullptr};
+        return handler;
+    }
+
+    /** Levels of the leveled layers held by the current thread.
+      * Guards can be released in any order (moved, returned from functions),
+      * so every level has its own counter and the watermark (highest held level)
+      * is recomputed when the last guard of the highest level is released.
       */
-    class AsymmetricLockLayer {
-        detail::LockLayerImpl impl_;
-        enum {
-            P = SYNCOPE_READ_SIDE_PARALLELISM  // Parallelism factor for readers and writers
+    class HeldLevels {
+        struct Entry {
+            int level;
+            int count;
         };
+        std::vector<Entry> entries_;
+        int watermark_;
     public:
+        HeldLevels()
+            : watermark_(INT_MIN)
+        {
+        }
 
-        /** C-tor
-          * @param name statically initialized string
-          */
-        AsymmetricLockLayer(detail::StaticString name, int level = -1) : impl_(name.str(), level) {}
+        //! Highest held level (INT_MIN if nothing is held)
+        int watermark() const {
+            return watermark_;
+        }
 
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-        template<class T>
-        LockGuard<T> synchronize_read(
-                const char* loc,
-                T const* ptr) {
-            return std::move(LockGuard<T>(ptr, impl_, loc, detail::BiasedHash<P>()));
+        void add(int level) {
+            for (auto& e: entries_) {
+                if (e.level == level) {
+                    e.count++;
+                    return;
+                }
+            }
+            entries_.push_back(Entry{level, 1});
+            watermark_ = std::max(watermark_, level);
         }
-#else
-        template<class T>
-        LockGuard<T> synchronize_read(T const* ptr) {
-            return std::move(LockGuard<T>(ptr, impl_, detail::BiasedHash<P>()));
+
+        void remove(int level) {
+            for (size_t i = 0; i < entries_.size(); i++) {
+                if (entries_[i].level == level) {
+                    if (--entries_[i].count == 0) {
+                        entries_[i] = entries_.back();
+                        entries_.pop_back();
+                        if (level == watermark_) {
+                            watermark_ = INT_MIN;
+                            for (auto const& e: entries_) {
+                                watermark_ = std::max(watermark_, e.level);
+                            }
+                        }
+                    }
+                    return;
+                }
+            }
+            assert(false && "level is not held");
         }
-#endif
+    };
 
-#ifdef SYNCOPE_DETECT_DEADLOCKS
-        template<typename T>
-        LockGuardMany<P, T> synchronize_write(
-                const char* loc,
-                T const* arg) {
-            return std::move(LockGuardMany<P, T>(impl_, loc, detail::BiasedHash2<P>(), arg));
+    inline HeldLevels& held_levels() {
+        static thread_local HeldLevels levels;
+        return levels;
+    }
+
+    inline void on_hierarchy_violation(int held, int acquired) {
+        auto handler = hierarchy_handler().load(std::memory_order_relaxed);
+        if (handler) {
+            handler(held, acquired);
+        } else {
+            std::fprintf(stderr, "Lock hierarchy violation - level %d acquired while holding level %d\n", acquired, held);
+            std::terminate();
         }
-#else
-        template<typename T>
-        LockGuardMany<P, T> synchronize_write(T const* arg) {
-            return std::move(LockGuardMany<P, T>(impl_, detail::BiasedHash2<P>(), arg));
+    }
+}  // namespace detail
+
+    //! Install lock hierarchy violation handler (by default message is printed and std::terminate is called)
+    inline void set_hierarchy_handler(HierarchyHandler handler) {
+        detail::hierarchy_handler().store(handler, std::memory_order_relaxed);
+    }
+
+    //! Compile-time proof that the lock of the given level is held
+    template<int Level>
+    struct LevelToken {
+    };
+
+    /** Guard returned by the leveled lock layer.
+      * Wraps guard of the underlying layer, its level is registered in the
+      * thread's held levels while the guard owns the lock.
+      */
+    template<int Level, class Guard>
+    class LevelGuard : public Guard {
+        bool raised_;
+    public:
+        LevelGuard(Guard&& guard)
+            : Guard(std::move(guard))
+            , raised_(Guard::owns_lock())
+        {
+            if (raised_) {
+                detail::held_levels().add(Level);
+            }
         }
-#endif
+
+        LevelGuard(LevelGuard&& other)
+            : Guard(std::move(other))
+            , raised_(other.raised_)
+        {
+            other.raised_ = false;
+        }
+
+        LevelGuard& operator = (LevelGuard&& other) {
+            if (raised_) {
+                detail::held_levels().remove(Level);
+            }
+            Guard::operator = (std::move(other));
+            raised_ = other.raised_;
+            other.raised_ = false;
+            return *this;
+        }
+
+        ~LevelGuard() {
+            if (raised_) {
+                detail::held_levels().remove(Level);
+            }
+        }
+
+        //! Token that can be passed to the nested lock of the higher level layer
+        LevelToken<Level> token() const {
+            return LevelToken<Level>();
+        }
+    };
+
+    /** Lock layer with the level encoded in its type.
+      * Layers must be locked in increasing order of levels. Order is checked
+      * at compile time if the token of the outer lock is passed to the nested
+      * lock (see SYNCOPE_LOCK_NESTED) and at run time using thread-local
+      * watermark of the highest held level otherwise.
+      * Underlying layer is inherited privately, so a locking method that
+      * isn't wrapped below can't bypass the level check.
+      * @param Level level of the layer
+      * @param Layer underlying lock layer (symmetric or asymmetric)
+      */
+    template<int Level, class Layer = SymmetricLockLayer>
+    class LeveledLockLayer : private Layer {
+
+        //! Check the thread's watermark
+        static void enter() {
+            int held = detail::held_levels().watermark();
+            if (held >= Level) {
+                detail::on_hierarchy_violation(held, Level);
+            }
+        }
+
+        template<class Guard>
+        static LevelGuard<Level, Guard> wrap(Guard&& guard) {
+            return LevelGuard<Level, Guard>(std::move(guard));
+        }
+
+    public:
+        enum {
+            level = Level
+        };
+
+        LeveledLockLayer(detail::StaticString name, size_t salt = detail::random_salt())
+            : Layer(name, Level, salt)
+        {
+        }
+
+        // Non-locking members of the underlying layer. Layers differ in their
+        // interface, so every member is forwarded only if the layer has it.
+#define SYNCOPE_LEVELED_FORWARD(method)                                                         \
+        template<class L = Layer, class... Args>                                                \
+        auto method(Args&&... args) -> decltype(std::declval<L&>().method(std::forward<Args>(args)...)) { \
+            return L::method(std::forward<Args>(args)...);                                      \
+        }                                                                                       \
+                                                                                                \
+        template<class L = Layer, class... Args>                                                \
+        auto method(Args&&... args) const -> decltype(std::declval<L const&>().method(std::forward<Args>(args)...)) { \
+            return L::method(std::forward<Args>(args)...);                                      \
+        }
+
+        SYNCOPE_LEVELED_FORWARD(wait)
+        SYNCOPE_LEVELED_FORWARD(wait_until)
+        SYNCOPE_LEVELED_FORWARD(wait_for)
+        SYNCOPE_LEVELED_FORWARD(notify)
+        SYNCOPE_LEVELED_FORWARD(notify_one)
+        SYNCOPE_LEVELED_FORWARD(plan_all)
+        SYNCOPE_LEVELED_FORWARD(plan_write)
+        SYNCOPE_LEVELED_FORWARD(read_begin)
+        SYNCOPE_LEVELED_FORWARD(read_validate)
+        SYNCOPE_LEVELED_FORWARD(read)
+        SYNCOPE_LEVELED_FORWARD(biased)
+        SYNCOPE_LEVELED_FORWARD(histogram)
+        SYNCOPE_LEVELED_FORWARD(snapshot)
+
+#undef SYNCOPE_LEVELED_FORWARD
+
+#define SYNCOPE_LEVELED_METHOD(method)                                                          \
+        template<class L = Layer, class... Args>                                                \
+        auto method(Args&&... args)                                                             \
+            -> LevelGuard<Level, decltype(std::declval<L&>().method(std::forward<Args>(args)...))> \
+        {                                                                                       \
+            enter();                                                                            \
+            return wrap(L::method(std::forward<Args>(args)...));                                \
+        }                                                                                       \
+                                                                                                \
+        template<int Outer, class L = Layer, class... Args>                                     \
+        auto method(LevelToken<Outer>, Args&&... args)                                          \
+            -> LevelGuard<Level, decltype(std::declval<L&>().method(std::forward<Args>(args)...))> \
+        {                                                                                       \
+            static_assert(Outer < Level, "lock hierarchy violation: layer of lower or equal level is locked under the higher level lock"); \
+            enter();                                                                            \
+            return wrap(L::method(std::forward<Args>(args)...));                                \
+        }
+
+        SYNCOPE_LEVELED_METHOD(synchronize)
+        SYNCOPE_LEVELED_METHOD(synchronize_all)
+        SYNCOPE_LEVELED_METHOD(synchronize_range)
+        SYNCOPE_LEVELED_METHOD(try_synchronize)
+        SYNCOPE_LEVELED_METHOD(try_synchronize_all)
+        SYNCOPE_LEVELED_METHOD(synchronize_read)
+        SYNCOPE_LEVELED_METHOD(synchronize_write)
+        SYNCOPE_LEVELED_METHOD(synchronize_read_all)
+        SYNCOPE_LEVELED_METHOD(synchronize_write_all)
+        SYNCOPE_LEVELED_METHOD(synchronize_read_range)
+        SYNCOPE_LEVELED_METHOD(synchronize_write_range)
+        SYNCOPE_LEVELED_METHOD(synchronize_upgrade)
+        SYNCOPE_LEVELED_METHOD(try_synchronize_read)
+        SYNCOPE_LEVELED_METHOD(try_synchronize_write)
+        SYNCOPE_LEVELED_METHOD(synchronize_layer)
+        SYNCOPE_LEVELED_METHOD(synchronize_layer_shared)
+        SYNCOPE_LEVELED_METHOD(try_synchronize_layer)
+
+#undef SYNCOPE_LEVELED_METHOD
+
+        // Held levels are thread-local and the coroutine can be resumed by
+        // another thread, so asynchronous locking can't be checked
+        template<class... Args> void lock_async(Args&&...) = delete;
+        template<class... Args> void lock_all_async(Args&&...) = delete;
+        template<class... Args> void lock_read_async(Args&&...) = delete;
+        template<class... Args> void lock_write_async(Args&&...) = delete;
     };
 }  // namespace syncope
 
@@ -503,7 +7204,7 @@ namespace detail {
 #define SYNCOPE_STRINGIFY_DETAIL(x) #x
 #define SYNCOPE_STRINGIFY(x) SYNCOPE_STRINGIFY_DETAIL(x)
 
-#ifdef SYNCOPE_DETECT_DEADLOCKS
+#ifdef SYNCOPE_CALL_SITES
 
 #define _SYNCOPE_LOCK_IMPL(layer, msg, ptr) auto __scope_lock_guard_##layer = layer.synchronize(msg, ptr)
 #define SYNCOPE_LOCK(layer, ptr) _SYNCOPE_LOCK_IMPL(layer, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr);
@@ -517,6 +7218,48 @@ namespace detail {
 #define _SYNCOPE_LOCK_WRITE_IMPL(layer, msg, ptr) auto __scope_lock_guard_##layer = layer.synchronize_write(msg, ptr)
 #define SYNCOPE_LOCK_WRITE(layer, ptr) _SYNCOPE_LOCK_WRITE_IMPL(layer, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr);
 
+#define _SYNCOPE_LOCK_READ_ALL_IMPL(layer, msg, ...) auto __scope_lock_guard_##layer = layer.synchronize_read_all(msg, __VA_ARGS__)
+#define SYNCOPE_LOCK_READ_ALL(layer, ...) _SYNCOPE_LOCK_READ_ALL_IMPL(layer, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), __VA_ARGS__);
+
+#define _SYNCOPE_LOCK_WRITE_ALL_IMPL(layer, msg, ...) auto __scope_lock_guard_##layer = layer.synchronize_write_all(msg, __VA_ARGS__)
+#define SYNCOPE_LOCK_WRITE_ALL(layer, ...) _SYNCOPE_LOCK_WRITE_ALL_IMPL(layer, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), __VA_ARGS__);
+
+#define _SYNCOPE_LOCK_RANGE_IMPL(layer, method, msg, begin, end) auto __scope_lock_guard_##layer = layer.method(msg, begin, end)
+#define SYNCOPE_LOCK_RANGE(layer, begin, end) _SYNCOPE_LOCK_RANGE_IMPL(layer, synchronize_range, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), begin, end);
+#define SYNCOPE_LOCK_READ_RANGE(layer, begin, end) _SYNCOPE_LOCK_RANGE_IMPL(layer, synchronize_read_range, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), begin, end);
+#define SYNCOPE_LOCK_WRITE_RANGE(layer, begin, end) _SYNCOPE_LOCK_RANGE_IMPL(layer, synchronize_write_range, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), begin, end);
+
+#define _SYNCOPE_LOCK_LAYER_IMPL(layer, method, msg) auto __scope_lock_guard_##layer = layer.method(msg)
+#define SYNCOPE_LOCK_LAYER(layer) _SYNCOPE_LOCK_LAYER_IMPL(layer, synchronize_layer, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__));
+#define SYNCOPE_LOCK_LAYER_SHARED(layer) _SYNCOPE_LOCK_LAYER_IMPL(layer, synchronize_layer_shared, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__));
+
+#define _SYNCOPE_LOCK_UPGRADE_IMPL(layer, msg, ptr) auto __scope_lock_guard_##layer = layer.synchronize_upgrade(msg, ptr)
+#define SYNCOPE_LOCK_UPGRADE(layer, ptr) _SYNCOPE_LOCK_UPGRADE_IMPL(layer, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr);
+
+#define _SYNCOPE_LOCK_NESTED_IMPL(outer, layer, method, msg, ptr) auto __scope_lock_guard_##layer = layer.method(__scope_lock_guard_##outer.token(), msg, ptr)
+#define SYNCOPE_LOCK_NESTED(outer, layer, ptr) _SYNCOPE_LOCK_NESTED_IMPL(outer, layer, synchronize, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr);
+#define SYNCOPE_LOCK_READ_NESTED(outer, layer, ptr) _SYNCOPE_LOCK_NESTED_IMPL(outer, layer, synchronize_read, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr);
+#define SYNCOPE_LOCK_WRITE_NESTED(outer, layer, ptr) _SYNCOPE_LOCK_NESTED_IMPL(outer, layer, synchronize_write, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr);
+
+#define SYNCOPE_EXECUTE(layer, ptr, ...) layer.execute(__FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr, __VA_ARGS__)
+#define SYNCOPE_EXECUTE_ASYNC(layer, ptr, ...) layer.execute_async(__FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr, __VA_ARGS__)
+
+#define _SYNCOPE_LOCK_ASYNC_IMPL(layer, method, msg, ...) auto __scope_lock_guard_##layer = co_await layer.method(msg, __VA_ARGS__)
+#define SYNCOPE_LOCK_ASYNC(layer, executor, ptr) _SYNCOPE_LOCK_ASYNC_IMPL(layer, lock_async, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), executor, ptr);
+#define SYNCOPE_LOCK_ALL_ASYNC(layer, executor, ...) _SYNCOPE_LOCK_ASYNC_IMPL(layer, lock_all_async, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), executor, __VA_ARGS__);
+#define SYNCOPE_LOCK_READ_ASYNC(layer, executor, ptr) _SYNCOPE_LOCK_ASYNC_IMPL(layer, lock_read_async, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), executor, ptr);
+#define SYNCOPE_LOCK_WRITE_ASYNC(layer, executor, ptr) _SYNCOPE_LOCK_ASYNC_IMPL(layer, lock_write_async, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), executor, ptr);
+
+#define _SYNCOPE_TRY_LOCK_IMPL(layer, method, msg, ...) auto __scope_lock_guard_##layer = layer.method(msg, __VA_ARGS__)
+#define SYNCOPE_TRY_LOCK(layer, ptr) _SYNCOPE_TRY_LOCK_IMPL(layer, try_synchronize, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr)
+#define SYNCOPE_TRY_LOCK_FOR(layer, timeout, ptr) _SYNCOPE_TRY_LOCK_IMPL(layer, try_synchronize, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), timeout, ptr)
+#define SYNCOPE_TRY_LOCK_ALL(layer, ...) _SYNCOPE_TRY_LOCK_IMPL(layer, try_synchronize_all, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), __VA_ARGS__)
+#define SYNCOPE_TRY_LOCK_ALL_FOR(layer, timeout, ...) _SYNCOPE_TRY_LOCK_IMPL(layer, try_synchronize_all, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), timeout, __VA_ARGS__)
+#define SYNCOPE_TRY_LOCK_READ(layer, ptr) _SYNCOPE_TRY_LOCK_IMPL(layer, try_synchronize_read, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr)
+#define SYNCOPE_TRY_LOCK_READ_FOR(layer, timeout, ptr) _SYNCOPE_TRY_LOCK_IMPL(layer, try_synchronize_read, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), timeout, ptr)
+#define SYNCOPE_TRY_LOCK_WRITE(layer, ptr) _SYNCOPE_TRY_LOCK_IMPL(layer, try_synchronize_write, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), ptr)
+#define SYNCOPE_TRY_LOCK_WRITE_FOR(layer, timeout, ptr) _SYNCOPE_TRY_LOCK_IMPL(layer, try_synchronize_write, __FILE__ ":" SYNCOPE_STRINGIFY(__LINE__), timeout, ptr)
+
 #else
 
 #define SYNCOPE_LOCK(layer, ptr)  auto __scope_lock_guard_##layer = layer.synchronize(ptr);
@@ -527,6 +7270,46 @@ namespace detail {
 
 #define SYNCOPE_LOCK_WRITE(layer, ptr) auto __scope_lock_guard_##layer = layer.synchronize_write(ptr);
 
+#define SYNCOPE_LOCK_READ_ALL(layer, ...) auto __scope_lock_guard_##layer = layer.synchronize_read_all(__VA_ARGS__);
+
+#define SYNCOPE_LOCK_WRITE_ALL(layer, ...) auto __scope_lock_guard_##layer = layer.synchronize_write_all(__VA_ARGS__);
+
+#define SYNCOPE_LOCK_RANGE(layer, begin, end) auto __scope_lock_guard_##layer = layer.synchronize_range(begin, end);
+#define SYNCOPE_LOCK_READ_RANGE(layer, begin, end) auto __scope_lock_guard_##layer = layer.synchronize_read_range(begin, end);
+#define SYNCOPE_LOCK_WRITE_RANGE(layer, begin, end) auto __scope_lock_guard_##layer = layer.synchronize_write_range(begin, end);
+
+#define SYNCOPE_LOCK_LAYER(layer) auto __scope_lock_guard_##layer = layer.synchronize_layer();
+#define SYNCOPE_LOCK_LAYER_SHARED(layer) auto __scope_lock_guard_##layer = layer.synchronize_layer_shared();
+
+#define SYNCOPE_LOCK_UPGRADE(layer, ptr) auto __scope_lock_guard_##layer = layer.synchronize_upgrade(ptr);
+
+#define SYNCOPE_LOCK_NESTED(outer, layer, ptr) auto __scope_lock_guard_##layer = layer.synchronize(__scope_lock_guard_##outer.token(), ptr);
+#define SYNCOPE_LOCK_READ_NESTED(outer, layer, ptr) auto __scope_lock_guard_##layer = layer.synchronize_read(__scope_lock_guard_##outer.token(), ptr);
+#define SYNCOPE_LOCK_WRITE_NESTED(outer, layer, ptr) auto __scope_lock_guard_##layer = layer.synchronize_write(__scope_lock_guard_##outer.token(), ptr);
+
+#define SYNCOPE_EXECUTE(layer, ptr, ...) layer.execute(ptr, __VA_ARGS__)
+#define SYNCOPE_EXECUTE_ASYNC(layer, ptr, ...) layer.execute_async(ptr, __VA_ARGS__)
+
+#define SYNCOPE_LOCK_ASYNC(layer, executor, ptr) auto __scope_lock_guard_##layer = co_await layer.lock_async(executor, ptr);
+#define SYNCOPE_LOCK_ALL_ASYNC(layer, executor, ...) auto __scope_lock_guard_##layer = co_await layer.lock_all_async(executor, __VA_ARGS__);
+#define SYNCOPE_LOCK_READ_ASYNC(layer, executor, ptr) auto __scope_lock_guard_##layer = co_await layer.lock_read_async(executor, ptr);
+#define SYNCOPE_LOCK_WRITE_ASYNC(layer, executor, ptr) auto __scope_lock_guard_##layer = co_await layer.lock_write_async(executor, ptr);
+
+#define SYNCOPE_TRY_LOCK(layer, ptr) auto __scope_lock_guard_##layer = layer.try_synchronize(ptr)
+#define SYNCOPE_TRY_LOCK_FOR(layer, timeout, ptr) auto __scope_lock_guard_##layer = layer.try_synchronize(timeout, ptr)
+#define SYNCOPE_TRY_LOCK_ALL(layer, ...) auto __scope_lock_guard_##layer = layer.try_synchronize_all(__VA_ARGS__)
+#define SYNCOPE_TRY_LOCK_ALL_FOR(layer, timeout, ...) auto __scope_lock_guard_##layer = layer.try_synchronize_all(timeout, __VA_ARGS__)
+#define SYNCOPE_TRY_LOCK_READ(layer, ptr) auto __scope_lock_guard_##layer = layer.try_synchronize_read(ptr)
+#define SYNCOPE_TRY_LOCK_READ_FOR(layer, timeout, ptr) auto __scope_lock_guard_##layer = layer.try_synchronize_read(timeout, ptr)
+#define SYNCOPE_TRY_LOCK_WRITE(layer, ptr) auto __scope_lock_guard_##layer = layer.try_synchronize_write(ptr)
+#define SYNCOPE_TRY_LOCK_WRITE_FOR(layer, timeout, ptr) auto __scope_lock_guard_##layer = layer.try_synchronize_write(timeout, ptr)
+
 #endif
 
+#define SYNCOPE_WAIT(layer, ptr, pred) layer.wait(__scope_lock_guard_##layer, ptr, pred)
+#define SYNCOPE_WAIT_FOR(layer, timeout, ptr, pred) layer.wait_for(__scope_lock_guard_##layer, ptr, timeout, pred)
+
+#define SYNCOPE_UPGRADE(layer) __scope_lock_guard_##layer.upgrade()
+#define SYNCOPE_DOWNGRADE(layer) __scope_lock_guard_##layer.downgrade()
+
 #endif